@@ -0,0 +1,326 @@
+/*
+ *	Top users/processes display for Unix
+ *
+ *	Copyright (c) 2007-2019, Mark Wong
+ */
+
+/*
+ *	This file times the Linux collector against a synthetic proc
+ *	filesystem and the stand-in libpq in libpq_stub.c, so regressions can
+ *	be tracked without PostgreSQL, root or a busy machine.  The machine
+ *	module is compiled in here rather than linked so its static routines,
+ *	read_one_proc_stat() among them, can be timed on their own.
+ *
+ *	usage: pg_top_bench [-n backends] [-i iterations] [-j threads]
+ *						[-s rounds]
+ *
+ *	Each line of output is the name of what was timed, how many times it
+ *	ran and the microseconds it took on average.  With -s the collector
+ *	also refreshes "rounds" more times while backends exit and start
+ *	between refreshes, the way they do behind a connection pooler.  The
+ *	exit status is 1 if the collector did not see every backend, or if
+ *	what it keeps grew with the churn.
+ */
+
+#include "machine/m_linux.c"
+
+#include <dirent.h>
+#include <getopt.h>
+#include <stdarg.h>
+
+#include "display.h"
+#include "pg_top.h"
+#include "bench.h"
+
+/* What pg_top.c would otherwise provide. */
+char	   *myname = "pg_top_bench";
+int			mode_stats = STATS_DIFF;
+int			collector_threads = 1;
+char	   *proc_root = NULL;
+
+void
+new_message(int type, char *msgfmt,...)
+{
+	va_list		ap;
+
+	va_start(ap, msgfmt);
+	vfprintf(stderr, msgfmt, ap);
+	va_end(ap);
+	fputc('\n', stderr);
+}
+
+static double
+bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static void
+bench_report(const char *name, int calls, double usec)
+{
+	printf("%-28s %8d calls %12.3f us/call\n", name, calls,
+		   calls > 0 ? usec / calls : 0);
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr,
+			"usage: %s [-n backends] [-i iterations] [-j threads] "
+			"[-s rounds]\n", myname);
+	exit(2);
+}
+
+/* The number of descriptors the benchmark has open, or -1. */
+static int
+bench_open_fds(void)
+{
+	DIR		   *dir;
+	struct dirent *d;
+	int			count = 0;
+
+	if ((dir = opendir("/proc/self/fd")) == NULL)
+		return -1;
+	while ((d = readdir(dir)) != NULL)
+		if (d->d_name[0] != '.')
+			count++;
+	closedir(dir);
+
+	/* not counting the one that was just read */
+	return count - 1;
+}
+
+/*
+ * Refresh "rounds" times, a tenth of the backends exiting and as many new
+ * ones starting before each refresh.  After the first round the tree has
+ * to hold exactly the backends that are left, and the descriptors, the
+ * interned strings and the per-refresh arrays must not grow any further.
+ * Returns 1 if anything grew, 0 otherwise.
+ */
+static int
+bench_soak(const char *root, int nbackends, int rounds,
+		   struct process_select *sel, struct pg_conninfo_ctx *conninfo)
+{
+	struct system_info si;
+	struct procfs_backend b;
+	struct top_proc *n;
+	int			churn = nbackends / 10 > 0 ? nbackends / 10 : 1;
+	int			first_pid = BENCH_FIRST_PID;
+	int			fds = 0;
+	unsigned int interned = 0;
+	int			tree;
+	int			status = 0;
+	double		usec = 0;
+	double		start;
+	int			round;
+	int			i;
+
+	memset(&b, 0, sizeof(b));
+	b.utime = 500;
+	b.stime = 100;
+	b.vsize = 250000000ULL;
+	b.rss = 3000;
+	b.rchar = 1000000;
+	b.wchar = 500000;
+
+	for (round = 0; round < rounds; round++)
+	{
+		for (i = 0; i < churn; i++)
+		{
+			procfs_exit(root, first_pid + i);
+			b.start_time = 200000 + first_pid + nbackends + i;
+			if (procfs_backend(root, first_pid + nbackends + i, &b) == -1)
+				return 1;
+		}
+		first_pid += churn;
+		stub_set_backends(nbackends, first_pid);
+
+		start = bench_now();
+		get_process_info(&si, sel, 0, conninfo, MODE_PROCESSES);
+		usec += bench_now() - start;
+
+		tree = 0;
+		RB_FOREACH(n, pgproc, &head_proc)
+			tree++;
+		if (tree != nbackends || si.p_active != nbackends)
+		{
+			fprintf(stderr, "%s: round %d kept %d entries and saw %d "
+					"backends of %d\n", myname, round, tree, si.p_active,
+					nbackends);
+			status = 1;
+		}
+
+		if (round == 0)
+		{
+			fds = bench_open_fds();
+			interned = interned_count();
+			continue;
+		}
+		if (bench_open_fds() > fds || proc_fds_open > proc_fd_budget)
+		{
+			fprintf(stderr, "%s: round %d has %d descriptors open, %d after "
+					"the first\n", myname, round, bench_open_fds(), fds);
+			status = 1;
+		}
+		if (interned_count() > interned)
+		{
+			fprintf(stderr, "%s: round %d has %u strings interned, %u after "
+					"the first\n", myname, round, interned_count(),
+					interned);
+			status = 1;
+		}
+		if (proc_sample_size > 2 * nbackends || proc_hot.rows > nbackends)
+		{
+			fprintf(stderr, "%s: round %d grew the refresh arrays to %d and "
+					"%d rows\n", myname, round, proc_sample_size,
+					proc_hot.rows);
+			status = 1;
+		}
+	}
+	bench_report("get_process_info (churn)", rounds, usec);
+
+	return status;
+}
+
+int
+main(int argc, char *argv[])
+{
+	char		root[] = "/tmp/pg_top_bench.XXXXXX";
+	struct statics statics;
+	struct system_info si;
+	struct process_select sel;
+	struct pg_conninfo_ctx conninfo;
+	struct top_proc **procs;
+	int			nbackends = 1000;
+	int			iterations = 20;
+	int			rounds = 0;
+	int			status = 0;
+	double		start;
+	int			c;
+	int			i;
+	int			j;
+
+	while ((c = getopt(argc, argv, "n:i:j:s:")) != -1)
+	{
+		switch (c)
+		{
+			case 'n':
+				nbackends = atoi(optarg);
+				break;
+			case 'i':
+				iterations = atoi(optarg);
+				break;
+			case 'j':
+				collector_threads = atoi(optarg);
+				break;
+			case 's':
+				rounds = atoi(optarg);
+				break;
+			default:
+				usage();
+		}
+	}
+	if (nbackends < 1 || iterations < 1 || collector_threads < 1 ||
+		rounds < 0)
+		usage();
+
+	if (mkdtemp(root) == NULL)
+	{
+		fprintf(stderr, "%s: cannot create %s: %s\n", myname, root,
+				strerror(errno));
+		return 1;
+	}
+	start = bench_now();
+	if (procfs_make(root, nbackends, BENCH_FIRST_PID) == -1)
+	{
+		procfs_remove(root);
+		return 1;
+	}
+	stub_set_backends(nbackends, BENCH_FIRST_PID);
+
+	printf("%d backends, %d iterations, %d collector threads\n", nbackends,
+		   iterations, collector_threads);
+	bench_report("procfs_make", 1, bench_now() - start);
+
+	memset(&statics, 0, sizeof(statics));
+	proc_root = root;
+	if (machine_init(&statics) == -1)
+	{
+		procfs_remove(root);
+		return 1;
+	}
+
+	memset(&sel, 0, sizeof(sel));
+	sel.idle = 1;
+	sel.fullcmd = 1;
+	sel.topn = Largest;
+
+	/* one backend at a time, opening the files and then reusing them */
+	procs = malloc(nbackends * sizeof(struct top_proc *));
+	if (procs == NULL)
+	{
+		fprintf(stderr, "malloc error\n");
+		exit(1);
+	}
+	for (i = 0; i < nbackends; i++)
+	{
+		procs[i] = alloc_proc();
+		procs[i]->pid = BENCH_FIRST_PID + i;
+	}
+	start = bench_now();
+	for (i = 0; i < nbackends; i++)
+		read_one_proc_stat(procs[i], &sel);
+	bench_report("read_one_proc_stat (open)", nbackends, bench_now() - start);
+	start = bench_now();
+	for (j = 0; j < iterations; j++)
+		for (i = 0; i < nbackends; i++)
+			read_one_proc_stat(procs[i], &sel);
+	bench_report("read_one_proc_stat", nbackends * iterations,
+				 bench_now() - start);
+	for (i = 0; i < nbackends; i++)
+	{
+		if (procs[i]->state == 0)
+		{
+			fprintf(stderr, "%s: could not read backend %d\n", myname,
+					procs[i]->pid);
+			status = 1;
+		}
+		free_proc(procs[i]);
+	}
+	free(procs);
+
+	start = bench_now();
+	for (j = 0; j < iterations; j++)
+		get_system_info(&si);
+	bench_report("get_system_info", iterations, bench_now() - start);
+
+	/* the whole refresh, the first one finding every backend new */
+	memset(&conninfo, 0, sizeof(conninfo));
+	conninfo.persistent = 1;
+	conninfo.prepares = 1;
+	start = bench_now();
+	get_process_info(&si, &sel, 0, &conninfo, MODE_PROCESSES);
+	bench_report("get_process_info (first)", 1, bench_now() - start);
+	start = bench_now();
+	for (j = 0; j < iterations; j++)
+		get_process_info(&si, &sel, 0, &conninfo, MODE_PROCESSES);
+	bench_report("get_process_info", iterations, bench_now() - start);
+	if (si.p_total != nbackends || si.p_active != nbackends)
+	{
+		fprintf(stderr, "%s: the collector saw %d of %d backends\n", myname,
+				si.p_active, nbackends);
+		status = 1;
+	}
+
+	if (rounds > 0 &&
+		bench_soak(root, nbackends, rounds, &sel, &conninfo) != 0)
+		status = 1;
+
+	if (chdir("/") == -1)
+		perror("chdir");
+	procfs_remove(root);
+	return status;
+}
@@ -0,0 +1,40 @@
+/*
+ * Interface between the pieces of the collector benchmark.
+ *
+ *	Copyright (c) 2007-2019, Mark Wong
+ */
+
+#ifndef _BENCH_H_
+#define _BENCH_H_
+
+/* The pid of the first synthetic backend, the rest follow on from it. */
+#define BENCH_FIRST_PID	10000
+
+/* What procfs_backend() writes for one backend. */
+struct procfs_backend
+{
+	unsigned long utime;		/* in ticks */
+	unsigned long stime;
+	unsigned long start_time;	/* in ticks after boot */
+	unsigned long long vsize;	/* in bytes */
+	long		rss;			/* in pages */
+	long long	rchar;
+	long long	wchar;
+	long long	syscr;
+	long long	syscw;
+	long long	read_bytes;
+	long long	write_bytes;
+	long long	cancelled_write_bytes;
+};
+
+/* procfs.c */
+int			procfs_backend(const char *, int, const struct procfs_backend *);
+int			procfs_make(const char *, int, int);
+void		procfs_exit(const char *, int);
+void		procfs_remove(const char *);
+
+/* libpq_stub.c */
+void		stub_set_backends(int, int);
+int			stub_restart_backend(int, long long);
+
+#endif							/* _BENCH_H_ */
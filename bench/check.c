@@ -0,0 +1,303 @@
+/*
+ *	Top users/processes display for Unix
+ *
+ *	Copyright (c) 2007-2019, Mark Wong
+ */
+
+/*
+ *	This file checks the per-backend deltas of the Linux collector against
+ *	a proc filesystem built from fixed values.  It refreshes once, moves
+ *	the counters of each backend on by a known amount and refreshes again,
+ *	so the cpu share and the i/o differences are known exactly, and gives
+ *	one pid to a new backend to see that what was read about the old one
+ *	is forgotten.  Like the benchmark it compiles the machine module in.
+ *
+ *	usage: pg_top_check
+ *
+ *	Every difference from what was expected is reported, and the exit
+ *	status is 1 if there was any.
+ */
+
+#include "machine/m_linux.c"
+
+#include <math.h>
+#include <stdarg.h>
+
+#include "display.h"
+#include "pg_top.h"
+#include "bench.h"
+
+/* What pg_top.c would otherwise provide. */
+char	   *myname = "pg_top_check";
+int			mode_stats = STATS_DIFF;
+int			collector_threads = 1;
+char	   *proc_root = NULL;
+
+/* The backends of the fixture. */
+#define CHECK_STEADY	BENCH_FIRST_PID /* runs on */
+#define CHECK_REUSED	(BENCH_FIRST_PID + 1)	/* pid goes to a new backend */
+#define CHECK_QUIET		(BENCH_FIRST_PID + 2)	/* does nothing */
+#define CHECK_BACKENDS	3
+
+static int	failures = 0;
+
+void
+new_message(int type, char *msgfmt,...)
+{
+	va_list		ap;
+
+	va_start(ap, msgfmt);
+	vfprintf(stderr, msgfmt, ap);
+	va_end(ap);
+	fputc('\n', stderr);
+}
+
+static void
+check_failed(const char *fmt,...)
+{
+	va_list		ap;
+
+	fprintf(stderr, "%s: ", myname);
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	fputc('\n', stderr);
+	failures++;
+}
+
+/* The fixture values of backend "i" at the start. */
+static void
+check_initial(struct procfs_backend *b, int i)
+{
+	memset(b, 0, sizeof(*b));
+	b->utime = 1000 + i * 100;
+	b->stime = 200 + i * 10;
+	b->start_time = 5000 + i;
+	b->vsize = 250000000ULL;
+	b->rss = 3000;
+	b->rchar = 1000000 + i;
+	b->wchar = 500000 + i;
+	b->syscr = 2000 + i;
+	b->syscw = 1000 + i;
+	b->read_bytes = 40960 + i;
+	b->write_bytes = 81920 + i;
+	b->cancelled_write_bytes = 4096 + i;
+}
+
+/* Move every counter of "b" on by "step", the cpu time by "ticks". */
+static void
+check_advance(struct procfs_backend *b, unsigned long ticks, long long step)
+{
+	b->utime += ticks - ticks / 4;
+	b->stime += ticks / 4;
+	b->rchar += step;
+	b->wchar += step * 2;
+	b->syscr += step * 3;
+	b->syscw += step * 4;
+	b->read_bytes += step * 5;
+	b->write_bytes += step * 6;
+	b->cancelled_write_bytes += step * 7;
+}
+
+static struct top_proc *
+check_find(int pid)
+{
+	struct top_proc key;
+	struct top_proc *proc;
+
+	key.pid = pid;
+	if ((proc = RB_FIND(pgproc, &head_proc, &key)) == NULL)
+		check_failed("backend %d is not in the tree", pid);
+	return proc;
+}
+
+static void
+check_io(const char *when, struct top_proc *proc, const char *name,
+		 long long got, long long expected)
+{
+	if (got != expected)
+		check_failed("%s: backend %d %s changed by %lld, expected %lld",
+					 when, proc->pid, name, got, expected);
+}
+
+/* Check that backend "pid" used "ticks" of cpu since the last refresh. */
+static void
+check_cpu(const char *when, int pid, unsigned long ticks)
+{
+	struct top_proc *proc;
+	double		used;
+
+	if ((proc = check_find(pid)) == NULL)
+		return;
+
+	/* pcpu is the ticks used over the ticks that passed */
+	used = proc->pcpu * timediff;
+	if (fabs(used - ticks) > 1e-6 * (ticks + 1))
+		check_failed("%s: backend %d used %g ticks, expected %lu", when, pid,
+					 used, ticks);
+}
+
+/*
+ * Check that backend "pid" used "ticks" of cpu and that its i/o counters
+ * moved by "step" times the multiples check_advance() uses.
+ */
+static void
+check_deltas(const char *when, int pid, unsigned long ticks, long long step)
+{
+	struct top_proc *proc;
+
+	check_cpu(when, pid, ticks);
+	if ((proc = check_find(pid)) == NULL)
+		return;
+
+	check_io(when, proc, "rchar", proc->diff_rchar, step);
+	check_io(when, proc, "wchar", proc->diff_wchar, step * 2);
+	check_io(when, proc, "syscr", proc->diff_syscr, step * 3);
+	check_io(when, proc, "syscw", proc->diff_syscw, step * 4);
+	check_io(when, proc, "read_bytes", proc->diff_read_bytes, step * 5);
+	check_io(when, proc, "write_bytes", proc->diff_write_bytes, step * 6);
+	check_io(when, proc, "cancelled_write_bytes",
+			 proc->diff_cancelled_write_bytes, step * 7);
+}
+
+/* Check that backend "pid" reports all of its counters "b" as the change. */
+static void
+check_counted_from_zero(const char *when, int pid,
+						const struct procfs_backend *b)
+{
+	struct top_proc *proc;
+
+	if ((proc = check_find(pid)) == NULL)
+		return;
+
+	check_io(when, proc, "rchar", proc->diff_rchar, b->rchar);
+	check_io(when, proc, "wchar", proc->diff_wchar, b->wchar);
+	check_io(when, proc, "syscr", proc->diff_syscr, b->syscr);
+	check_io(when, proc, "syscw", proc->diff_syscw, b->syscw);
+	check_io(when, proc, "read_bytes", proc->diff_read_bytes, b->read_bytes);
+	check_io(when, proc, "write_bytes", proc->diff_write_bytes,
+			 b->write_bytes);
+	check_io(when, proc, "cancelled_write_bytes",
+			 proc->diff_cancelled_write_bytes, b->cancelled_write_bytes);
+}
+
+/* Refresh, leaving some time since the last one so the cpu share is sane. */
+static void
+check_refresh(struct system_info *si, struct process_select *sel,
+			  struct pg_conninfo_ctx *conninfo)
+{
+	struct timespec pause = {0, 20000000};
+
+	nanosleep(&pause, NULL);
+	get_process_info(si, sel, 0, conninfo, MODE_PROCESSES);
+	if (si->p_total != CHECK_BACKENDS)
+		check_failed("the collector saw %d of %d backends", si->p_total,
+					 CHECK_BACKENDS);
+}
+
+int
+main(int argc, char *argv[])
+{
+	char		root[] = "/tmp/pg_top_check.XXXXXX";
+	struct procfs_backend b[CHECK_BACKENDS];
+	struct statics statics;
+	struct system_info si;
+	struct process_select sel;
+	struct pg_conninfo_ctx conninfo;
+	int			i;
+
+	if (mkdtemp(root) == NULL)
+	{
+		fprintf(stderr, "%s: cannot create %s: %s\n", myname, root,
+				strerror(errno));
+		return 1;
+	}
+	if (procfs_make(root, 0, BENCH_FIRST_PID) == -1)
+	{
+		procfs_remove(root);
+		return 1;
+	}
+	for (i = 0; i < CHECK_BACKENDS; i++)
+	{
+		check_initial(&b[i], i);
+		if (procfs_backend(root, BENCH_FIRST_PID + i, &b[i]) == -1)
+		{
+			procfs_remove(root);
+			return 1;
+		}
+	}
+	stub_set_backends(CHECK_BACKENDS, BENCH_FIRST_PID);
+
+	memset(&statics, 0, sizeof(statics));
+	proc_root = root;
+	if (machine_init(&statics) == -1)
+	{
+		procfs_remove(root);
+		return 1;
+	}
+
+	memset(&sel, 0, sizeof(sel));
+	sel.idle = 1;
+	sel.fullcmd = 1;
+	sel.topn = Largest;
+	memset(&conninfo, 0, sizeof(conninfo));
+	conninfo.persistent = 1;
+	conninfo.prepares = 1;
+
+	/* the first refresh finds every backend new */
+	check_refresh(&si, &sel, &conninfo);
+	for (i = 0; i < CHECK_BACKENDS; i++)
+		check_counted_from_zero("first refresh", BENCH_FIRST_PID + i, &b[i]);
+
+	/*
+	 * One backend does some work, another exits and its pid is given to a
+	 * new backend with less to its name, the last does nothing.
+	 */
+	check_advance(&b[0], 40, 1000);
+	check_initial(&b[1], 1);
+	b[1].utime = 7;
+	b[1].stime = 3;
+	b[1].start_time += 100000;
+	b[1].rchar = 10;
+	b[1].wchar = 20;
+	b[1].syscr = 3;
+	b[1].syscw = 4;
+	b[1].read_bytes = 0;
+	b[1].write_bytes = 8192;
+	b[1].cancelled_write_bytes = 0;
+	if (procfs_backend(root, CHECK_STEADY, &b[0]) == -1 ||
+		procfs_backend(root, CHECK_REUSED, &b[1]) == -1 ||
+		stub_restart_backend(CHECK_REUSED, 1800000000000000LL) == -1)
+	{
+		procfs_remove(root);
+		return 1;
+	}
+	check_refresh(&si, &sel, &conninfo);
+	check_deltas("second refresh", CHECK_STEADY, 40, 1000);
+	check_deltas("second refresh", CHECK_QUIET, 0, 0);
+	check_counted_from_zero("second refresh", CHECK_REUSED, &b[1]);
+	check_cpu("second refresh", CHECK_REUSED, 10);
+
+	/* the new backend is compared with itself from now on */
+	check_advance(&b[0], 8, 1);
+	check_advance(&b[1], 20, 500);
+	if (procfs_backend(root, CHECK_STEADY, &b[0]) == -1 ||
+		procfs_backend(root, CHECK_REUSED, &b[1]) == -1)
+	{
+		procfs_remove(root);
+		return 1;
+	}
+	check_refresh(&si, &sel, &conninfo);
+	check_deltas("third refresh", CHECK_STEADY, 8, 1);
+	check_deltas("third refresh", CHECK_REUSED, 20, 500);
+	check_deltas("third refresh", CHECK_QUIET, 0, 0);
+
+	if (chdir("/") == -1)
+		perror("chdir");
+	procfs_remove(root);
+
+	if (failures > 0)
+		return 1;
+	printf("%s: ok\n", myname);
+	return 0;
+}
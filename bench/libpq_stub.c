@@ -0,0 +1,260 @@
+/*
+ *	Top users/processes display for Unix
+ *
+ *	Copyright (c) 2007-2019, Mark Wong
+ */
+
+/*
+ *	This file stands in for libpq in the collector benchmark.  Every
+ *	connection succeeds and the query for the processes returns the rows
+ *	set up with stub_set_backends(), in the columns pg.c asks for, so the
+ *	whole of get_process_info() runs without a server.  Results are never
+ *	freed, PQclear() leaves them for the next refresh.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libpq-fe.h>
+
+#include "bench.h"
+
+/* The columns of the process query. */
+#define PROCESS_COLUMNS 9
+
+struct pg_conn
+{
+	int			pending;		/* a query was sent, its result not taken */
+};
+
+struct pg_result
+{
+	ExecStatusType status;
+	int			ntuples;
+	int			nfields;
+	char	  **values;			/* ntuples rows of nfields each */
+};
+
+static struct pg_conn conn;
+static PGresult command_ok = {PGRES_COMMAND_OK, 0, 0, NULL};
+static PGresult processes = {PGRES_TUPLES_OK, 0, PROCESS_COLUMNS, NULL};
+
+static char *
+stub_strdup(const char *s)
+{
+	char	   *p;
+
+	if ((p = strdup(s)) == NULL)
+	{
+		fprintf(stderr, "strdup error\n");
+		exit(1);
+	}
+	return p;
+}
+
+/*
+ * Make the process query return "nbackends" rows for the pids from
+ * "first_pid" on: a mix of users, databases and states, each backend
+ * keeping the same start time so none looks like a reused pid.
+ */
+void
+stub_set_backends(int nbackends, int first_pid)
+{
+	static const char *states[] = {"idle", "active", "idle in transaction"};
+	char		buf[64];
+	char	  **values;
+	char	  **v;
+	int			i;
+
+	/* the previous rows go, the collector has copied what it needs */
+	if (processes.values != NULL)
+	{
+		for (i = 0; i < processes.ntuples * PROCESS_COLUMNS; i++)
+			free(processes.values[i]);
+		free(processes.values);
+	}
+
+	values = calloc((size_t) nbackends * PROCESS_COLUMNS, sizeof(char *));
+	if (values == NULL)
+	{
+		fprintf(stderr, "calloc error\n");
+		exit(1);
+	}
+
+	for (i = 0; i < nbackends; i++)
+	{
+		v = values + (size_t) i * PROCESS_COLUMNS;
+		snprintf(buf, sizeof(buf), "%d", first_pid + i);
+		v[0] = stub_strdup(buf);
+		snprintf(buf, sizeof(buf), "SELECT * FROM t%d WHERE id = $1", i % 50);
+		v[1] = stub_strdup(buf);
+		v[2] = stub_strdup(states[i % 3]);
+		snprintf(buf, sizeof(buf), "user%d", i % 8);
+		v[3] = stub_strdup(buf);
+		snprintf(buf, sizeof(buf), "%d", i % 600);
+		v[4] = stub_strdup(buf);
+		snprintf(buf, sizeof(buf), "%d", i % 60);
+		v[5] = stub_strdup(buf);
+		snprintf(buf, sizeof(buf), "%d", i % 7);
+		v[6] = stub_strdup(buf);
+		snprintf(buf, sizeof(buf), "%lld", 1700000000000000LL + i);
+		v[7] = stub_strdup(buf);
+		snprintf(buf, sizeof(buf), "db%d", i % 4);
+		v[8] = stub_strdup(buf);
+	}
+
+	processes.values = values;
+	processes.ntuples = nbackends;
+}
+
+/*
+ * Give backend "pid" a different start time, as if it had exited and a new
+ * backend had been given the same pid.  Returns -1 if there is no such
+ * backend.
+ */
+int
+stub_restart_backend(int pid, long long backend_start)
+{
+	char		buf[64];
+	char	  **v;
+	int			i;
+
+	for (i = 0; i < processes.ntuples; i++)
+	{
+		v = processes.values + (size_t) i * PROCESS_COLUMNS;
+		if (atoi(v[0]) != pid)
+			continue;
+		snprintf(buf, sizeof(buf), "%lld", backend_start);
+		free(v[7]);
+		v[7] = stub_strdup(buf);
+		return 0;
+	}
+	return -1;
+}
+
+PGconn *
+PQconnectdbParams(const char *const *keywords, const char *const *values,
+				  int expand_dbname)
+{
+	return &conn;
+}
+
+ConnStatusType
+PQstatus(const PGconn *pgconn)
+{
+	return CONNECTION_OK;
+}
+
+int
+PQconsumeInput(PGconn *pgconn)
+{
+	return 1;
+}
+
+char *
+PQerrorMessage(const PGconn *pgconn)
+{
+	return "";
+}
+
+void
+PQfinish(PGconn *pgconn)
+{
+}
+
+void
+PQreset(PGconn *pgconn)
+{
+}
+
+int
+PQserverVersion(const PGconn *pgconn)
+{
+	return 170000;
+}
+
+PGresult *
+PQexec(PGconn *pgconn, const char *query)
+{
+	return &command_ok;
+}
+
+PGresult *
+PQexecParams(PGconn *pgconn, const char *command, int nParams,
+			 const Oid *paramTypes, const char *const *paramValues,
+			 const int *paramLengths, const int *paramFormats,
+			 int resultFormat)
+{
+	return &command_ok;
+}
+
+PGresult *
+PQprepare(PGconn *pgconn, const char *stmtName, const char *query,
+		  int nParams, const Oid *paramTypes)
+{
+	return &command_ok;
+}
+
+PGresult *
+PQexecPrepared(PGconn *pgconn, const char *stmtName, int nParams,
+			   const char *const *paramValues, const int *paramLengths,
+			   const int *paramFormats, int resultFormat)
+{
+	return &processes;
+}
+
+int
+PQsendQueryPrepared(PGconn *pgconn, const char *stmtName, int nParams,
+					const char *const *paramValues, const int *paramLengths,
+					const int *paramFormats, int resultFormat)
+{
+	pgconn->pending = 1;
+	return 1;
+}
+
+PGresult *
+PQgetResult(PGconn *pgconn)
+{
+	if (!pgconn->pending)
+		return NULL;
+	pgconn->pending = 0;
+	return &processes;
+}
+
+void
+PQclear(PGresult *res)
+{
+}
+
+ExecStatusType
+PQresultStatus(const PGresult *res)
+{
+	return res->status;
+}
+
+int
+PQntuples(const PGresult *res)
+{
+	return res->ntuples;
+}
+
+char *
+PQgetvalue(const PGresult *res, int tup_num, int field_num)
+{
+	if (tup_num >= res->ntuples || field_num >= res->nfields)
+		return "";
+	return res->values[tup_num * res->nfields + field_num];
+}
+
+int
+PQgetlength(const PGresult *res, int tup_num, int field_num)
+{
+	return strlen(PQgetvalue(res, tup_num, field_num));
+}
+
+int
+PQfformat(const PGresult *res, int field_num)
+{
+	return 0;
+}
@@ -0,0 +1,185 @@
+/*
+ *	Top users/processes display for Unix
+ *
+ *	Copyright (c) 2007-2019, Mark Wong
+ */
+
+/*
+ *	This file builds the synthetic proc filesystem the collector benchmark
+ *	reads with --proc-root.  It has the system wide files the Linux machine
+ *	module opens and a stat, cmdline and io file for each backend, laid
+ *	out and filled in the way the kernel does it.  Backends can be
+ *	rewritten, added and removed between refreshes.
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include <errno.h>
+#include <ftw.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "bench.h"
+
+/* Write "len" bytes of "data" to root/name.  Returns -1 on failure. */
+static int
+put_file(const char *root, const char *name, const char *data, size_t len)
+{
+	char		path[1024];
+	FILE	   *f;
+	int			ok;
+
+	snprintf(path, sizeof(path), "%s/%s", root, name);
+	if ((f = fopen(path, "w")) == NULL)
+	{
+		fprintf(stderr, "cannot create %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	ok = fwrite(data, 1, len, f) == len;
+	if (fclose(f) != 0 || !ok)
+	{
+		fprintf(stderr, "cannot write %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+static int
+put_string(const char *root, const char *name, const char *data)
+{
+	return put_file(root, name, data, strlen(data));
+}
+
+static const char stat_file[] =
+"cpu  123456 789 45678 9876543 2345 0 678 0 0 0\n"
+"cpu0 61728 394 22839 4938271 1172 0 339 0 0 0\n"
+"cpu1 61728 395 22839 4938272 1173 0 339 0 0 0\n"
+"intr 0\n"
+"ctxt 123456789\n"
+"btime 1700000000\n"
+"processes 123456\n"
+"procs_running 2\n"
+"procs_blocked 0\n";
+
+static const char meminfo_file[] =
+"MemTotal:       16318496 kB\n"
+"MemFree:         1234567 kB\n"
+"MemAvailable:    9876543 kB\n"
+"Buffers:          234567 kB\n"
+"Cached:          7654321 kB\n"
+"SwapCached:            0 kB\n"
+"Shmem:            345678 kB\n"
+"SwapTotal:       2097148 kB\n"
+"SwapFree:        2097148 kB\n";
+
+/*
+ * Write the stat, cmdline and io files of backend "pid" under "root" from
+ * "b", creating its directory if need be.  Rewriting a backend that is
+ * already there changes its files in place, as the kernel does, so that
+ * descriptors the collector kept open see the new values.  Returns -1 on
+ * failure.
+ */
+int
+procfs_backend(const char *root, int pid, const struct procfs_backend *b)
+{
+	char		dir[1024];
+	char		buf[1024];
+	int			len;
+
+	snprintf(dir, sizeof(dir), "%s/%d", root, pid);
+	if (mkdir(dir, 0755) == -1 && errno != EEXIST)
+	{
+		fprintf(stderr, "cannot create %s: %s\n", dir, strerror(errno));
+		return -1;
+	}
+
+	snprintf(buf, sizeof(buf),
+			 "%d (postgres) S 1 %d %d 0 -1 4194560 %d 0 0 0 %lu %lu 0 0 "
+			 "20 0 1 0 %lu %llu %ld 18446744073709551615 1 1 0 0 0 0 "
+			 "4194304 6 1 0 0 0 17 %d 0 0 0 0 0\n",
+			 pid, pid, pid, 1000 + pid % 1000, b->utime, b->stime,
+			 b->start_time, b->vsize, b->rss, pid % 8);
+	if (put_string(dir, "stat", buf) == -1)
+		return -1;
+
+	/* the arguments are separated by nul bytes, the last one too */
+	len = snprintf(buf, sizeof(buf),
+				   "postgres: user%d db%d 127.0.0.1(%d) idle", pid % 8,
+				   pid % 4, 40000 + pid % 20000);
+	if (put_file(dir, "cmdline", buf, len + 1) == -1)
+		return -1;
+
+	snprintf(buf, sizeof(buf),
+			 "rchar: %lld\nwchar: %lld\nsyscr: %lld\nsyscw: %lld\n"
+			 "read_bytes: %lld\nwrite_bytes: %lld\n"
+			 "cancelled_write_bytes: %lld\n",
+			 b->rchar, b->wchar, b->syscr, b->syscw, b->read_bytes,
+			 b->write_bytes, b->cancelled_write_bytes);
+	return put_string(dir, "io", buf);
+}
+
+/*
+ * Build a proc filesystem with "nbackends" backends under "root", which
+ * has to exist, numbered from "first_pid".  Returns -1 on failure.
+ */
+int
+procfs_make(const char *root, int nbackends, int first_pid)
+{
+	struct procfs_backend b;
+	int			i;
+
+	if (put_string(root, "uptime", "123456.78 234567.89\n") == -1 ||
+		put_string(root, "loadavg", "0.52 0.58 0.59 3/1234 56789\n") == -1 ||
+		put_string(root, "stat", stat_file) == -1 ||
+		put_string(root, "meminfo", meminfo_file) == -1)
+		return -1;
+
+	for (i = 0; i < nbackends; i++)
+	{
+		b.utime = 500 + i % 997;
+		b.stime = 100 + i % 97;
+		b.start_time = 123400 + i;
+		b.vsize = 250000000ULL + i * 4096ULL;
+		b.rss = 3000 + i % 5000;
+		b.rchar = 1000000 + i;
+		b.wchar = 500000 + i;
+		b.syscr = 2000 + i;
+		b.syscw = 1000 + i;
+		b.read_bytes = 4096LL * i;
+		b.write_bytes = 8192LL * i;
+		b.cancelled_write_bytes = 0;
+		if (procfs_backend(root, first_pid + i, &b) == -1)
+			return -1;
+	}
+
+	return 0;
+}
+
+static int
+remove_one(const char *path, const struct stat *sb, int flag,
+		   struct FTW *ftwbuf)
+{
+	if (remove(path) == -1)
+		fprintf(stderr, "cannot remove %s: %s\n", path, strerror(errno));
+	return 0;
+}
+
+/* Remove backend "pid" from under "root", as when it exits. */
+void
+procfs_exit(const char *root, int pid)
+{
+	char		dir[1024];
+
+	snprintf(dir, sizeof(dir), "%s/%d", root, pid);
+	procfs_remove(dir);
+}
+
+/* Remove "root" and everything under it. */
+void
+procfs_remove(const char *root)
+{
+	nftw(root, remove_one, 16, FTW_DEPTH | FTW_PHYS);
+}
@@ -35,6 +35,8 @@
 #include "help.h"
 #include "display.h"
 #include "pg.h"
+#include "record.h"
+#include "relstats.h"
 #include "commands.h"
 #include "screen.h"
 
@@ -49,11 +51,18 @@ extern int	max_topn;
 
 #define BEGIN "BEGIN;"
 #define ROLLBACK "ROLLBACK;"
+#define NO_TIMEOUT "SET LOCAL statement_timeout = 0;"
 
 struct cmd	cmd_map[] = {
 	{'\014', cmd_redraw},
 	{'#', cmd_number},
 	{' ', cmd_update},
+	{'+', cmd_faster},
+	{',', cmd_step_back},
+	{'-', cmd_slower},
+	{'.', cmd_step_forward},
+	{'<', cmd_seek_back},
+	{'>', cmd_seek_forward},
 	{'?', cmd_help},
 	{'A', cmd_explain_analyze},
 	{'a', cmd_activity},
@@ -69,12 +78,16 @@ struct cmd	cmd_map[] = {
 	{'L', cmd_locks},
 	{'n', cmd_number},
 	{'o', cmd_order},
+	{'p', cmd_pause},
 	{'q', cmd_quit},
 	{'R', cmd_replication},
 	{'Q', cmd_current_query},
+	{'S', cmd_statements},
 	{'s', cmd_delay},
+	{'T', cmd_tables},
 	{'t', cmd_toggle},
 	{'u', cmd_user},
+	{'X', cmd_indexes},
 	{'\0', NULL},
 };
 
@@ -156,7 +169,7 @@ cmd_current_query(struct pg_top_context *pgtctx)
 	newval = readline(tempbuf1, 8, Yes);
 	reset_display(pgtctx);
 	display_pagerstart();
-	show_current_query(&pgtctx->conninfo, newval);
+	show_current_query(&pgtctx->cmd_conninfo, newval);
 	display_pagerend();
 	return No;
 }
@@ -164,16 +177,19 @@ cmd_current_query(struct pg_top_context *pgtctx)
 int
 cmd_delay(struct pg_top_context *pgtctx)
 {
-	int			i;
+	double		delay;
 	char		tempbuf[50];
 
 	new_message(MT_standout, "Seconds to delay: ");
-	if ((i = readline(tempbuf, 8, Yes)) > -1)
+	if (readline(tempbuf, 8, No) > 0)
 	{
-		if ((pgtctx->delay = i) == 0 && getuid() != 0)
+		if ((delay = atodelay(tempbuf)) == Invalid)
 		{
-			pgtctx->delay = 1;
+			new_message(MT_standout, " Bad seconds delay");
+			putchar('\r');
+			return Yes;
 		}
+		pgtctx->delay = delay;
 	}
 	clear_message();
 	return No;
@@ -209,7 +225,7 @@ cmd_explain(struct pg_top_context *pgtctx)
 	newval = readline(tempbuf1, 8, Yes);
 	reset_display(pgtctx);
 	display_pagerstart();
-	show_explain(&pgtctx->conninfo, newval, EXPLAIN);
+	show_explain(&pgtctx->cmd_conninfo, newval, EXPLAIN);
 	display_pagerend();
 	return No;
 }
@@ -224,11 +240,32 @@ cmd_explain_analyze(struct pg_top_context *pgtctx)
 	newval = readline(tempbuf1, 8, Yes);
 	reset_display(pgtctx);
 	display_pagerstart();
-	show_explain(&pgtctx->conninfo, newval, EXPLAIN_ANALYZE);
+	show_explain(&pgtctx->cmd_conninfo, newval, EXPLAIN_ANALYZE);
 	display_pagerend();
 	return No;
 }
 
+/* Commands that move around a recording need one to be replaying. */
+static int
+not_replaying(void)
+{
+	if (replaying())
+		return No;
+	new_message(MT_standout, " Only available when replaying a recording");
+	putchar('\r');
+	return Yes;
+}
+
+int
+cmd_faster(struct pg_top_context *pgtctx)
+{
+	if (not_replaying())
+		return Yes;
+	new_message(MT_standout | MT_delayed, " Replaying at %gx",
+				replay_speed(2));
+	return No;
+}
+
 int
 cmd_help(struct pg_top_context *pgtctx)
 {
@@ -249,6 +286,16 @@ cmd_idletog(struct pg_top_context *pgtctx)
 	return No;
 }
 
+int
+cmd_indexes(struct pg_top_context *pgtctx)
+{
+	pgtctx->mode = MODE_INDEX_STATS;
+	pgtctx->header_text =
+		pgtctx->header_options[pgtctx->mode_remote][pgtctx->mode];
+	reset_display(pgtctx);
+	return No;
+}
+
 int
 cmd_io(struct pg_top_context *pgtctx)
 {
@@ -269,7 +316,7 @@ cmd_locks(struct pg_top_context *pgtctx)
 	newval = readline(tempbuf1, 8, Yes);
 	reset_display(pgtctx);
 	display_pagerstart();
-	show_locks(&pgtctx->conninfo, newval);
+	show_locks(&pgtctx->cmd_conninfo, newval);
 	display_pagerend();
 	return No;
 }
@@ -308,6 +355,16 @@ cmd_number(struct pg_top_context *pgtctx)
 	return No;
 }
 
+int
+cmd_pause(struct pg_top_context *pgtctx)
+{
+	if (not_replaying())
+		return Yes;
+	new_message(MT_standout | MT_delayed, replay_pause() ? " Paused" :
+				" Replaying");
+	return No;
+}
+
 int
 cmd_quit(struct pg_top_context *pgtctx)
 {
@@ -351,6 +408,13 @@ cmd_order(struct pg_top_context *pgtctx)
 							tempbuf);
 				no_command = Yes;
 			}
+			else if (!order_applies(&pgtctx->statics, pgtctx->mode, i))
+			{
+				new_message(MT_standout,
+							" %s: not a sorting order for this display",
+							tempbuf);
+				no_command = Yes;
+			}
 			else
 			{
 				pgtctx->order_index = i;
@@ -376,6 +440,11 @@ cmd_order_cpu(struct pg_top_context *pgtctx)
 		putchar('\r');
 		/* no_command = Yes; */
 	}
+	else if (!order_applies(&pgtctx->statics, pgtctx->mode, i))
+	{
+		new_message(MT_standout, " Not a sorting order for this display");
+		putchar('\r');
+	}
 	else
 	{
 		pgtctx->order_index = i;
@@ -394,6 +463,12 @@ cmd_order_mem(struct pg_top_context *pgtctx)
 		putchar('\r');
 		return Yes;
 	}
+	else if (!order_applies(&pgtctx->statics, pgtctx->mode, i))
+	{
+		new_message(MT_standout, " Not a sorting order for this display");
+		putchar('\r');
+		return Yes;
+	}
 	else
 	{
 		pgtctx->order_index = i;
@@ -408,6 +483,72 @@ cmd_redraw(struct pg_top_context *pgtctx)
 	return No;
 }
 
+int
+cmd_seek_back(struct pg_top_context *pgtctx)
+{
+	if (not_replaying())
+		return Yes;
+	replay_seek(-60);
+	return No;
+}
+
+int
+cmd_seek_forward(struct pg_top_context *pgtctx)
+{
+	if (not_replaying())
+		return Yes;
+	replay_seek(60);
+	return No;
+}
+
+int
+cmd_slower(struct pg_top_context *pgtctx)
+{
+	if (not_replaying())
+		return Yes;
+	new_message(MT_standout | MT_delayed, " Replaying at %gx",
+				replay_speed(0.5));
+	return No;
+}
+
+int
+cmd_statements(struct pg_top_context *pgtctx)
+{
+	pgtctx->mode = MODE_STATEMENTS;
+	pgtctx->header_text =
+		pgtctx->header_options[pgtctx->mode_remote][pgtctx->mode];
+	reset_display(pgtctx);
+	return No;
+}
+
+int
+cmd_step_back(struct pg_top_context *pgtctx)
+{
+	if (not_replaying())
+		return Yes;
+	replay_step(-1);
+	return No;
+}
+
+int
+cmd_step_forward(struct pg_top_context *pgtctx)
+{
+	if (not_replaying())
+		return Yes;
+	replay_step(1);
+	return No;
+}
+
+int
+cmd_tables(struct pg_top_context *pgtctx)
+{
+	pgtctx->mode = MODE_TABLE_STATS;
+	pgtctx->header_text =
+		pgtctx->header_options[pgtctx->mode_remote][pgtctx->mode];
+	reset_display(pgtctx);
+	return No;
+}
+
 int
 cmd_toggle(struct pg_top_context *pgtctx)
 {
@@ -681,9 +822,14 @@ show_explain(struct pg_conninfo_ctx *conninfo, int procpid, int analyze)
 		{
 			sprintf(sql, "EXPLAIN\n%s", PQgetvalue(pgresult_query, i, 0));
 		}
-		PQexec(conninfo->connection, BEGIN);
+		/*
+		 * EXPLAIN ANALYZE runs the statement, so lift the session's
+		 * statement timeout for the length of the transaction.
+		 */
+		PQclear(PQexec(conninfo->connection, BEGIN));
+		PQclear(PQexec(conninfo->connection, NO_TIMEOUT));
 		pgresult_explain = PQexec(conninfo->connection, sql);
-		PQexec(conninfo->connection, ROLLBACK);
+		PQclear(PQexec(conninfo->connection, ROLLBACK));
 		r = PQntuples(pgresult_explain);
 		/* This will display an error if the EXPLAIN fails. */
 		display_pager("\n\nQuery Plan:\n\n");
@@ -28,17 +28,25 @@ int			cmd_delay(struct pg_top_context *);
 int			cmd_displays(struct pg_top_context *);
 int			cmd_explain(struct pg_top_context *);
 int			cmd_explain_analyze(struct pg_top_context *);
+int			cmd_faster(struct pg_top_context *);
 int			cmd_help(struct pg_top_context *);
 int			cmd_idletog(struct pg_top_context *);
 int			cmd_indexes(struct pg_top_context *);
 int			cmd_io(struct pg_top_context *);
 int			cmd_locks(struct pg_top_context *);
 int			cmd_number(struct pg_top_context *);
+int			cmd_pause(struct pg_top_context *);
 int			cmd_quit(struct pg_top_context *);
 int			cmd_replication(struct pg_top_context *);
 int			cmd_order(struct pg_top_context *);
 int			cmd_redraw(struct pg_top_context *);
+int			cmd_seek_back(struct pg_top_context *);
+int			cmd_seek_forward(struct pg_top_context *);
+int			cmd_slower(struct pg_top_context *);
 int			cmd_statements(struct pg_top_context *);
+int			cmd_step_back(struct pg_top_context *);
+int			cmd_step_forward(struct pg_top_context *);
+int			cmd_tables(struct pg_top_context *);
 int			cmd_toggle(struct pg_top_context *);
 int			cmd_update(struct pg_top_context *);
 int			cmd_user(struct pg_top_context *);
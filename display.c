@@ -28,6 +28,7 @@
 
 #include "os.h"
 #include <ctype.h>
+#include <pthread.h>
 #include <stdarg.h>
 #include <unistd.h>
 
@@ -45,12 +46,24 @@
 
 #define CURSOR_COST 8
 
+extern char *myname;
+
 /* imported from screen.c */
 extern int	overstrike;
 
 static int	lmpid = -1;
 static int	display_width = MAX_COLS;
 
+/*
+ * Only the thread that display_init was called from draws on the screen.
+ * Messages from any other thread wait here to be shown with the next
+ * refresh.
+ */
+static pthread_t display_thread;
+static int	display_thread_set = 0;
+static pthread_mutex_t thread_msg_lock = PTHREAD_MUTEX_INITIALIZER;
+static char thread_msg[MAX_COLS + 8];
+
 /* cursor positions of key points on the screen are maintained here */
 /* layout.h has static definitions, but we may change our minds on some
    of the positions as we make decisions about what needs to be displayed */
@@ -87,6 +100,14 @@ static char *colorbuf = NULL;
 static char scratchbuf[MAX_COLS];
 static int	bufsize = 0;
 
+/*
+ * Hash of each line as last drawn by i_process, or 0 if the line has been
+ * written or cleared by anything else since.  A process line whose text
+ * hashes the same is already on the screen and is skipped altogether.
+ */
+static uint64_t *linehash = NULL;
+static int	linehash_lines = 0;
+
 /* lineindex tells us where the beginning of a line is in the buffer */
 #define lineindex(l) ((l)*MAX_COLS)
 
@@ -163,6 +184,7 @@ display_clear()
 	clear();
 	memzero(screenbuf, bufsize);
 	memzero(colorbuf, bufsize);
+	memzero(linehash, linehash_lines * sizeof(uint64_t));
 	curr_x = curr_y = 0;
 }
 
@@ -329,6 +351,9 @@ display_write(int x, int y, int newcolor, int eol, char *new)
 		virt_y = y;
 	}
 
+	if (y < linehash_lines)
+		linehash[y] = 0;
+
 	/* a pointer to where we start */
 	bufp = &screenbuf[lineindex(y) + x];
 	colorp = &colorbuf[lineindex(y) + x];
@@ -474,6 +499,9 @@ display_cte()
 		len = lineindex(virt_y) + virt_x;
 		memzero(&screenbuf[len], bufsize - len);
 		memzero(&colorbuf[len], bufsize - len);
+		if (virt_y < linehash_lines)
+			memzero(&linehash[virt_y],
+					(linehash_lines - virt_y) * sizeof(uint64_t));
 	}
 }
 
@@ -661,6 +689,25 @@ display_resize()
 		memzero(colorbuf, bufsize);
 	}
 
+	if (lines > linehash_lines)
+	{
+		if (linehash != NULL)
+		{
+			free(linehash);
+		}
+		linehash_lines = lines;
+		linehash = (uint64_t *) calloc(linehash_lines, sizeof(uint64_t));
+		if (linehash == NULL)
+		{
+			linehash_lines = 0;
+			return (-1);
+		}
+	}
+	else
+	{
+		memzero(linehash, linehash_lines * sizeof(uint64_t));
+	}
+
 	/* adjust total lines on screen to lines available for procs */
 	lines -= y_procs;
 
@@ -686,6 +733,9 @@ display_init(struct statics *statics)
 	register int *ip;
 	register int i;
 
+	display_thread = pthread_self();
+	display_thread_set = 1;
+
 	/*
 	 * certain things may influence the screen layout, so look at those first
 	 */
@@ -1208,9 +1258,27 @@ static int	msglen = 0;
 /* Invariant: msglen is always the length of the message currently displayed
    on the screen (even when next_msg doesn't contain that message). */
 
+/* pick up a message left by another thread, if there is room for it */
+static void
+thread_message()
+{
+	if (next_msg[0] == '\0')
+	{
+		pthread_mutex_lock(&thread_msg_lock);
+		if (thread_msg[0] != '\0')
+		{
+			strcpy(next_msg, thread_msg);
+			thread_msg[0] = '\0';
+		}
+		pthread_mutex_unlock(&thread_msg_lock);
+	}
+}
+
 void
 i_message()
 {
+	thread_message();
+
 	if (smart_terminal)
 	{
 		if (next_msg[0] != '\0')
@@ -1235,6 +1303,23 @@ u_message()
 	i_message();
 }
 
+/*
+ *	e_message() - write any pending message to stderr, for when stdout is
+ *	not a screen but the statistics themselves
+ */
+
+void
+e_message()
+{
+	thread_message();
+
+	if (next_msg[0] != '\0')
+	{
+		fprintf(stderr, "%s:%s\n", myname, next_msg);
+		next_msg[0] = '\0';
+	}
+}
+
 static int	header_length;
 
 /*
@@ -1274,20 +1359,65 @@ u_header(char *text)
  *	Assumptions:  lastline is consistent
  */
 
+static uint64_t
+line_hash(char *line)
+{
+	uint64_t	hash = 14695981039346656037ULL;
+
+	while (*line != '\0')
+	{
+		hash ^= (unsigned char) *line++;
+		hash *= 1099511628211ULL;
+	}
+
+	/* 0 means the line is not known to be on the screen */
+	return hash != 0 ? hash : 1;
+}
+
 void
 i_process(int line, char *thisline)
 {
+	int			y = y_procs + line;
+
 	/* truncate the line to conform to our current screen width */
 	thisline[display_width] = '\0';
 
 	/* write the line out */
-	display_write(0, y_procs + line, 0, 1, thisline);
+	display_write(0, y, 0, 1, thisline);
+
+	if (smart_terminal && y < linehash_lines)
+		linehash[y] = line_hash(thisline);
 }
 
 void
 u_process(int line, char *newline)
 {
-	i_process(line, newline);
+	int			y = y_procs + line;
+	uint64_t	hash;
+
+	if (!smart_terminal || y >= linehash_lines)
+	{
+		i_process(line, newline);
+		return;
+	}
+
+	newline[display_width] = '\0';
+	hash = line_hash(newline);
+
+	/*
+	 * Leave the line alone if it is exactly what was drawn there last time,
+	 * but put the virtual cursor where writing it would have, since
+	 * u_endscreen clears from there.
+	 */
+	if (linehash[y] == hash)
+	{
+		virt_x = strlen(newline);
+		virt_y = y;
+		return;
+	}
+
+	display_write(0, y, 0, 1, newline);
+	linehash[y] = hash;
 }
 
 void
@@ -1327,6 +1457,14 @@ new_message_v(int type, char *msgfmt, va_list ap)
 {
 	register int i;
 
+	if (display_thread_set && !pthread_equal(pthread_self(), display_thread))
+	{
+		pthread_mutex_lock(&thread_msg_lock);
+		(void) vsnprintf(thread_msg, sizeof(thread_msg), msgfmt, ap);
+		pthread_mutex_unlock(&thread_msg_lock);
+		return;
+	}
+
 	/* first, format the message */
 	(void) vsnprintf(next_msg, sizeof(next_msg), msgfmt, ap);
 
@@ -30,6 +30,7 @@ void		i_swap(long *stats);
 void		u_swap(long *stats);
 void		i_message();
 void		u_message();
+void		e_message();
 void		i_header(char *text);
 void		u_header(char *text);
 void		i_process(int line, char *thisline);
@@ -10,6 +10,9 @@ These single-character commands are available:\n\
 \n\
 ^L      - redraw screen\n\
 <sp>    - update screen\n\
++ or -  - replay twice or half as fast\n\
+, or .  - replay the previous or next refresh\n\
+< or >  - replay from a minute earlier or later\n\
 A       - EXPLAIN ANALYZE (UPDATE/DELETE safe)\n\
 a       - show PostgreSQL activity\n\
 C       - toggle the use of color\n\
@@ -17,14 +20,19 @@ E       - show execution plan (UPDATE/DELETE safe)\n\
 I       - show I/O statistics per process (Linux only)\n\
 L       - show locks held by a process\n\
 Q       - show current query of a process\n\
+S       - show statement statistics (needs pg_stat_statements)\n\
+T       - show table statistics\n\
+X       - show index statistics\n\
 c       - toggle the display of process commands\n\
 d       - change number of displays to show\n\
 h or ?  - help; show this text\n\
 i       - toggle the displaying of idle processes\n\
 n or #  - change number of processes to display\n\
 o       - specify sort order (%s)\n\
+p       - pause or resume replay\n\
 q       - quit\n\
-s       - change number of seconds to delay between updates\n\
+s       - change number of seconds to delay between updates (e.g. 0.5)\n\
+t       - toggle between changes since the last update and totals\n\
 u       - display processes for only one user (+ selects all users)\n\
 \n\
 Not all commands are available on all systems.\n\
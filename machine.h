@@ -34,6 +34,9 @@ enum DisplayMode
 	MODE_PROCESSES,
 	MODE_IO_STATS,
 	MODE_REPLICATION,
+	MODE_TABLE_STATS,
+	MODE_INDEX_STATS,
+	MODE_STATEMENTS,
 	MODE_TYPES					/* number of modes */
 };
 
@@ -63,6 +66,7 @@ struct statics
 	char	  **memory_names;
 	char	  **swap_names;		/* optional */
 	char	  **order_names;	/* optional */
+	int			process_orders; /* optional, how many of them sort processes */
 	char	  **color_names;	/* optional */
 	time_t		boottime;		/* optional */
 	int			ncpus;
@@ -111,6 +115,41 @@ struct process_select
 	int			fullcmd;		/* show full command */
 	char	   *command;		/* only this command (unless == NULL) */
 	char		usename[NAMEDATALEN + 1];	/* only this postgres usename */
+	int			topn;			/* only the first topn need to be in order */
+};
+
+/*
+ * What the metrics exporter and the recorder need to know about a backend.
+ * The names are interned, so they stay put and can be compared as pointers.
+ * The command is only good until the next sample.
+ */
+
+struct backend_io
+{
+	long long	rchar;
+	long long	wchar;
+	long long	syscr;
+	long long	syscw;
+	long long	read_bytes;
+	long long	write_bytes;
+	long long	cancelled_write_bytes;
+};
+
+struct backend_stats
+{
+	pid_t		pid;
+	char	   *usename;
+	char	   *datname;
+	char	   *command;
+	int			pgstate;
+	double		pcpu;
+	unsigned long size;			/* in k */
+	unsigned long rss;			/* in k */
+	unsigned long xtime;
+	unsigned long qtime;
+	unsigned int locks;
+	struct backend_io io;		/* since the backend started */
+	struct backend_io io_diff;	/* since the previous sample */
 };
 
 /* routines defined by the machine dependent module */
@@ -127,11 +166,22 @@ char	   *format_header(char *);
 char	   *format_next_io(caddr_t);
 char	   *format_next_process(caddr_t);
 char	   *format_next_replication(caddr_t);
+#ifdef __linux__
+void		output_next_io(caddr_t);
+void		output_next_process(caddr_t);
+void		output_next_replication(caddr_t);
+void		metrics_next_process(caddr_t, struct backend_stats *);
+void		rewind_process_info(caddr_t);
+#endif							/* __linux__ */
 uid_t		proc_owner(pid_t);
 void		update_state(int *pgstate, char *state);
 void		update_str(char **, char *);
+char	   *intern_str(const char *);
+unsigned int interned_count(void);
 
 extern int	mode_stats;
+extern int	collector_threads;
+extern char *proc_root;
 
 extern char *backendstatenames[];
 extern char *procstatenames[];
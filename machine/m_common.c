@@ -5,6 +5,7 @@
  *
  * Copyright (c) 2013 VMware, Inc. All Rights Reserved.
  */
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/time.h>
@@ -54,3 +55,88 @@ update_str(char **old, char *new)
 		*old = strdup(new);
 	}
 }
+
+/*
+ * Interned strings.  Role names, application names, client addresses and
+ * replication states come back on every row of every refresh but only take
+ * a handful of distinct values, so each one is stored once and shared.  The
+ * entries are never freed; two interned strings are equal exactly when the
+ * pointers are.
+ */
+static char **intern_table = NULL;
+static unsigned int intern_size = 0;	/* always a power of two */
+static unsigned int intern_count = 0;
+
+static unsigned int
+intern_hash(const char *str)
+{
+	unsigned int hash = 2166136261u;
+
+	while (*str != '\0')
+	{
+		hash ^= (unsigned char) *str++;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+static void
+intern_grow(void)
+{
+	char	  **old = intern_table;
+	unsigned int old_size = intern_size;
+	unsigned int i,
+				j;
+
+	intern_size = old_size == 0 ? 64 : old_size * 2;
+	intern_table = calloc(intern_size, sizeof(char *));
+	if (intern_table == NULL)
+	{
+		fprintf(stderr, "calloc error\n");
+		exit(1);
+	}
+
+	for (i = 0; i < old_size; i++)
+	{
+		if (old[i] == NULL)
+			continue;
+		j = intern_hash(old[i]) & (intern_size - 1);
+		while (intern_table[j] != NULL)
+			j = (j + 1) & (intern_size - 1);
+		intern_table[j] = old[i];
+	}
+	free(old);
+}
+
+char *
+intern_str(const char *str)
+{
+	unsigned int i;
+
+	if (intern_count * 2 >= intern_size)
+		intern_grow();
+
+	i = intern_hash(str) & (intern_size - 1);
+	while (intern_table[i] != NULL)
+	{
+		if (strcmp(intern_table[i], str) == 0)
+			return intern_table[i];
+		i = (i + 1) & (intern_size - 1);
+	}
+
+	intern_table[i] = strdup(str);
+	if (intern_table[i] == NULL)
+	{
+		fprintf(stderr, "strdup error\n");
+		exit(1);
+	}
+	intern_count++;
+	return intern_table[i];
+}
+
+/* The number of distinct strings interned so far. */
+unsigned int
+interned_count(void)
+{
+	return intern_count;
+}
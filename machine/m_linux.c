@@ -35,6 +35,11 @@
 #include <sys/time.h>
 #include <sys/stat.h>
 #include <sys/vfs.h>
+#include <sys/resource.h>
+#include <limits.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <signal.h>
 
 #include <sys/param.h>			/* for HZ */
 
@@ -61,6 +66,7 @@
 		v = atoll(value);
 
 #include "machine.h"
+#include "output.h"
 #include "utils.h"
 
 #define PROCFS "/proc"
@@ -72,16 +78,20 @@ struct top_proc
 {
 	RB_ENTRY(top_proc) entry;
 	pid_t		pid;
+	unsigned int generation;	/* refresh in which the pid was last seen */
+	unsigned int sampled;		/* refresh in which /proc was last read */
 
 	/* Data from /proc/<pid>/stat. */
 	char	   *name;
-	char	   *usename;
+	char	   *usename;		/* interned */
+	char	   *datname;		/* interned */
 	unsigned long size,
 				rss;			/* in k */
 	int			state;
 	int			pgstate;
 	unsigned long time;
-	unsigned long start_time;
+	unsigned long start_time;	/* in ticks after boot */
+	long long	backend_start;	/* in microseconds since the epoch */
 	unsigned long xtime;
 	unsigned long qtime;
 	unsigned int locks;
@@ -106,9 +116,9 @@ struct top_proc
 	long long	diff_cancelled_write_bytes;
 
 	/* Replication data */
-	char	   *application_name;
-	char	   *client_addr;
-	char	   *repstate;
+	char	   *application_name;	/* interned */
+	char	   *client_addr;	/* interned */
+	char	   *repstate;		/* interned */
 	char	   *primary;
 	char	   *sent;
 	char	   *write;
@@ -118,8 +128,45 @@ struct top_proc
 	long long	write_lag;
 	long long	flush_lag;
 	long long	replay_lag;
+
+	/* Descriptors on /proc/<pid>/ files kept open between refreshes. */
+	int			fd_cmdline;
+	int			fd_stat;
+	int			fd_io;
+
+	struct top_proc *next_free; /* link in proc_free_list */
 };
 
+/*
+ * The columns that the active processes are sorted and displayed by, copied
+ * out of the tree once per refresh so that sorting walks short dense arrays
+ * instead of whole top_proc entries.  Row i describes proc[i], which holds
+ * the strings and everything else that is only needed for the rows shown.
+ */
+static struct
+{
+	int			rows;			/* allocated length of each column */
+	struct top_proc **proc;
+	int		   *pgstate;
+	unsigned int *locks;
+	unsigned long *size;
+	unsigned long *rss;
+	unsigned long *xtime;
+	unsigned long *qtime;
+	double	   *pcpu;
+	long long  *rchar;
+	long long  *wchar;
+	long long  *syscr;
+	long long  *syscw;
+	long long  *read_bytes;
+	long long  *write_bytes;
+	long long  *cancelled_write_bytes;
+	long long  *sent_lag;
+	long long  *write_lag;
+	long long  *flush_lag;
+	long long  *replay_lag;
+}			proc_hot;
+
 int			topproccmp(struct top_proc *, struct top_proc *);
 
 RB_HEAD(pgproc, top_proc) head_proc = RB_INITIALIZER(&head_proc);
@@ -167,12 +214,19 @@ char		fmt_header_io[] =
 char		fmt_header_replication[] =
 "  PID USERNAME APPLICATION          CLIENT STATE     PRIMARY    SENT       WRITE      FLUSH      REPLAY      SLAG  WLAG  FLAG  RLAG";
 
-/* these are names given to allowed sorting orders -- first is default */
+/*
+ * these are names given to allowed sorting orders -- first is default.
+ * Only the first NPROCORDERS sort the processes, the rest are for the
+ * table, index and statement displays.
+ */
+#define NPROCORDERS 18
 static char *ordernames[] =
 {
 	"cpu", "size", "res", "xtime", "qtime", "rchar", "wchar", "syscr",
 	"syscw", "reads", "writes", "cwrites", "locks", "command", "flag",
-	"rlag", "slag", "wlag", NULL
+	"rlag", "slag", "wlag", "seqscan", "idxscan", "ins", "upd", "del",
+	"hits", "idxhits", "idxread", "idxtup", "fetch", "calls", "time",
+	"mean", "rows", "temp", NULL
 };
 
 /* forward definitions for comparison functions */
@@ -194,6 +248,23 @@ static int	compare_syscw(const void *, const void *);
 static int	compare_wchar(const void *, const void *);
 static int	compare_writes(const void *, const void *);
 static int	compare_xtime(const void *, const void *);
+static void key_cpu(const void *, uint64_t *, uint64_t *);
+static void key_size(const void *, uint64_t *, uint64_t *);
+static void key_res(const void *, uint64_t *, uint64_t *);
+static void key_xtime(const void *, uint64_t *, uint64_t *);
+static void key_qtime(const void *, uint64_t *, uint64_t *);
+static void key_rchar(const void *, uint64_t *, uint64_t *);
+static void key_wchar(const void *, uint64_t *, uint64_t *);
+static void key_syscr(const void *, uint64_t *, uint64_t *);
+static void key_syscw(const void *, uint64_t *, uint64_t *);
+static void key_reads(const void *, uint64_t *, uint64_t *);
+static void key_writes(const void *, uint64_t *, uint64_t *);
+static void key_cwrites(const void *, uint64_t *, uint64_t *);
+static void key_locks(const void *, uint64_t *, uint64_t *);
+static void key_lag_flush(const void *, uint64_t *, uint64_t *);
+static void key_lag_replay(const void *, uint64_t *, uint64_t *);
+static void key_lag_sent(const void *, uint64_t *, uint64_t *);
+static void key_lag_write(const void *, uint64_t *, uint64_t *);
 
 int			(*proc_compares[]) () =
 {
@@ -218,6 +289,33 @@ int			(*proc_compares[]) () =
 		NULL
 };
 
+/*
+ * Packed first and second keys for each of the orders above, for key_sort.
+ * Sorting by command name has to go through the comparison function.
+ */
+static void (*proc_keys[]) (const void *, uint64_t *, uint64_t *) =
+{
+	key_cpu,
+		key_size,
+		key_res,
+		key_xtime,
+		key_qtime,
+		key_rchar,
+		key_wchar,
+		key_syscr,
+		key_syscw,
+		key_reads,
+		key_writes,
+		key_cwrites,
+		key_locks,
+		NULL,
+		key_lag_flush,
+		key_lag_replay,
+		key_lag_sent,
+		key_lag_write,
+		NULL
+};
+
 /*=SYSTEM STATE INFO====================================================*/
 
 /* these are for calculating cpu state percentages */
@@ -228,14 +326,53 @@ static int64_t cp_diff[NCPUSTATES];
 
 /* for calculating the exponential average */
 
-static struct timeval lasttime;
+static struct timespec lasttime;
+static double timediff;			/* ticks elapsed since the last refresh */
 
 /* these are for keeping track of processes */
 
 #define INITIAL_ACTIVE_SIZE  (256)
 #define PROCBLOCK_SIZE		 (32)
-static struct top_proc *pgtable;
+static int *pgtable;				/* rows of proc_hot, in display order */
+static struct top_proc *proc_free_list = NULL;
+static struct top_proc **proc_sample;	/* tree entries in row order */
+static int	proc_sample_size = 0;
 static int	proc_index;
+static unsigned int generation = 0;
+
+/*
+ * Number of descriptors that may be held open on /proc files, derived from
+ * RLIMIT_NOFILE less some headroom for the terminal, libpq and friends.
+ */
+#define PROC_FD_RESERVE		(64)
+static int	proc_fd_budget = 0;
+static int	proc_fds_open = 0;
+
+/*
+ * Worker pool for reading /proc when there are many backends.  The entries
+ * to sample are split into contiguous shards, one per thread, with the
+ * calling thread taking the first shard.  Each entry is only ever touched by
+ * one thread and stays in row order, so the result does not depend on how
+ * the threads happen to be scheduled.
+ */
+struct collector
+{
+	pthread_t  *threads;
+	int			nthreads;		/* including the calling thread */
+	pthread_mutex_t lock;
+	pthread_cond_t start;
+	pthread_cond_t done;
+	unsigned int round;
+	int			running;
+	struct top_proc **procs;
+	int			nprocs;
+	struct process_select *sel;
+};
+
+static struct collector collector = {
+	NULL, 0, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+	PTHREAD_COND_INITIALIZER, 0, 0, NULL, 0, NULL
+};
 static time_t boottime = -1;
 
 /* these are for passing data back to the machine independant portion */
@@ -288,10 +425,148 @@ xfrm_cmdline(char *p, int len)
 	}
 }
 
+static void
+proc_close(int *fdp)
+{
+	if (*fdp != -1)
+	{
+		close(*fdp);
+		*fdp = -1;
+		__sync_sub_and_fetch(&proc_fds_open, 1);
+	}
+}
+
+/*
+ * Read the /proc/<pid>/ file "name" into "buffer", reusing the descriptor
+ * cached in "fdp" when there is one.  A descriptor that fails to read
+ * belongs to a process that has exited, so it is replaced by a fresh one.
+ * Returns the number of bytes read or -1.
+ */
+static int
+proc_read(struct top_proc *proc, int *fdp, char *name, char *buffer,
+		  size_t size)
+{
+	char		path[64];
+	int			fd;
+	int			len;
+
+	if (*fdp != -1)
+	{
+		if ((len = pread(*fdp, buffer, size, 0)) > 0)
+			return len;
+		proc_close(fdp);
+	}
+
+	sprintf(path, "%d/%s", proc->pid, name);
+	if ((fd = open(path, O_RDONLY)) == -1)
+		return -1;
+	len = read(fd, buffer, size);
+
+	/*
+	 * Keep it around for the next refresh if the budget allows.  This may
+	 * run on several collector threads at once.
+	 */
+	if (len > 0 &&
+		__sync_add_and_fetch(&proc_fds_open, 1) <= proc_fd_budget)
+	{
+		*fdp = fd;
+	}
+	else
+	{
+		if (len > 0)
+			__sync_sub_and_fetch(&proc_fds_open, 1);
+		close(fd);
+	}
+
+	return len;
+}
+
+/*
+ * Get a cleared process entry.  Entries are carved out of blocks of
+ * PROCBLOCK_SIZE and go back on a free list when their backend exits, so
+ * once the number of backends settles no more memory is allocated.
+ */
+static struct top_proc *
+alloc_proc(void)
+{
+	struct top_proc *proc;
+	int			i;
+
+	if (proc_free_list == NULL)
+	{
+		proc = malloc(PROCBLOCK_SIZE * sizeof(struct top_proc));
+		if (proc == NULL)
+		{
+			fprintf(stderr, "malloc error\n");
+			exit(1);
+		}
+		for (i = 0; i < PROCBLOCK_SIZE; i++)
+		{
+			proc[i].next_free = proc_free_list;
+			proc_free_list = &proc[i];
+		}
+	}
+
+	proc = proc_free_list;
+	proc_free_list = proc->next_free;
+
+	memset(proc, 0, sizeof(struct top_proc));
+	proc->fd_cmdline = -1;
+	proc->fd_stat = -1;
+	proc->fd_io = -1;
+	return proc;
+}
+
+/*
+ * Release a process entry that has dropped out of the tree along with the
+ * strings and descriptors it owns, and put it back on the free list.
+ */
+static void
+free_proc(struct top_proc *proc)
+{
+	proc_close(&proc->fd_cmdline);
+	proc_close(&proc->fd_stat);
+	proc_close(&proc->fd_io);
+	free(proc->name);
+	free(proc->primary);
+	free(proc->sent);
+	free(proc->write);
+	free(proc->flush);
+	free(proc->replay);
+
+	proc->next_free = proc_free_list;
+	proc_free_list = proc;
+}
+
+/*
+ * Remove every entry that was not seen during the current refresh.  Backends
+ * come and go constantly behind a connection pooler, so without this the
+ * tree grows with every pid ever seen.
+ */
+static void
+evict_stale_procs(void)
+{
+	struct top_proc *n,
+			   *next;
+
+	RB_FOREACH_SAFE(n, pgproc, &head_proc, next)
+	{
+		if (n->generation != generation)
+		{
+			RB_REMOVE(pgproc, &head_proc, n);
+			free_proc(n);
+		}
+	}
+}
+
 int
 machine_init(struct statics *statics)
 {
-	/* make sure the proc filesystem is mounted */
+	/*
+	 * Make sure the proc filesystem is mounted.  A root given with
+	 * --proc-root may be a copy of one, so it only has to exist.
+	 */
+	if (proc_root == NULL)
 	{
 		struct statfs sb;
 
@@ -304,7 +579,25 @@ machine_init(struct statics *statics)
 	}
 
 	/* chdir to the proc filesystem to make things easier */
-	chdir(PROCFS);
+	if (chdir(proc_root != NULL ? proc_root : PROCFS) == -1)
+	{
+		fprintf(stderr, "%s: cannot change to %s: %s\n", myname,
+				proc_root != NULL ? proc_root : PROCFS, strerror(errno));
+		return -1;
+	}
+
+	/* see how many /proc files we can afford to keep open */
+	{
+		struct rlimit rl;
+
+		if (getrlimit(RLIMIT_NOFILE, &rl) == 0)
+		{
+			if (rl.rlim_cur == RLIM_INFINITY || rl.rlim_cur > INT_MAX)
+				proc_fd_budget = INT_MAX - PROC_FD_RESERVE;
+			else if (rl.rlim_cur > PROC_FD_RESERVE)
+				proc_fd_budget = rl.rlim_cur - PROC_FD_RESERVE;
+		}
+	}
 
 	/* a few preliminary checks */
 	{
@@ -368,6 +661,7 @@ machine_init(struct statics *statics)
 	statics->memory_names = memorynames;
 	statics->swap_names = swapnames;
 	statics->order_names = ordernames;
+	statics->process_orders = NPROCORDERS;
 	statics->boottime = boottime;
 	statics->flags.fullcmds = 1;
 	statics->flags.warmup = 1;
@@ -538,16 +832,47 @@ get_system_info(struct system_info *info)
 	info->swap = swap_stats;
 }
 
+/* Forget the i/o counters, so the next read of /proc/<pid>/io starts over. */
+static void
+proc_reset_io(struct top_proc *proc)
+{
+	proc->rchar = 0;
+	proc->wchar = 0;
+	proc->syscr = 0;
+	proc->syscw = 0;
+	proc->read_bytes = 0;
+	proc->write_bytes = 0;
+	proc->cancelled_write_bytes = 0;
+}
+
+/*
+ * Forget everything that was read from /proc about an entry whose pid now
+ * belongs to a different backend, so that it is sampled again as if it were
+ * new.
+ */
+static void
+proc_reset(struct top_proc *proc)
+{
+	proc_close(&proc->fd_cmdline);
+	proc_close(&proc->fd_stat);
+	proc_close(&proc->fd_io);
+	proc_reset_io(proc);
+	proc->time = 0;
+	proc->start_time = 0;
+	proc->pcpu = 0;
+	proc->sampled = 0;
+}
+
 static void
 read_one_proc_stat(struct top_proc *proc, struct process_select *sel)
 {
 	char		buffer[4096],
 			   *p,
 			   *q;
-	int			fd,
-				len;
+	int			len;
 	int			fullcmd;
 	char		value[BUFFERLEN + 1];
+	unsigned long start_time;
 
 	long long	tmp;
 
@@ -558,23 +883,15 @@ read_one_proc_stat(struct top_proc *proc, struct process_select *sel)
 	fullcmd = sel->fullcmd;
 	if (fullcmd == 1)
 	{
-		sprintf(buffer, "%d/cmdline", proc->pid);
-		if ((fd = open(buffer, O_RDONLY)) != -1)
+		/* read command line data */
+		/* (theres no sense in reading more than we can fit) */
+		if ((len = proc_read(proc, &proc->fd_cmdline, "cmdline", buffer,
+							 MAX_COLS)) > 1)
 		{
-			/* read command line data */
-			/* (theres no sense in reading more than we can fit) */
-			if ((len = read(fd, buffer, MAX_COLS)) > 1)
-			{
-				buffer[len] = '\0';
-				xfrm_cmdline(buffer, len);
-				update_str(&proc->name, buffer);
-				printable(proc->name);
-			}
-			else
-			{
-				fullcmd = 0;
-			}
-			close(fd);
+			buffer[len] = '\0';
+			xfrm_cmdline(buffer, len);
+			update_str(&proc->name, buffer);
+			printable(proc->name);
 		}
 		else
 		{
@@ -583,11 +900,11 @@ read_one_proc_stat(struct top_proc *proc, struct process_select *sel)
 	}
 
 	/* grab the proc stat info in one go */
-	sprintf(buffer, "%d/stat", proc->pid);
-
-	fd = open(buffer, O_RDONLY);
-	len = read(fd, buffer, sizeof(buffer) - 1);
-	close(fd);
+	if ((len = proc_read(proc, &proc->fd_stat, "stat", buffer,
+						 sizeof(buffer) - 1)) <= 0)
+	{
+		return;
+	}
 
 	buffer[len] = '\0';
 
@@ -658,7 +975,17 @@ read_one_proc_stat(struct top_proc *proc, struct process_select *sel)
 	p = skip_token(p);			/* skip nice */
 	p = skip_token(p);			/* skip num_threads */
 	p = skip_token(p);			/* skip itrealvalue, 0 */
-	proc->start_time = strtoul(p, &p, 10);	/* start_time */
+	start_time = strtoul(p, &p, 10);	/* start_time */
+	if (proc->start_time != start_time)
+	{
+		/*
+		 * The pid has been reused.  Don't read the old process's i/o, and
+		 * count the new one's from zero.
+		 */
+		proc_close(&proc->fd_io);
+		proc_reset_io(proc);
+		proc->start_time = start_time;
+	}
 	proc->size = bytetok(strtoul(p, &p, 10));	/* vsize */
 	proc->rss = pagetok(strtoul(p, &p, 10));	/* rss */
 
@@ -684,9 +1011,8 @@ read_one_proc_stat(struct top_proc *proc, struct process_select *sel)
 #endif
 
 	/* Get the io stats. */
-	sprintf(buffer, "%d/io", proc->pid);
-	fd = open(buffer, O_RDONLY);
-	if (fd == -1)
+	if ((len = proc_read(proc, &proc->fd_io, "io", buffer,
+						 sizeof(buffer) - 1)) <= 0)
 	{
 		/*
 		 * CONFIG_TASK_IO_ACCOUNTING is not enabled in the Linux kernel or
@@ -702,8 +1028,6 @@ read_one_proc_stat(struct top_proc *proc, struct process_select *sel)
 		proc->cancelled_write_bytes = 0;
 		return;
 	}
-	len = read(fd, buffer, sizeof(buffer) - 1);
-	close(fd);
 
 	buffer[len] = '\0';
 	p = buffer;
@@ -737,20 +1061,232 @@ read_one_proc_stat(struct top_proc *proc, struct process_select *sel)
 	proc->cancelled_write_bytes = tmp;
 }
 
+/* Read /proc for one backend and work out its share of the cpu. */
+static void
+sample_proc(struct top_proc *proc, struct process_select *sel)
+{
+	unsigned long otime = proc->time;
+	unsigned long ostart_time = proc->start_time;
+
+	proc->sampled = generation;
+	read_one_proc_stat(proc, sel);
+
+	/* a new process behind a reused pid has no cpu time to compare with */
+	if (proc->start_time != ostart_time)
+		otime = 0;
+
+	if (timediff > 0.0)
+	{
+		if ((proc->pcpu = (proc->time - otime) / timediff) < 0.0001)
+		{
+			proc->pcpu = 0;
+		}
+	}
+}
+
+static void
+sample_shard(int shard)
+{
+	int			i;
+	int			first = (int) ((long long) collector.nprocs * shard /
+							   collector.nthreads);
+	int			last = (int) ((long long) collector.nprocs * (shard + 1) /
+							  collector.nthreads);
+
+	for (i = first; i < last; i++)
+		sample_proc(collector.procs[i], collector.sel);
+}
+
+static void *
+collector_main(void *arg)
+{
+	int			shard = (int) (intptr_t) arg;
+	unsigned int seen = 0;
+
+	pthread_mutex_lock(&collector.lock);
+	for (;;)
+	{
+		while (collector.round == seen)
+			pthread_cond_wait(&collector.start, &collector.lock);
+		seen = collector.round;
+		pthread_mutex_unlock(&collector.lock);
+
+		sample_shard(shard);
+
+		pthread_mutex_lock(&collector.lock);
+		if (--collector.running == 0)
+			pthread_cond_signal(&collector.done);
+	}
+
+	/* NOTREACHED */
+	return NULL;
+}
+
+/*
+ * Start the worker threads the first time they are needed.  Returns -1 if
+ * they could not be created, in which case sampling stays serial.
+ */
+static int
+collector_init(void)
+{
+	sigset_t	all;
+	sigset_t	old;
+	int			i;
+
+	collector.threads = malloc((collector_threads - 1) * sizeof(pthread_t));
+	if (collector.threads == NULL)
+		return -1;
+
+	/* signals are for the thread looking after the terminal */
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	for (i = 1; i < collector_threads; i++)
+	{
+		if (pthread_create(&collector.threads[i - 1], NULL, collector_main,
+						   (void *) (intptr_t) i) != 0)
+			break;
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	collector.nthreads = i;
+	return collector.nthreads > 1 ? 0 : -1;
+}
+
+/* Read /proc for every entry in "procs", sharing the work out if allowed. */
+static void
+sample_procs(struct top_proc **procs, int nprocs, struct process_select *sel)
+{
+	int			i;
+
+	if (collector_threads <= 1 || nprocs < collector_threads ||
+		(collector.nthreads == 0 && collector_init() == -1))
+	{
+		for (i = 0; i < nprocs; i++)
+			sample_proc(procs[i], sel);
+		return;
+	}
+
+	pthread_mutex_lock(&collector.lock);
+	collector.procs = procs;
+	collector.nprocs = nprocs;
+	collector.sel = sel;
+	collector.running = collector.nthreads - 1;
+	++collector.round;
+	pthread_cond_broadcast(&collector.start);
+	pthread_mutex_unlock(&collector.lock);
+
+	sample_shard(0);
+
+	pthread_mutex_lock(&collector.lock);
+	while (collector.running > 0)
+		pthread_cond_wait(&collector.done, &collector.lock);
+	pthread_mutex_unlock(&collector.lock);
+}
+
+/* Make room for at least "count" entries in proc_sample. */
+static void
+proc_sample_reserve(int count)
+{
+	struct top_proc **p;
+
+	if (count <= proc_sample_size)
+		return;
+
+	p = realloc(proc_sample, count * sizeof(struct top_proc *));
+	if (p == NULL)
+	{
+		fprintf(stderr, "realloc error\n");
+		exit(1);
+	}
+	proc_sample = p;
+	proc_sample_size = count;
+}
+
+static void *
+proc_hot_column(void *column, size_t width, int rows)
+{
+	column = realloc(column, rows * width);
+	if (column == NULL)
+	{
+		fprintf(stderr, "realloc error\n");
+		exit(1);
+	}
+	return column;
+}
+
+/* Make room for rows entries in proc_hot and in pgtable. */
+static void
+proc_hot_reserve(int rows)
+{
+	if (rows <= proc_hot.rows)
+		return;
+
+#define GROW(column) \
+	proc_hot.column = proc_hot_column(proc_hot.column, \
+									  sizeof(*proc_hot.column), rows)
+	GROW(proc);
+	GROW(pgstate);
+	GROW(locks);
+	GROW(size);
+	GROW(rss);
+	GROW(xtime);
+	GROW(qtime);
+	GROW(pcpu);
+	GROW(rchar);
+	GROW(wchar);
+	GROW(syscr);
+	GROW(syscw);
+	GROW(read_bytes);
+	GROW(write_bytes);
+	GROW(cancelled_write_bytes);
+	GROW(sent_lag);
+	GROW(write_lag);
+	GROW(flush_lag);
+	GROW(replay_lag);
+#undef GROW
+
+	pgtable = proc_hot_column(pgtable, sizeof(*pgtable), rows);
+	proc_hot.rows = rows;
+}
+
+/* Copy the sort and display columns of an active process into row i. */
+static void
+proc_hot_set(int i, struct top_proc *p)
+{
+	proc_hot.proc[i] = p;
+	proc_hot.pgstate[i] = p->pgstate;
+	proc_hot.locks[i] = p->locks;
+	proc_hot.size[i] = p->size;
+	proc_hot.rss[i] = p->rss;
+	proc_hot.xtime[i] = p->xtime;
+	proc_hot.qtime[i] = p->qtime;
+	proc_hot.pcpu[i] = p->pcpu;
+	proc_hot.rchar[i] = p->rchar;
+	proc_hot.wchar[i] = p->wchar;
+	proc_hot.syscr[i] = p->syscr;
+	proc_hot.syscw[i] = p->syscw;
+	proc_hot.read_bytes[i] = p->read_bytes;
+	proc_hot.write_bytes[i] = p->write_bytes;
+	proc_hot.cancelled_write_bytes[i] = p->cancelled_write_bytes;
+	proc_hot.sent_lag[i] = p->sent_lag;
+	proc_hot.write_lag[i] = p->write_lag;
+	proc_hot.flush_lag[i] = p->flush_lag;
+	proc_hot.replay_lag[i] = p->replay_lag;
+	pgtable[i] = i;
+}
+
 caddr_t
 get_process_info(struct system_info *si,
 				 struct process_select *sel,
 				 int compare_index, struct pg_conninfo_ctx *conninfo, int mode)
 {
-	struct timeval thistime;
-	double		timediff;
+	struct timespec thistime;
 
 	/* calculate the time difference since our last check */
-	gettimeofday(&thistime, 0);
+	clock_gettime(CLOCK_MONOTONIC, &thistime);
 	if (lasttime.tv_sec)
 	{
 		timediff = ((thistime.tv_sec - lasttime.tv_sec) +
-					(thistime.tv_usec - lasttime.tv_usec) * 1e-6);
+					(thistime.tv_nsec - lasttime.tv_nsec) * 1e-9);
 	}
 	else
 	{
@@ -766,15 +1302,20 @@ get_process_info(struct system_info *si,
 		int			active_procs = 0;
 
 		int			show_idle = sel->idle;
+		char	   *usename = NULL;	/* -z filter, interned */
+		long long	backend_start;
 
 		int			i;
 		int			rows;
 		PGresult   *pgresult = NULL;
 
-		struct top_proc *n,
-				   *p;
+		struct top_proc *n;
 
 		memset(process_states, 0, sizeof(process_states));
+		if (sel->usename[0] != '\0')
+			usename = intern_str(sel->usename);
+
+		++generation;
 
 		connect_to_db(conninfo);
 		if (conninfo->connection != NULL)
@@ -783,9 +1324,23 @@ get_process_info(struct system_info *si,
 			{
 				pgresult = pg_replication(conninfo->connection);
 			}
-			else
+			else if (pg_processes_send(conninfo->connection))
 			{
-				pgresult = pg_processes(conninfo->connection);
+				/*
+				 * Read /proc for the backends seen last time while the server
+				 * works on the query.  Whatever is new gets read once the
+				 * result is in.
+				 */
+				i = 0;
+				RB_FOREACH(n, pgproc, &head_proc)
+					i++;
+				proc_sample_reserve(i);
+				i = 0;
+				RB_FOREACH(n, pgproc, &head_proc)
+					proc_sample[i++] = n;
+				sample_procs(proc_sample, i, sel);
+
+				pgresult = pg_processes_result(conninfo->connection);
 			}
 			rows = PQntuples(pgresult);
 		}
@@ -794,98 +1349,109 @@ get_process_info(struct system_info *si,
 			rows = 0;
 		}
 
+		proc_hot_reserve(rows);
+
+		/*
+		 * The first half holds the entries in row order, the second half the
+		 * ones whose /proc files still need to be read.
+		 */
 		if (rows > 0)
-		{
-			p = realloc(pgtable, rows * sizeof(struct top_proc));
-			if (p == NULL)
-			{
-				fprintf(stderr, "realloc error\n");
-				if (pgresult != NULL)
-					PQclear(pgresult);
-				disconnect_from_db(conninfo);
-				exit(1);
-			}
-			pgtable = p;
-		}
+			proc_sample_reserve(rows * 2);
 
+		/* find or create the entry for every pid the server returned */
 		for (i = 0; i < rows; i++)
 		{
-			unsigned long otime;
+			struct top_proc key;
 
-			n = malloc(sizeof(struct top_proc));
+			key.pid = pg_getint(pgresult, i, 0);
+			n = RB_FIND(pgproc, &head_proc, &key);
 			if (n == NULL)
 			{
-				fprintf(stderr, "malloc error\n");
-				if (pgresult != NULL)
-					PQclear(pgresult);
-				disconnect_from_db(conninfo);
-				exit(1);
+				n = alloc_proc();
+				n->pid = key.pid;
+				RB_INSERT(pgproc, &head_proc, n);
 			}
-			memset(n, 0, sizeof(struct top_proc));
-			n->pid = atoi(PQgetvalue(pgresult, i, 0));
-			p = RB_INSERT(pgproc, &head_proc, n);
-			if (p != NULL)
+			if (mode != MODE_REPLICATION)
 			{
-				free(n);
-				n = p;
-			}
-			else
-			{
-				n->time = 0;
+				/*
+				 * A different backend_start means the pid was reused since
+				 * the last refresh, so whatever was read about it belongs to
+				 * another process.
+				 */
+				backend_start = pg_getint(pgresult, i, 7);
+				if (n->backend_start != backend_start)
+				{
+					if (n->backend_start != 0)
+						proc_reset(n);
+					n->backend_start = backend_start;
+				}
 			}
+			n->generation = generation;
+			proc_sample[i] = n;
+		}
+
+		if (mode != MODE_REPLICATION)
+		{
+			int			unsampled = 0;
+
+			for (i = 0; i < rows; i++)
+				if (proc_sample[i]->sampled != generation)
+					proc_sample[rows + unsampled++] = proc_sample[i];
+			sample_procs(proc_sample + rows, unsampled, sel);
+		}
 
-			otime = n->time;
+		for (i = 0; i < rows; i++)
+		{
+			n = proc_sample[i];
 
 			if (mode == MODE_REPLICATION)
 			{
-				update_str(&n->usename, PQgetvalue(pgresult, i, 1));
-				update_str(&n->application_name, PQgetvalue(pgresult, i, 2));
-				update_str(&n->client_addr, PQgetvalue(pgresult, i, 3));
-				update_str(&n->repstate, PQgetvalue(pgresult, i, 4));
+				n->usename = intern_str(PQgetvalue(pgresult, i, 1));
+				n->application_name = intern_str(PQgetvalue(pgresult, i, 2));
+				n->client_addr = intern_str(PQgetvalue(pgresult, i, 3));
+				n->repstate = intern_str(PQgetvalue(pgresult, i, 4));
 				update_str(&n->primary, PQgetvalue(pgresult, i, 5));
 				update_str(&n->sent, PQgetvalue(pgresult, i, 6));
 				update_str(&n->write, PQgetvalue(pgresult, i, 7));
 				update_str(&n->flush, PQgetvalue(pgresult, i, 8));
 				update_str(&n->replay, PQgetvalue(pgresult, i, 9));
-				n->sent_lag = atol(PQgetvalue(pgresult, i, 10));
-				n->write_lag = atol(PQgetvalue(pgresult, i, 11));
-				n->flush_lag = atol(PQgetvalue(pgresult, i, 12));
-				n->replay_lag = atol(PQgetvalue(pgresult, i, 13));
+				n->sent_lag = pg_getint(pgresult, i, 10);
+				n->write_lag = pg_getint(pgresult, i, 11);
+				n->flush_lag = pg_getint(pgresult, i, 12);
+				n->replay_lag = pg_getint(pgresult, i, 13);
 
-				memcpy(&pgtable[active_procs++], n, sizeof(struct top_proc));
+				proc_hot_set(active_procs++, n);
 			}
 			else
 			{
-				read_one_proc_stat(n, sel);
 				if (sel->fullcmd == 2)
 				{
 					update_str(&n->name, PQgetvalue(pgresult, i, 1));
 					printable(n->name);
 				}
 				update_state(&n->pgstate, PQgetvalue(pgresult, i, 2));
-				update_str(&n->usename, PQgetvalue(pgresult, i, 3));
-				n->xtime = atol(PQgetvalue(pgresult, i, 4));
-				n->qtime = atol(PQgetvalue(pgresult, i, 5));
-				n->locks = atoi(PQgetvalue(pgresult, i, 6));
+				n->usename = intern_str(PQgetvalue(pgresult, i, 3));
+				n->datname = intern_str(PQgetvalue(pgresult, i, 8));
+				n->xtime = pg_getint(pgresult, i, 4);
+				n->qtime = pg_getint(pgresult, i, 5);
+				n->locks = pg_getint(pgresult, i, 6);
 
 				process_states[n->pgstate]++;
 
-				if (timediff > 0.0)
-				{
-					if ((n->pcpu = (n->time - otime) / timediff) < 0.0001)
-					{
-						n->pcpu = 0;
-					}
-				}
-
 				if ((show_idle || n->pgstate != STATE_IDLE) &&
-					(sel->usename[0] == '\0' ||
-					 strcmp(n->usename, sel->usename) == 0))
-					memcpy(&pgtable[active_procs++], n,
-						   sizeof(struct top_proc));
+					(usename == NULL || n->usename == usename))
+					proc_hot_set(active_procs++, n);
 			}
 			total_procs++;
 		}
+
+		/*
+		 * Only forget the pids that are gone if the query actually told us
+		 * which ones are still around.
+		 */
+		if (pgresult != NULL && PQresultStatus(pgresult) == PGRES_TUPLES_OK)
+			evict_stale_procs();
+
 		if (pgresult != NULL)
 			PQclear(pgresult);
 		disconnect_from_db(conninfo);
@@ -895,11 +1461,16 @@ get_process_info(struct system_info *si,
 		si->procstates = process_states;
 	}
 
-	/* if requested, sort the "active" procs */
+	/* if requested, sort the "active" procs that are going to be shown */
 	if (compare_index >= 0 && si->p_active)
 	{
-		qsort(pgtable, si->p_active, sizeof(struct top_proc),
-			  proc_compares[compare_index]);
+		if (proc_keys[compare_index] != NULL)
+			key_sort(pgtable, si->p_active, sizeof(*pgtable),
+					 sel->topn, proc_keys[compare_index],
+					 proc_compares[compare_index]);
+		else
+			partial_sort(pgtable, si->p_active, sizeof(*pgtable),
+						 sel->topn, proc_compares[compare_index]);
 	}
 
 	/* don't even pretend that the return value thing here isn't bogus */
@@ -924,7 +1495,7 @@ char *
 format_next_io(caddr_t handle)
 {
 	static char fmt[MAX_COLS];	/* static area where result is built */
-	struct top_proc *p = &pgtable[proc_index++];
+	struct top_proc *p = proc_hot.proc[pgtable[proc_index++]];
 
 	if (mode_stats == STATS_DIFF)
 	{
@@ -962,19 +1533,20 @@ char *
 format_next_process(caddr_t handle)
 {
 	static char fmt[MAX_COLS];	/* static area where result is built */
-	struct top_proc *p = &pgtable[proc_index++];
+	int			i = pgtable[proc_index++];
+	struct top_proc *p = proc_hot.proc[i];
 
 	snprintf(fmt, sizeof(fmt),
 			 "%5d %-8.8s %5s %5s %-6s %5s %5s %5.1f %5d %s",
 			 p->pid,
 			 p->usename,
-			 format_k(p->size),
-			 format_k(p->rss),
-			 backendstatenames[p->pgstate],
-			 format_time(p->xtime),
-			 format_time(p->qtime),
-			 p->pcpu * 100.0,
-			 p->locks,
+			 format_k(proc_hot.size[i]),
+			 format_k(proc_hot.rss[i]),
+			 backendstatenames[proc_hot.pgstate[i]],
+			 format_time(proc_hot.xtime[i]),
+			 format_time(proc_hot.qtime[i]),
+			 proc_hot.pcpu[i] * 100.0,
+			 proc_hot.locks[i],
 			 p->name);
 
 	/* return the result */
@@ -985,7 +1557,7 @@ char *
 format_next_replication(caddr_t handle)
 {
 	static char fmt[MAX_COLS];	/* static area where result is built */
-	struct top_proc *p = &pgtable[proc_index++];
+	struct top_proc *p = proc_hot.proc[pgtable[proc_index++]];
 
 	snprintf(fmt, sizeof(fmt),
 			 "%5d %-8.8s %-11.11s %15s %-9.9s %9s %9s %9s %9s %9s %5s %5s %5s %5s",
@@ -1008,6 +1580,114 @@ format_next_replication(caddr_t handle)
 	return (fmt);
 }
 
+/*
+ * The output_next_* routines write out the same rows as the format_next_*
+ * ones, field by field and at full length.
+ */
+
+void
+output_next_io(caddr_t handle)
+{
+	struct top_proc *p = proc_hot.proc[pgtable[proc_index++]];
+
+	output_int("pid", p->pid);
+	output_int("rchar", p->rchar);
+	output_int("wchar", p->wchar);
+	output_int("syscr", p->syscr);
+	output_int("syscw", p->syscw);
+	output_int("read_bytes", p->read_bytes);
+	output_int("write_bytes", p->write_bytes);
+	output_int("cancelled_write_bytes", p->cancelled_write_bytes);
+	output_int("rchar_diff", p->diff_rchar);
+	output_int("wchar_diff", p->diff_wchar);
+	output_int("syscr_diff", p->diff_syscr);
+	output_int("syscw_diff", p->diff_syscw);
+	output_int("read_bytes_diff", p->diff_read_bytes);
+	output_int("write_bytes_diff", p->diff_write_bytes);
+	output_int("cancelled_write_bytes_diff", p->diff_cancelled_write_bytes);
+	output_str("command", p->name);
+}
+
+void
+output_next_process(caddr_t handle)
+{
+	int			i = pgtable[proc_index++];
+	struct top_proc *p = proc_hot.proc[i];
+
+	output_int("pid", p->pid);
+	output_str("username", p->usename);
+	output_int("size", proc_hot.size[i] * 1024LL);
+	output_int("res", proc_hot.rss[i] * 1024LL);
+	output_str("state", backendstatenames[proc_hot.pgstate[i]]);
+	output_int("xtime", proc_hot.xtime[i]);
+	output_int("qtime", proc_hot.qtime[i]);
+	output_double("cpu", proc_hot.pcpu[i] * 100.0);
+	output_int("locks", proc_hot.locks[i]);
+	output_str("command", p->name);
+}
+
+void
+output_next_replication(caddr_t handle)
+{
+	struct top_proc *p = proc_hot.proc[pgtable[proc_index++]];
+
+	output_int("pid", p->pid);
+	output_str("username", p->usename);
+	output_str("application", p->application_name);
+	output_str("client", p->client_addr);
+	output_str("state", p->repstate);
+	output_str("primary", p->primary);
+	output_str("sent", p->sent);
+	output_str("write", p->write);
+	output_str("flush", p->flush);
+	output_str("replay", p->replay);
+	output_int("sent_lag", p->sent_lag);
+	output_int("write_lag", p->write_lag);
+	output_int("flush_lag", p->flush_lag);
+	output_int("replay_lag", p->replay_lag);
+}
+
+/* Fill in "b" with what the metrics are made of for the next process. */
+void
+metrics_next_process(caddr_t handle, struct backend_stats *b)
+{
+	int			i = pgtable[proc_index++];
+	struct top_proc *p = proc_hot.proc[i];
+
+	b->pid = p->pid;
+	b->usename = p->usename;
+	b->datname = p->datname;
+	b->pgstate = proc_hot.pgstate[i];
+	b->pcpu = proc_hot.pcpu[i];
+	b->size = proc_hot.size[i];
+	b->rss = proc_hot.rss[i];
+	b->xtime = proc_hot.xtime[i];
+	b->qtime = proc_hot.qtime[i];
+	b->locks = proc_hot.locks[i];
+	b->command = p->name;
+	b->io.rchar = p->rchar;
+	b->io.wchar = p->wchar;
+	b->io.syscr = p->syscr;
+	b->io.syscw = p->syscw;
+	b->io.read_bytes = p->read_bytes;
+	b->io.write_bytes = p->write_bytes;
+	b->io.cancelled_write_bytes = p->cancelled_write_bytes;
+	b->io_diff.rchar = p->diff_rchar;
+	b->io_diff.wchar = p->diff_wchar;
+	b->io_diff.syscr = p->diff_syscr;
+	b->io_diff.syscw = p->diff_syscw;
+	b->io_diff.read_bytes = p->diff_read_bytes;
+	b->io_diff.write_bytes = p->diff_write_bytes;
+	b->io_diff.cancelled_write_bytes = p->diff_cancelled_write_bytes;
+}
+
+/* Go through the processes from the first one again. */
+void
+rewind_process_info(caddr_t handle)
+{
+	proc_index = 0;
+}
+
 /* comparison routines for qsort */
 
 /*
@@ -1027,35 +1707,40 @@ format_next_replication(caddr_t handle)
    desired ordering.
  */
 
-#define ORDERKEY_CWRITES if ((result = p1->cancelled_write_bytes - \
-                                       p2->cancelled_write_bytes) == 0)
-#define ORDERKEY_LAG_FLUSH  if ((result = p2->flush_lag - p1->flush_lag) == 0)
-#define ORDERKEY_LAG_REPLAY if ((result = p2->replay_lag - \
-                                          p1->replay_lag) == 0)
-#define ORDERKEY_LAG_SENT   if ((result = p2->sent_lag - p1->sent_lag) == 0)
-#define ORDERKEY_LAG_WRITE  if ((result = p2->write_lag - p1->write_lag) == 0)
-#define ORDERKEY_LOCKS   if ((result = p2->locks - p1->locks) == 0)
-#define ORDERKEY_MEM     if ((result = p2->size - p1->size) == 0)
-#define ORDERKEY_NAME    if ((result = strcmp(p1->name, p2->name)) == 0)
-#define ORDERKEY_PCTCPU  if ((result = (int)(p2->pcpu - p1->pcpu)) == 0)
-#define ORDERKEY_QTIME   if ((result = p2->qtime - p1->qtime) == 0)
-#define ORDERKEY_RCHAR   if ((result = p1->rchar - p2->rchar) == 0)
-#define ORDERKEY_READS   if ((result = p1->read_bytes - p2->read_bytes) == 0)
-#define ORDERKEY_RSSIZE  if ((result = p2->rss - p1->rss) == 0)
-#define ORDERKEY_STATE   if ((result = p1->pgstate < p2->pgstate))
-#define ORDERKEY_SYSCR   if ((result = p1->syscr - p2->syscr) == 0)
-#define ORDERKEY_SYSCW   if ((result = p1->syscw - p2->syscw) == 0)
-#define ORDERKEY_WCHAR   if ((result = p1->wchar - p2->wchar) == 0)
-#define ORDERKEY_WRITES  if ((result = p1->write_bytes - p2->write_bytes) == 0)
-#define ORDERKEY_XTIME   if ((result = p2->xtime - p1->xtime) == 0)
+#define CMP(a, b)        (((a) > (b)) - ((a) < (b)))
+
+/* rows i1 and i2 of proc_hot */
+#define HOT1(column)     (proc_hot.column[i1])
+#define HOT2(column)     (proc_hot.column[i2])
+
+#define ORDERKEY_CWRITES if ((result = CMP(HOT1(cancelled_write_bytes), \
+                                           HOT2(cancelled_write_bytes))) == 0)
+#define ORDERKEY_LAG_FLUSH  if ((result = CMP(HOT2(flush_lag), HOT1(flush_lag))) == 0)
+#define ORDERKEY_LAG_REPLAY if ((result = CMP(HOT2(replay_lag), HOT1(replay_lag))) == 0)
+#define ORDERKEY_LAG_SENT   if ((result = CMP(HOT2(sent_lag), HOT1(sent_lag))) == 0)
+#define ORDERKEY_LAG_WRITE  if ((result = CMP(HOT2(write_lag), HOT1(write_lag))) == 0)
+#define ORDERKEY_LOCKS   if ((result = CMP(HOT2(locks), HOT1(locks))) == 0)
+#define ORDERKEY_MEM     if ((result = CMP(HOT2(size), HOT1(size))) == 0)
+#define ORDERKEY_NAME    if ((result = strcmp(HOT1(proc)->name, HOT2(proc)->name)) == 0)
+#define ORDERKEY_PCTCPU  if ((result = CMP(HOT2(pcpu), HOT1(pcpu))) == 0)
+#define ORDERKEY_QTIME   if ((result = CMP(HOT2(qtime), HOT1(qtime))) == 0)
+#define ORDERKEY_RCHAR   if ((result = CMP(HOT1(rchar), HOT2(rchar))) == 0)
+#define ORDERKEY_READS   if ((result = CMP(HOT1(read_bytes), HOT2(read_bytes))) == 0)
+#define ORDERKEY_RSSIZE  if ((result = CMP(HOT2(rss), HOT1(rss))) == 0)
+#define ORDERKEY_STATE   if ((result = CMP(HOT2(pgstate), HOT1(pgstate))) == 0)
+#define ORDERKEY_SYSCR   if ((result = CMP(HOT1(syscr), HOT2(syscr))) == 0)
+#define ORDERKEY_SYSCW   if ((result = CMP(HOT1(syscw), HOT2(syscw))) == 0)
+#define ORDERKEY_WCHAR   if ((result = CMP(HOT1(wchar), HOT2(wchar))) == 0)
+#define ORDERKEY_WRITES  if ((result = CMP(HOT1(write_bytes), HOT2(write_bytes))) == 0)
+#define ORDERKEY_XTIME   if ((result = CMP(HOT2(xtime), HOT1(xtime))) == 0)
 
 /* compare_cmd - the comparison function for sorting by command name */
 
 static int
 compare_cmd(const void *v1, const void *v2)
 {
-	struct top_proc *p1 = (struct top_proc *) v1;
-	struct top_proc *p2 = (struct top_proc *) v2;
+	int			i1 = *(const int *) v1;
+	int			i2 = *(const int *) v2;
 	int			result;
 
 	ORDERKEY_NAME
@@ -1073,8 +1758,8 @@ compare_cmd(const void *v1, const void *v2)
 static int
 compare_cpu(const void *v1, const void *v2)
 {
-	struct top_proc *p1 = (struct top_proc *) v1;
-	struct top_proc *p2 = (struct top_proc *) v2;
+	int			i1 = *(const int *) v1;
+	int			i2 = *(const int *) v2;
 	int			result;
 
 	ORDERKEY_PCTCPU
@@ -1089,8 +1774,8 @@ compare_cpu(const void *v1, const void *v2)
 static int
 compare_cwrites(const void *v1, const void *v2)
 {
-	struct top_proc *p1 = (struct top_proc *) v1;
-	struct top_proc *p2 = (struct top_proc *) v2;
+	int			i1 = *(const int *) v1;
+	int			i2 = *(const int *) v2;
 	int			result;
 
 	ORDERKEY_CWRITES
@@ -1109,8 +1794,8 @@ compare_cwrites(const void *v1, const void *v2)
 static int
 compare_lag_flush(const void *v1, const void *v2)
 {
-	struct top_proc *p1 = (struct top_proc *) v1;
-	struct top_proc *p2 = (struct top_proc *) v2;
+	int			i1 = *(const int *) v1;
+	int			i2 = *(const int *) v2;
 	int			result;
 
 	ORDERKEY_LAG_FLUSH
@@ -1126,8 +1811,8 @@ compare_lag_flush(const void *v1, const void *v2)
 static int
 compare_lag_replay(const void *v1, const void *v2)
 {
-	struct top_proc *p1 = (struct top_proc *) v1;
-	struct top_proc *p2 = (struct top_proc *) v2;
+	int			i1 = *(const int *) v1;
+	int			i2 = *(const int *) v2;
 	int			result;
 
 	ORDERKEY_LAG_REPLAY
@@ -1143,8 +1828,8 @@ compare_lag_replay(const void *v1, const void *v2)
 static int
 compare_lag_sent(const void *v1, const void *v2)
 {
-	struct top_proc *p1 = (struct top_proc *) v1;
-	struct top_proc *p2 = (struct top_proc *) v2;
+	int			i1 = *(const int *) v1;
+	int			i2 = *(const int *) v2;
 	int			result;
 
 	ORDERKEY_LAG_SENT
@@ -1160,8 +1845,8 @@ compare_lag_sent(const void *v1, const void *v2)
 static int
 compare_lag_write(const void *v1, const void *v2)
 {
-	struct top_proc *p1 = (struct top_proc *) v1;
-	struct top_proc *p2 = (struct top_proc *) v2;
+	int			i1 = *(const int *) v1;
+	int			i2 = *(const int *) v2;
 	int			result;
 
 	ORDERKEY_LAG_WRITE
@@ -1181,8 +1866,8 @@ compare_lag_write(const void *v1, const void *v2)
 static int
 compare_locks(const void *v1, const void *v2)
 {
-	struct top_proc *p1 = (struct top_proc *) v1;
-	struct top_proc *p2 = (struct top_proc *) v2;
+	int			i1 = *(const int *) v1;
+	int			i2 = *(const int *) v2;
 	int			result;
 
 	ORDERKEY_LOCKS
@@ -1201,8 +1886,8 @@ compare_locks(const void *v1, const void *v2)
 static int
 compare_qtime(const void *v1, const void *v2)
 {
-	struct top_proc *p1 = (struct top_proc *) v1;
-	struct top_proc *p2 = (struct top_proc *) v2;
+	int			i1 = *(const int *) v1;
+	int			i2 = *(const int *) v2;
 	int			result;
 
 	ORDERKEY_QTIME
@@ -1218,8 +1903,8 @@ compare_qtime(const void *v1, const void *v2)
 static int
 compare_rchar(const void *v1, const void *v2)
 {
-	struct top_proc *p1 = (struct top_proc *) v1;
-	struct top_proc *p2 = (struct top_proc *) v2;
+	int			i1 = *(const int *) v1;
+	int			i2 = *(const int *) v2;
 	int			result;
 
 	ORDERKEY_RCHAR
@@ -1238,8 +1923,8 @@ compare_rchar(const void *v1, const void *v2)
 static int
 compare_reads(const void *v1, const void *v2)
 {
-	struct top_proc *p1 = (struct top_proc *) v1;
-	struct top_proc *p2 = (struct top_proc *) v2;
+	int			i1 = *(const int *) v1;
+	int			i2 = *(const int *) v2;
 	int			result;
 
 	ORDERKEY_READS
@@ -1260,8 +1945,8 @@ compare_reads(const void *v1, const void *v2)
 static int
 compare_res(const void *v1, const void *v2)
 {
-	struct top_proc *p1 = (struct top_proc *) v1;
-	struct top_proc *p2 = (struct top_proc *) v2;
+	int			i1 = *(const int *) v1;
+	int			i2 = *(const int *) v2;
 	int			result;
 
 	ORDERKEY_RSSIZE
@@ -1278,8 +1963,8 @@ compare_res(const void *v1, const void *v2)
 static int
 compare_size(const void *v1, const void *v2)
 {
-	struct top_proc *p1 = (struct top_proc *) v1;
-	struct top_proc *p2 = (struct top_proc *) v2;
+	int			i1 = *(const int *) v1;
+	int			i2 = *(const int *) v2;
 	int			result;
 
 	ORDERKEY_MEM
@@ -1294,8 +1979,8 @@ compare_size(const void *v1, const void *v2)
 static int
 compare_syscr(const void *v1, const void *v2)
 {
-	struct top_proc *p1 = (struct top_proc *) v1;
-	struct top_proc *p2 = (struct top_proc *) v2;
+	int			i1 = *(const int *) v1;
+	int			i2 = *(const int *) v2;
 	int			result;
 
 	ORDERKEY_SYSCR
@@ -1314,8 +1999,8 @@ compare_syscr(const void *v1, const void *v2)
 static int
 compare_syscw(const void *v1, const void *v2)
 {
-	struct top_proc *p1 = (struct top_proc *) v1;
-	struct top_proc *p2 = (struct top_proc *) v2;
+	int			i1 = *(const int *) v1;
+	int			i2 = *(const int *) v2;
 	int			result;
 
 	ORDERKEY_SYSCW
@@ -1336,8 +2021,8 @@ compare_syscw(const void *v1, const void *v2)
 static int
 compare_xtime(const void *v1, const void *v2)
 {
-	struct top_proc *p1 = (struct top_proc *) v1;
-	struct top_proc *p2 = (struct top_proc *) v2;
+	int			i1 = *(const int *) v1;
+	int			i2 = *(const int *) v2;
 	int			result;
 
 	ORDERKEY_XTIME
@@ -1353,8 +2038,8 @@ compare_xtime(const void *v1, const void *v2)
 static int
 compare_wchar(const void *v1, const void *v2)
 {
-	struct top_proc *p1 = (struct top_proc *) v1;
-	struct top_proc *p2 = (struct top_proc *) v2;
+	int			i1 = *(const int *) v1;
+	int			i2 = *(const int *) v2;
 	int			result;
 
 	ORDERKEY_WCHAR
@@ -1373,8 +2058,8 @@ compare_wchar(const void *v1, const void *v2)
 static int
 compare_writes(const void *v1, const void *v2)
 {
-	struct top_proc *p1 = (struct top_proc *) v1;
-	struct top_proc *p2 = (struct top_proc *) v2;
+	int			i1 = *(const int *) v1;
+	int			i2 = *(const int *) v2;
 	int			result;
 
 	ORDERKEY_WRITES
@@ -1389,3 +2074,55 @@ compare_writes(const void *v1, const void *v2)
 
 	return (result);
 }
+
+/*
+ * Sort keys for key_sort.  Each packs the first two ORDERKEYs of the
+ * matching comparison function so that the keys sort in the same order.
+ */
+
+#define SORTKEY_CWRITES    sort_key_int(proc_hot.cancelled_write_bytes[i])
+#define SORTKEY_LAG_FLUSH  (~sort_key_int(proc_hot.flush_lag[i]))
+#define SORTKEY_LAG_REPLAY (~sort_key_int(proc_hot.replay_lag[i]))
+#define SORTKEY_LAG_SENT   (~sort_key_int(proc_hot.sent_lag[i]))
+#define SORTKEY_LAG_WRITE  (~sort_key_int(proc_hot.write_lag[i]))
+#define SORTKEY_LOCKS      (~sort_key_int(proc_hot.locks[i]))
+#define SORTKEY_MEM        (~sort_key_int(proc_hot.size[i]))
+#define SORTKEY_PCTCPU     (~sort_key_double(proc_hot.pcpu[i]))
+#define SORTKEY_QTIME      (~sort_key_int(proc_hot.qtime[i]))
+#define SORTKEY_RCHAR      sort_key_int(proc_hot.rchar[i])
+#define SORTKEY_READS      sort_key_int(proc_hot.read_bytes[i])
+#define SORTKEY_RSSIZE     (~sort_key_int(proc_hot.rss[i]))
+#define SORTKEY_STATE      (~sort_key_int(proc_hot.pgstate[i]))
+#define SORTKEY_SYSCR      sort_key_int(proc_hot.syscr[i])
+#define SORTKEY_SYSCW      sort_key_int(proc_hot.syscw[i])
+#define SORTKEY_WCHAR      sort_key_int(proc_hot.wchar[i])
+#define SORTKEY_WRITES     sort_key_int(proc_hot.write_bytes[i])
+#define SORTKEY_XTIME      (~sort_key_int(proc_hot.xtime[i]))
+
+#define PROC_SORTKEY(name, primary, secondary) \
+static void \
+key_##name(const void *v, uint64_t *hi, uint64_t *lo) \
+{ \
+	int			i = *(const int *) v; \
+\
+	*hi = primary; \
+	*lo = secondary; \
+}
+
+PROC_SORTKEY(cpu, SORTKEY_PCTCPU, SORTKEY_STATE)
+PROC_SORTKEY(size, SORTKEY_MEM, SORTKEY_RSSIZE)
+PROC_SORTKEY(res, SORTKEY_RSSIZE, SORTKEY_MEM)
+PROC_SORTKEY(xtime, SORTKEY_XTIME, SORTKEY_PCTCPU)
+PROC_SORTKEY(qtime, SORTKEY_QTIME, SORTKEY_PCTCPU)
+PROC_SORTKEY(rchar, SORTKEY_RCHAR, SORTKEY_WCHAR)
+PROC_SORTKEY(wchar, SORTKEY_WCHAR, SORTKEY_RCHAR)
+PROC_SORTKEY(syscr, SORTKEY_SYSCR, SORTKEY_RCHAR)
+PROC_SORTKEY(syscw, SORTKEY_SYSCW, SORTKEY_RCHAR)
+PROC_SORTKEY(reads, SORTKEY_READS, SORTKEY_RCHAR)
+PROC_SORTKEY(writes, SORTKEY_WRITES, SORTKEY_RCHAR)
+PROC_SORTKEY(cwrites, SORTKEY_CWRITES, SORTKEY_RCHAR)
+PROC_SORTKEY(locks, SORTKEY_LOCKS, SORTKEY_QTIME)
+PROC_SORTKEY(lag_flush, SORTKEY_LAG_FLUSH, SORTKEY_PCTCPU)
+PROC_SORTKEY(lag_replay, SORTKEY_LAG_REPLAY, SORTKEY_PCTCPU)
+PROC_SORTKEY(lag_sent, SORTKEY_LAG_SENT, SORTKEY_PCTCPU)
+PROC_SORTKEY(lag_write, SORTKEY_LAG_WRITE, SORTKEY_PCTCPU)
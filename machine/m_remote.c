@@ -7,94 +7,81 @@
 #include <bsd/stdlib.h>
 #include <bsd/sys/tree.h>
 #endif							/* __linux__ */
+#include <stdint.h>
 #include <string.h>
 #include <sys/time.h>
+#include <time.h>
 #include <unistd.h>
 #include <libpq-fe.h>
 
 #include "pg.h"
 
 #include "remote.h"
+#include "output.h"
 #include "utils.h"
 
-#define QUERY_CPUTIME \
-		"SELECT user, nice, system, idle, iowait\n" \
-		"FROM pg_cputime()"
-
-#define QUERY_LOADAVG \
-		"SELECT load1, load5, load15, last_pid\n" \
-		"FROM pg_loadavg()"
-
-#define QUERY_MEMUSAGE \
-		"SELECT memused, memfree, memshared, membuffers, memcached,\n" \
+/*
+ * The system wide numbers, all in one row.  "user" has to be qualified or it
+ * means current_user.
+ */
+#define QUERY_SYSTEM \
+		"SELECT load1, load5, load15, last_pid,\n" \
+		"       c.\"user\", nice, system, idle, iowait,\n" \
+		"       memused, memfree, memshared, membuffers, memcached,\n" \
 		"       swapused, swapfree, swapcached\n" \
-		"FROM pg_memusage()"
+		"FROM pg_loadavg(), pg_cputime() c, pg_memusage()"
 
-#define QUERY_PROCTAB \
+/*
+ * Everything needed for a refresh in one round trip: the system wide numbers
+ * followed by the processes.  The outer join on the processes makes sure
+ * there is always a row to carry the system wide numbers.
+ */
+#define QUERY_SNAPSHOT(command) \
 		"WITH lock_activity AS\n" \
 		"(\n" \
 		"     SELECT pid, count(*) AS lock_count\n" \
 		"     FROM pg_locks\n" \
 		"     GROUP BY pid\n" \
-		")\n" \
-		"SELECT a.pid, comm, fullcomm, a.state, utime, stime,\n" \
-		"       starttime, vsize, rss, usename, rchar, wchar,\n" \
-		"       syscr, syscw, reads, writes, cwrites, b.state,\n" \
-		"       extract(EPOCH FROM age(clock_timestamp(),\n" \
-		"                              xact_start))::BIGINT,\n" \
-		"       extract(EPOCH FROM age(clock_timestamp(),\n" \
-		"                              query_start))::BIGINT,\n" \
-		"       coalesce(lock_count, 0) AS lock_count\n" \
-		"FROM pg_proctab() a LEFT OUTER JOIN pg_stat_activity b\n" \
-		"                    ON a.pid = b.pid\n" \
-		"     LEFT OUTER JOIN lock_activity c\n" \
-		"  ON a.pid = c.pid;"
-
-#define QUERY_PROCTAB_QUERY \
-		"WITH lock_activity AS\n" \
+		"),\n" \
+		"system_stats AS\n" \
 		"(\n" \
-		"     SELECT pid, count(*) AS lock_count\n" \
-		"     FROM pg_locks\n" \
-		"     GROUP BY pid\n" \
+		QUERY_SYSTEM "\n" \
 		")\n" \
-		"SELECT a.pid, comm, query, a.state, utime, stime,\n" \
+		"SELECT s.*, p.*\n" \
+		"FROM system_stats s LEFT OUTER JOIN\n" \
+		"(\n" \
+		"SELECT a.pid, comm, " command ", a.state, utime, stime,\n" \
 		"       starttime, vsize, rss, usename, rchar, wchar,\n" \
-		"       syscr, syscw, reads, writes, cwrites, b.state,\n" \
+		"       syscr, syscw, reads, writes, cwrites, b.state AS pgstate,\n" \
 		"       extract(EPOCH FROM age(clock_timestamp(),\n" \
 		"                              xact_start))::BIGINT,\n" \
 		"       extract(EPOCH FROM age(clock_timestamp(),\n" \
 		"                              query_start))::BIGINT,\n" \
-		"       coalesce(lock_count, 0) AS lock_count\n" \
+		"       coalesce(lock_count, 0) AS lock_count, datname\n" \
 		"FROM pg_proctab() a LEFT OUTER JOIN pg_stat_activity b\n" \
 		"                    ON a.pid = b.pid\n" \
 		"     LEFT OUTER JOIN lock_activity c\n" \
-		"  ON a.pid = c.pid;"
+		"  ON a.pid = c.pid\n" \
+		") p ON true;"
+
+#define QUERY_PROCTAB QUERY_SNAPSHOT("fullcomm")
+#define QUERY_PROCTAB_QUERY QUERY_SNAPSHOT("query")
 
 #define QUERY_PG_PROC \
 		"SELECT COUNT(*)\n" \
 		"FROM pg_catalog.pg_proc\n" \
 		"WHERE proname = '%s'"
 
-enum column_cputime
-{
-	c_cpu_user, c_cpu_nice, c_cpu_system, c_cpu_idle,
-	c_cpu_iowait
-};
-enum column_loadavg
-{
-	c_load1, c_load5, c_load15, c_last_pid
-};
-enum column_memusage
+enum column_snapshot
 {
+	c_load1, c_load5, c_load15, c_last_pid,
+	c_cpu_user, c_cpu_nice, c_cpu_system, c_cpu_idle, c_cpu_iowait,
 	c_memused, c_memfree, c_memshared, c_membuffers,
-	c_memcached, c_swapused, c_swapfree, c_swapcached
-};
-enum column_proctab
-{
+	c_memcached, c_swapused, c_swapfree, c_swapcached,
 	c_pid, c_comm, c_fullcomm, c_state, c_utime, c_stime,
 	c_starttime, c_vsize, c_rss, c_username,
 	c_rchar, c_wchar, c_syscr, c_syscw, c_reads, c_writes, c_cwrites,
-	c_pgstate, c_xtime, c_qtime, c_locks
+	c_pgstate, c_xtime, c_qtime, c_locks, c_datname
 };
 
 #define bytetok(x)  (((x) + 512) >> 10)
@@ -121,8 +108,10 @@ struct top_proc_r
 {
 	RB_ENTRY(top_proc_r) entry;
 	pid_t		pid;
+	unsigned int generation;	/* refresh in which the pid was last seen */
 	char	   *name;
-	char	   *usename;
+	char	   *usename;		/* interned */
+	char	   *datname;		/* interned */
 	unsigned long size;
 	unsigned long rss;			/* in k */
 	int			state;
@@ -153,9 +142,9 @@ struct top_proc_r
 	long long	cancelled_write_bytes;
 
 	/* Replication data */
-	char	   *application_name;
-	char	   *client_addr;
-	char	   *repstate;
+	char	   *application_name;	/* interned */
+	char	   *client_addr;	/* interned */
+	char	   *repstate;		/* interned */
 	char	   *primary;
 	char	   *sent;
 	char	   *write;
@@ -165,11 +154,19 @@ struct top_proc_r
 	long long	write_lag;
 	long long	flush_lag;
 	long long	replay_lag;
+
+	struct top_proc_r *next_free;	/* link in proc_r_free_list */
 };
 
 static time_t boottime = -1;
-static struct top_proc_r *pgrtable;
+static struct top_proc_r **pgrtable;	/* the active entries, in display order */
+static int	pgrtable_size = 0;
+static struct top_proc_r *proc_r_free_list = NULL;
 static int	proc_r_index;
+static unsigned int generation = 0;
+
+/* Result fetched by get_system_info_r() for get_process_info_r() to use. */
+static PGresult *snapshot = NULL;
 
 int			topprocrcmp(struct top_proc_r *, struct top_proc_r *);
 
@@ -187,12 +184,19 @@ static char *memorynames[NMEMSTATS + 1] =
 	"K used, ", "K free, ", "K shared, ", "K buffers, ", "K cached", NULL
 };
 
-/* these are names given to allowed sorting orders -- first is default */
+/*
+ * these are names given to allowed sorting orders -- first is default.
+ * Only the first NPROCORDERS sort the processes, the rest are for the
+ * table, index and statement displays.
+ */
+#define NPROCORDERS 18
 static char *ordernames[] =
 {
 	"cpu", "size", "res", "xtime", "qtime", "rchar", "wchar", "syscr",
 	"syscw", "reads", "writes", "cwrites", "locks", "command", "flag",
-	"rlag", "slag", "wlag", NULL
+	"rlag", "slag", "wlag", "seqscan", "idxscan", "ins", "upd", "del",
+	"hits", "idxhits", "idxread", "idxtup", "fetch", "calls", "time",
+	"mean", "rows", "temp", NULL
 };
 
 static char *swapnames[NSWAPSTATS + 1] =
@@ -227,32 +231,35 @@ static long memory_stats[NMEMSTATS];
 static int	process_states[NPROCSTATES];
 static long swap_stats[NSWAPSTATS];
 
-static struct timeval lasttime;
+static struct timespec lasttime;
 
 static int64_t cp_time[NCPUSTATES];
 static int64_t cp_old[NCPUSTATES];
 static int64_t cp_diff[NCPUSTATES];
 
-#define ORDERKEY_PCTCPU  if ((result = (int)(p2->pcpu - p1->pcpu)) == 0)
-#define ORDERKEY_STATE	 if ((result = p1->pgstate < p2->pgstate))
-#define ORDERKEY_RSSIZE  if ((result = p2->rss - p1->rss) == 0)
-#define ORDERKEY_LAG_FLUSH  if ((result = p2->flush_lag - p1->flush_lag) == 0)
-#define ORDERKEY_LAG_REPLAY if ((result = p2->replay_lag - \
-                                          p1->replay_lag) == 0)
-#define ORDERKEY_LAG_SENT   if ((result = p2->sent_lag - p1->sent_lag) == 0)
-#define ORDERKEY_LAG_WRITE  if ((result = p2->write_lag - p1->write_lag) == 0)
-#define ORDERKEY_MEM	 if ((result = p2->size - p1->size) == 0)
-#define ORDERKEY_NAME	if ((result = strcmp(p1->name, p2->name)) == 0)
-#define ORDERKEY_RCHAR	 if ((result = p1->rchar - p2->rchar) == 0)
-#define ORDERKEY_WCHAR	 if ((result = p1->wchar - p2->wchar) == 0)
-#define ORDERKEY_SYSCR	 if ((result = p1->syscr - p2->syscr) == 0)
-#define ORDERKEY_SYSCW	 if ((result = p1->syscw - p2->syscw) == 0)
-#define ORDERKEY_READS	 if ((result = p1->read_bytes - p2->read_bytes) == 0)
-#define ORDERKEY_WRITES	 if ((result = p1->write_bytes - p2->write_bytes) == 0)
-#define ORDERKEY_CWRITES if ((result = p1->cancelled_write_bytes - p2->cancelled_write_bytes) == 0)
-#define ORDERKEY_XTIME if ((result = p2->xtime - p1->xtime) == 0)
-#define ORDERKEY_QTIME if ((result = p2->qtime - p1->qtime) == 0)
-#define ORDERKEY_LOCKS if ((result = p2->locks - p1->locks) == 0)
+#define CMP(a, b)        (((a) > (b)) - ((a) < (b)))
+
+#define ORDERKEY_CWRITES if ((result = CMP(p1->cancelled_write_bytes, \
+                                           p2->cancelled_write_bytes)) == 0)
+#define ORDERKEY_LAG_FLUSH  if ((result = CMP(p2->flush_lag, p1->flush_lag)) == 0)
+#define ORDERKEY_LAG_REPLAY if ((result = CMP(p2->replay_lag, \
+                                              p1->replay_lag)) == 0)
+#define ORDERKEY_LAG_SENT   if ((result = CMP(p2->sent_lag, p1->sent_lag)) == 0)
+#define ORDERKEY_LAG_WRITE  if ((result = CMP(p2->write_lag, p1->write_lag)) == 0)
+#define ORDERKEY_LOCKS   if ((result = CMP(p2->locks, p1->locks)) == 0)
+#define ORDERKEY_MEM     if ((result = CMP(p2->size, p1->size)) == 0)
+#define ORDERKEY_NAME    if ((result = strcmp(p1->name, p2->name)) == 0)
+#define ORDERKEY_PCTCPU  if ((result = CMP(p2->pcpu, p1->pcpu)) == 0)
+#define ORDERKEY_QTIME   if ((result = CMP(p2->qtime, p1->qtime)) == 0)
+#define ORDERKEY_RCHAR   if ((result = CMP(p1->rchar, p2->rchar)) == 0)
+#define ORDERKEY_READS   if ((result = CMP(p1->read_bytes, p2->read_bytes)) == 0)
+#define ORDERKEY_RSSIZE  if ((result = CMP(p2->rss, p1->rss)) == 0)
+#define ORDERKEY_STATE   if ((result = CMP(p2->pgstate, p1->pgstate)) == 0)
+#define ORDERKEY_SYSCR   if ((result = CMP(p1->syscr, p2->syscr)) == 0)
+#define ORDERKEY_SYSCW   if ((result = CMP(p1->syscw, p2->syscw)) == 0)
+#define ORDERKEY_WCHAR   if ((result = CMP(p1->wchar, p2->wchar)) == 0)
+#define ORDERKEY_WRITES  if ((result = CMP(p1->write_bytes, p2->write_bytes)) == 0)
+#define ORDERKEY_XTIME   if ((result = CMP(p2->xtime, p1->xtime)) == 0)
 
 int			check_for_function(PGconn *, char *);
 static int	compare_cmd_r(const void *, const void *);
@@ -273,6 +280,90 @@ static int	compare_syscw_r(const void *, const void *);
 static int	compare_wchar_r(const void *, const void *);
 static int	compare_writes_r(const void *, const void *);
 static int	compare_xtime_r(const void *, const void *);
+static void key_cpu_r(const void *, uint64_t *, uint64_t *);
+static void key_size_r(const void *, uint64_t *, uint64_t *);
+static void key_res_r(const void *, uint64_t *, uint64_t *);
+static void key_xtime_r(const void *, uint64_t *, uint64_t *);
+static void key_qtime_r(const void *, uint64_t *, uint64_t *);
+static void key_rchar_r(const void *, uint64_t *, uint64_t *);
+static void key_wchar_r(const void *, uint64_t *, uint64_t *);
+static void key_syscr_r(const void *, uint64_t *, uint64_t *);
+static void key_syscw_r(const void *, uint64_t *, uint64_t *);
+static void key_reads_r(const void *, uint64_t *, uint64_t *);
+static void key_writes_r(const void *, uint64_t *, uint64_t *);
+static void key_cwrites_r(const void *, uint64_t *, uint64_t *);
+static void key_locks_r(const void *, uint64_t *, uint64_t *);
+static void key_lag_flush(const void *, uint64_t *, uint64_t *);
+static void key_lag_replay(const void *, uint64_t *, uint64_t *);
+static void key_lag_sent(const void *, uint64_t *, uint64_t *);
+static void key_lag_write(const void *, uint64_t *, uint64_t *);
+
+/*
+ * Get a cleared process entry from the free list, refilling it a block of
+ * PROCBLOCK_SIZE entries at a time.
+ */
+static struct top_proc_r *
+alloc_proc_r(void)
+{
+	struct top_proc_r *proc;
+	int			i;
+
+	if (proc_r_free_list == NULL)
+	{
+		proc = malloc(PROCBLOCK_SIZE * sizeof(struct top_proc_r));
+		if (proc == NULL)
+		{
+			fprintf(stderr, "malloc error\n");
+			exit(1);
+		}
+		for (i = 0; i < PROCBLOCK_SIZE; i++)
+		{
+			proc[i].next_free = proc_r_free_list;
+			proc_r_free_list = &proc[i];
+		}
+	}
+
+	proc = proc_r_free_list;
+	proc_r_free_list = proc->next_free;
+
+	memset(proc, 0, sizeof(struct top_proc_r));
+	return proc;
+}
+
+/*
+ * Release a process entry that has dropped out of the tree along with the
+ * strings it owns, and put it back on the free list.
+ */
+static void
+free_proc_r(struct top_proc_r *proc)
+{
+	free(proc->name);
+	free(proc->primary);
+	free(proc->sent);
+	free(proc->write);
+	free(proc->flush);
+	free(proc->replay);
+
+	proc->next_free = proc_r_free_list;
+	proc_r_free_list = proc;
+}
+
+/* Remove every entry that was not seen during the current refresh. */
+static void
+evict_stale_procs_r(void)
+{
+	struct top_proc_r *n,
+			   *next;
+
+	RB_FOREACH_SAFE(n, pgprocr, &head_proc_r, next)
+	{
+		if (n->generation != generation)
+		{
+			RB_REMOVE(pgprocr, &head_proc_r, n);
+			free_proc_r(n);
+		}
+	}
+}
 
 int
 check_for_function(PGconn *pgconn, char *procname)
@@ -325,13 +416,40 @@ int			(*proc_compares_r[]) () =
 		NULL
 };
 
+/*
+ * Packed first and second keys for each of the orders above, for key_sort.
+ * Sorting by command name has to go through the comparison function.
+ */
+static void (*proc_keys_r[]) (const void *, uint64_t *, uint64_t *) =
+{
+	key_cpu_r,
+		key_size_r,
+		key_res_r,
+		key_xtime_r,
+		key_qtime_r,
+		key_rchar_r,
+		key_wchar_r,
+		key_syscr_r,
+		key_syscw_r,
+		key_reads_r,
+		key_writes_r,
+		key_cwrites_r,
+		key_locks_r,
+		NULL,
+		key_lag_flush,
+		key_lag_replay,
+		key_lag_sent,
+		key_lag_write,
+		NULL
+};
+
 /* The comparison function for sorting by command name. */
 
 static int
 compare_cmd_r(const void *v1, const void *v2)
 {
-	struct top_proc_r *p1 = (struct top_proc_r *) v1;
-	struct top_proc_r *p2 = (struct top_proc_r *) v2;
+	struct top_proc_r *p1 = *(struct top_proc_r **) v1;
+	struct top_proc_r *p2 = *(struct top_proc_r **) v2;
 	int			result;
 
 	ORDERKEY_NAME
@@ -349,8 +467,8 @@ compare_cmd_r(const void *v1, const void *v2)
 static int
 compare_cpu_r(const void *v1, const void *v2)
 {
-	struct top_proc_r *p1 = (struct top_proc_r *) v1;
-	struct top_proc_r *p2 = (struct top_proc_r *) v2;
+	struct top_proc_r *p1 = *(struct top_proc_r **) v1;
+	struct top_proc_r *p2 = *(struct top_proc_r **) v2;
 	int			result;
 
 	ORDERKEY_PCTCPU
@@ -365,8 +483,8 @@ compare_cpu_r(const void *v1, const void *v2)
 static int
 compare_cwrites_r(const void *v1, const void *v2)
 {
-	struct top_proc_r *p1 = (struct top_proc_r *) v1;
-	struct top_proc_r *p2 = (struct top_proc_r *) v2;
+	struct top_proc_r *p1 = *(struct top_proc_r **) v1;
+	struct top_proc_r *p2 = *(struct top_proc_r **) v2;
 	int			result;
 
 	ORDERKEY_CWRITES
@@ -385,8 +503,8 @@ compare_cwrites_r(const void *v1, const void *v2)
 static int
 compare_lag_flush(const void *v1, const void *v2)
 {
-	struct top_proc_r *p1 = (struct top_proc_r *) v1;
-	struct top_proc_r *p2 = (struct top_proc_r *) v2;
+	struct top_proc_r *p1 = *(struct top_proc_r **) v1;
+	struct top_proc_r *p2 = *(struct top_proc_r **) v2;
 	int			result;
 
 	ORDERKEY_LAG_FLUSH
@@ -402,8 +520,8 @@ compare_lag_flush(const void *v1, const void *v2)
 static int
 compare_lag_replay(const void *v1, const void *v2)
 {
-	struct top_proc_r *p1 = (struct top_proc_r *) v1;
-	struct top_proc_r *p2 = (struct top_proc_r *) v2;
+	struct top_proc_r *p1 = *(struct top_proc_r **) v1;
+	struct top_proc_r *p2 = *(struct top_proc_r **) v2;
 	int			result;
 
 	ORDERKEY_LAG_REPLAY
@@ -419,8 +537,8 @@ compare_lag_replay(const void *v1, const void *v2)
 static int
 compare_lag_sent(const void *v1, const void *v2)
 {
-	struct top_proc_r *p1 = (struct top_proc_r *) v1;
-	struct top_proc_r *p2 = (struct top_proc_r *) v2;
+	struct top_proc_r *p1 = *(struct top_proc_r **) v1;
+	struct top_proc_r *p2 = *(struct top_proc_r **) v2;
 	int			result;
 
 	ORDERKEY_LAG_SENT
@@ -436,8 +554,8 @@ compare_lag_sent(const void *v1, const void *v2)
 static int
 compare_lag_write(const void *v1, const void *v2)
 {
-	struct top_proc_r *p1 = (struct top_proc_r *) v1;
-	struct top_proc_r *p2 = (struct top_proc_r *) v2;
+	struct top_proc_r *p1 = *(struct top_proc_r **) v1;
+	struct top_proc_r *p2 = *(struct top_proc_r **) v2;
 	int			result;
 
 	ORDERKEY_LAG_WRITE
@@ -458,8 +576,8 @@ compare_lag_write(const void *v1, const void *v2)
 int
 compare_locks_r(const void *v1, const void *v2)
 {
-	struct top_proc_r *p1 = (struct top_proc_r *) v1;
-	struct top_proc_r *p2 = (struct top_proc_r *) v2;
+	struct top_proc_r *p1 = *(struct top_proc_r **) v1;
+	struct top_proc_r *p2 = *(struct top_proc_r **) v2;
 	int			result;
 
 	ORDERKEY_LOCKS
@@ -478,8 +596,8 @@ compare_locks_r(const void *v1, const void *v2)
 static int
 compare_qtime_r(const void *v1, const void *v2)
 {
-	struct top_proc_r *p1 = (struct top_proc_r *) v1;
-	struct top_proc_r *p2 = (struct top_proc_r *) v2;
+	struct top_proc_r *p1 = *(struct top_proc_r **) v1;
+	struct top_proc_r *p2 = *(struct top_proc_r **) v2;
 	int			result;
 
 	ORDERKEY_QTIME
@@ -497,8 +615,8 @@ compare_qtime_r(const void *v1, const void *v2)
 static int
 compare_res_r(const void *v1, const void *v2)
 {
-	struct top_proc_r *p1 = (struct top_proc_r *) v1;
-	struct top_proc_r *p2 = (struct top_proc_r *) v2;
+	struct top_proc_r *p1 = *(struct top_proc_r **) v1;
+	struct top_proc_r *p2 = *(struct top_proc_r **) v2;
 	int			result;
 
 	ORDERKEY_RSSIZE
@@ -515,8 +633,8 @@ compare_res_r(const void *v1, const void *v2)
 static int
 compare_rchar_r(const void *v1, const void *v2)
 {
-	struct top_proc_r *p1 = (struct top_proc_r *) v1;
-	struct top_proc_r *p2 = (struct top_proc_r *) v2;
+	struct top_proc_r *p1 = *(struct top_proc_r **) v1;
+	struct top_proc_r *p2 = *(struct top_proc_r **) v2;
 	int			result;
 
 	ORDERKEY_RCHAR
@@ -535,8 +653,8 @@ compare_rchar_r(const void *v1, const void *v2)
 static int
 compare_reads_r(const void *v1, const void *v2)
 {
-	struct top_proc_r *p1 = (struct top_proc_r *) v1;
-	struct top_proc_r *p2 = (struct top_proc_r *) v2;
+	struct top_proc_r *p1 = *(struct top_proc_r **) v1;
+	struct top_proc_r *p2 = *(struct top_proc_r **) v2;
 	int			result;
 
 	ORDERKEY_READS
@@ -555,8 +673,8 @@ compare_reads_r(const void *v1, const void *v2)
 static int
 compare_size_r(const void *v1, const void *v2)
 {
-	struct top_proc_r *p1 = (struct top_proc_r *) v1;
-	struct top_proc_r *p2 = (struct top_proc_r *) v2;
+	struct top_proc_r *p1 = *(struct top_proc_r **) v1;
+	struct top_proc_r *p2 = *(struct top_proc_r **) v2;
 	int			result;
 
 	ORDERKEY_MEM
@@ -571,8 +689,8 @@ compare_size_r(const void *v1, const void *v2)
 static int
 compare_syscr_r(const void *v1, const void *v2)
 {
-	struct top_proc_r *p1 = (struct top_proc_r *) v1;
-	struct top_proc_r *p2 = (struct top_proc_r *) v2;
+	struct top_proc_r *p1 = *(struct top_proc_r **) v1;
+	struct top_proc_r *p2 = *(struct top_proc_r **) v2;
 	int			result;
 
 	ORDERKEY_SYSCR
@@ -591,8 +709,8 @@ compare_syscr_r(const void *v1, const void *v2)
 static int
 compare_syscw_r(const void *v1, const void *v2)
 {
-	struct top_proc_r *p1 = (struct top_proc_r *) v1;
-	struct top_proc_r *p2 = (struct top_proc_r *) v2;
+	struct top_proc_r *p1 = *(struct top_proc_r **) v1;
+	struct top_proc_r *p2 = *(struct top_proc_r **) v2;
 	int			result;
 
 	ORDERKEY_SYSCW
@@ -613,8 +731,8 @@ compare_syscw_r(const void *v1, const void *v2)
 static int
 compare_xtime_r(const void *v1, const void *v2)
 {
-	struct top_proc_r *p1 = (struct top_proc_r *) v1;
-	struct top_proc_r *p2 = (struct top_proc_r *) v2;
+	struct top_proc_r *p1 = *(struct top_proc_r **) v1;
+	struct top_proc_r *p2 = *(struct top_proc_r **) v2;
 	int			result;
 
 	ORDERKEY_XTIME
@@ -630,8 +748,8 @@ compare_xtime_r(const void *v1, const void *v2)
 static int
 compare_wchar_r(const void *v1, const void *v2)
 {
-	struct top_proc_r *p1 = (struct top_proc_r *) v1;
-	struct top_proc_r *p2 = (struct top_proc_r *) v2;
+	struct top_proc_r *p1 = *(struct top_proc_r **) v1;
+	struct top_proc_r *p2 = *(struct top_proc_r **) v2;
 	int			result;
 
 	ORDERKEY_WCHAR
@@ -650,8 +768,8 @@ compare_wchar_r(const void *v1, const void *v2)
 static int
 compare_writes_r(const void *v1, const void *v2)
 {
-	struct top_proc_r *p1 = (struct top_proc_r *) v1;
-	struct top_proc_r *p2 = (struct top_proc_r *) v2;
+	struct top_proc_r *p1 = *(struct top_proc_r **) v1;
+	struct top_proc_r *p2 = *(struct top_proc_r **) v2;
 	int			result;
 
 	ORDERKEY_WRITES
@@ -682,7 +800,7 @@ char *
 format_next_io_r(caddr_t handler)
 {
 	static char fmt[MAX_COLS];	/* static area where result is built */
-	struct top_proc_r *p = &pgrtable[proc_r_index++];
+	struct top_proc_r *p = pgrtable[proc_r_index++];
 
 	if (mode_stats == STATS_DIFF)
 		snprintf(fmt, sizeof(fmt),
@@ -716,7 +834,7 @@ char *
 format_next_process_r(caddr_t handler)
 {
 	static char fmt[MAX_COLS];	/* static area where result is built */
-	struct top_proc_r *p = &pgrtable[proc_r_index++];
+	struct top_proc_r *p = pgrtable[proc_r_index++];
 
 	snprintf(fmt, sizeof(fmt),
 			 "%5d %-8.8s %5s %5s %-6s %5s %5s %5.1f %5d %s",
@@ -738,7 +856,7 @@ char *
 format_next_replication_r(caddr_t handle)
 {
 	static char fmt[MAX_COLS];	/* static area where result is built */
-	struct top_proc_r *p = &pgrtable[proc_r_index++];
+	struct top_proc_r *p = pgrtable[proc_r_index++];
 
 	snprintf(fmt, sizeof(fmt),
 			 "%5d %-8.8s %-11.11s %15s %-9.9s %9s %9s %9s %9s %9s %5s %5s %5s %5s",
@@ -761,26 +879,150 @@ format_next_replication_r(caddr_t handle)
 	return (fmt);
 }
 
+/*
+ * The output_next_*_r routines write out the same rows as the
+ * format_next_*_r ones, field by field and at full length.
+ */
+
 void
-get_system_info_r(struct system_info *info, struct pg_conninfo_ctx *conninfo)
+output_next_io_r(caddr_t handle)
+{
+	struct top_proc_r *p = pgrtable[proc_r_index++];
+
+	output_int("pid", p->pid);
+	output_int("rchar", p->rchar);
+	output_int("wchar", p->wchar);
+	output_int("syscr", p->syscr);
+	output_int("syscw", p->syscw);
+	output_int("read_bytes", p->read_bytes);
+	output_int("write_bytes", p->write_bytes);
+	output_int("cancelled_write_bytes", p->cancelled_write_bytes);
+	output_int("rchar_diff", p->rchar_diff);
+	output_int("wchar_diff", p->wchar_diff);
+	output_int("syscr_diff", p->syscr_diff);
+	output_int("syscw_diff", p->syscw_diff);
+	output_int("read_bytes_diff", p->read_bytes_diff);
+	output_int("write_bytes_diff", p->write_bytes_diff);
+	output_int("cancelled_write_bytes_diff", p->cancelled_write_bytes_diff);
+	output_str("command", p->name);
+}
+
+void
+output_next_process_r(caddr_t handle)
+{
+	struct top_proc_r *p = pgrtable[proc_r_index++];
+
+	output_int("pid", p->pid);
+	output_str("username", p->usename);
+	output_int("size", p->size * 1024LL);
+	output_int("res", p->rss * 1024LL);
+	output_str("state", backendstatenames[p->pgstate]);
+	output_int("xtime", p->xtime);
+	output_int("qtime", p->qtime);
+	output_double("cpu", p->pcpu * 100.0);
+	output_int("locks", p->locks);
+	output_str("command", p->name);
+}
+
+void
+output_next_replication_r(caddr_t handle)
+{
+	struct top_proc_r *p = pgrtable[proc_r_index++];
+
+	output_int("pid", p->pid);
+	output_str("username", p->usename);
+	output_str("application", p->application_name);
+	output_str("client", p->client_addr);
+	output_str("state", p->repstate);
+	output_str("primary", p->primary);
+	output_str("sent", p->sent);
+	output_str("write", p->write);
+	output_str("flush", p->flush);
+	output_str("replay", p->replay);
+	output_int("sent_lag", p->sent_lag);
+	output_int("write_lag", p->write_lag);
+	output_int("flush_lag", p->flush_lag);
+	output_int("replay_lag", p->replay_lag);
+}
+
+/* Fill in "b" with what the metrics are made of for the next process. */
+void
+metrics_next_process_r(caddr_t handle, struct backend_stats *b)
+{
+	struct top_proc_r *p = pgrtable[proc_r_index++];
+
+	b->pid = p->pid;
+	b->usename = p->usename;
+	b->datname = p->datname;
+	b->pgstate = p->pgstate;
+	b->pcpu = p->pcpu;
+	b->size = p->size;
+	b->rss = p->rss;
+	b->xtime = p->xtime;
+	b->qtime = p->qtime;
+	b->locks = p->locks;
+	b->command = p->name;
+	b->io.rchar = p->rchar;
+	b->io.wchar = p->wchar;
+	b->io.syscr = p->syscr;
+	b->io.syscw = p->syscw;
+	b->io.read_bytes = p->read_bytes;
+	b->io.write_bytes = p->write_bytes;
+	b->io.cancelled_write_bytes = p->cancelled_write_bytes;
+	b->io_diff.rchar = p->rchar_diff;
+	b->io_diff.wchar = p->wchar_diff;
+	b->io_diff.syscr = p->syscr_diff;
+	b->io_diff.syscw = p->syscw_diff;
+	b->io_diff.read_bytes = p->read_bytes_diff;
+	b->io_diff.write_bytes = p->write_bytes_diff;
+	b->io_diff.cancelled_write_bytes = p->cancelled_write_bytes_diff;
+}
+
+/* Go through the processes from the first one again. */
+void
+rewind_process_info_r(caddr_t handle)
+{
+	proc_r_index = 0;
+}
+
+void
+get_system_info_r(struct system_info *info, struct process_select *sel,
+				  int mode, struct pg_conninfo_ctx *conninfo)
 {
 	PGresult   *pgresult = NULL;
 	int			rows = 0;
 
+	if (snapshot != NULL)
+	{
+		PQclear(snapshot);
+		snapshot = NULL;
+	}
+
 	connect_to_db(conninfo);
 	if (conninfo->connection != NULL)
 	{
-		pgresult = PQexec(conninfo->connection, QUERY_LOADAVG);
+		/*
+		 * Unless the processes come from somewhere else, get them now as
+		 * well and hang on to them for get_process_info_r().
+		 */
+		if (mode != MODE_PROCESSES && mode != MODE_IO_STATS)
+			pgresult = pg_exec(conninfo->connection, QUERY_SYSTEM);
+		else if (sel->fullcmd == 2)
+			pgresult = snapshot = pg_exec(conninfo->connection,
+										  QUERY_PROCTAB_QUERY);
+		else
+			pgresult = snapshot = pg_exec(conninfo->connection,
+										  QUERY_PROCTAB);
 		rows = PQntuples(pgresult);
 	}
 
 	/* Get load averages. */
 	if (rows > 0)
 	{
-		info->load_avg[0] = atof(PQgetvalue(pgresult, 0, c_load1));
-		info->load_avg[1] = atof(PQgetvalue(pgresult, 0, c_load5));
-		info->load_avg[2] = atof(PQgetvalue(pgresult, 0, c_load15));
-		info->last_pid = atoi(PQgetvalue(pgresult, 0, c_last_pid));
+		info->load_avg[0] = pg_getfloat(pgresult, 0, c_load1);
+		info->load_avg[1] = pg_getfloat(pgresult, 0, c_load5);
+		info->load_avg[2] = pg_getfloat(pgresult, 0, c_load15);
+		info->last_pid = pg_getint(pgresult, 0, c_last_pid);
 	}
 	else
 	{
@@ -791,18 +1033,13 @@ get_system_info_r(struct system_info *info, struct pg_conninfo_ctx *conninfo)
 	}
 
 	/* Get processor time info. */
-	if (conninfo->connection != NULL)
-	{
-		pgresult = PQexec(conninfo->connection, QUERY_CPUTIME);
-		rows = PQntuples(pgresult);
-	}
 	if (rows > 0)
 	{
-		cp_time[0] = atol(PQgetvalue(pgresult, 0, c_cpu_user));
-		cp_time[1] = atol(PQgetvalue(pgresult, 0, c_cpu_nice));
-		cp_time[2] = atol(PQgetvalue(pgresult, 0, c_cpu_system));
-		cp_time[3] = atol(PQgetvalue(pgresult, 0, c_cpu_idle));
-		cp_time[4] = atol(PQgetvalue(pgresult, 0, c_cpu_iowait));
+		cp_time[0] = pg_getint(pgresult, 0, c_cpu_user);
+		cp_time[1] = pg_getint(pgresult, 0, c_cpu_nice);
+		cp_time[2] = pg_getint(pgresult, 0, c_cpu_system);
+		cp_time[3] = pg_getint(pgresult, 0, c_cpu_idle);
+		cp_time[4] = pg_getint(pgresult, 0, c_cpu_iowait);
 
 		/* convert cp_time counts to percentages */
 		percentages(NCPUSTATES, cpu_states, cp_time, cp_old, cp_diff);
@@ -817,21 +1054,16 @@ get_system_info_r(struct system_info *info, struct pg_conninfo_ctx *conninfo)
 	}
 
 	/* Get system wide memory usage. */
-	if (conninfo->connection != NULL)
-	{
-		pgresult = PQexec(conninfo->connection, QUERY_MEMUSAGE);
-		rows = PQntuples(pgresult);
-	}
 	if (rows > 0)
 	{
-		memory_stats[MEMUSED] = atol(PQgetvalue(pgresult, 0, c_memused));
-		memory_stats[MEMFREE] = atol(PQgetvalue(pgresult, 0, c_memfree));
-		memory_stats[MEMSHARED] = atol(PQgetvalue(pgresult, 0, c_memshared));
-		memory_stats[MEMBUFFERS] = atol(PQgetvalue(pgresult, 0, c_membuffers));
-		memory_stats[MEMCACHED] = atol(PQgetvalue(pgresult, 0, c_memcached));
-		swap_stats[SWAPUSED] = atol(PQgetvalue(pgresult, 0, c_swapused));
-		swap_stats[SWAPFREE] = atol(PQgetvalue(pgresult, 0, c_swapfree));
-		swap_stats[SWAPCACHED] = atol(PQgetvalue(pgresult, 0, c_swapcached));
+		memory_stats[MEMUSED] = pg_getint(pgresult, 0, c_memused);
+		memory_stats[MEMFREE] = pg_getint(pgresult, 0, c_memfree);
+		memory_stats[MEMSHARED] = pg_getint(pgresult, 0, c_memshared);
+		memory_stats[MEMBUFFERS] = pg_getint(pgresult, 0, c_membuffers);
+		memory_stats[MEMCACHED] = pg_getint(pgresult, 0, c_memcached);
+		swap_stats[SWAPUSED] = pg_getint(pgresult, 0, c_swapused);
+		swap_stats[SWAPFREE] = pg_getint(pgresult, 0, c_swapfree);
+		swap_stats[SWAPCACHED] = pg_getint(pgresult, 0, c_swapcached);
 	}
 	else
 	{
@@ -849,7 +1081,7 @@ get_system_info_r(struct system_info *info, struct pg_conninfo_ctx *conninfo)
 	info->memory = memory_stats;
 	info->swap = swap_stats;
 
-	if (pgresult != NULL)
+	if (pgresult != NULL && pgresult != snapshot)
 		PQclear(pgresult);
 	disconnect_from_db(conninfo);
 }
@@ -863,25 +1095,27 @@ get_process_info_r(struct system_info *si, struct process_select *sel,
 	PGresult   *pgresult = NULL;
 	int			rows;
 
-	struct timeval thistime;
+	struct timespec thistime;
 	double		timediff;
 
 	int			active_procs = 0;
 	int			total_procs = 0;
 
 	int			show_idle = sel->idle;
+	char	   *usename = NULL;	/* -z filter, interned */
 
-	struct top_proc_r *n,
-			   *p;
+	struct top_proc_r *n;
 
 	memset(process_states, 0, sizeof(process_states));
+	if (sel->usename[0] != '\0')
+		usename = intern_str(sel->usename);
 
 	/* Calculate the time difference since our last check. */
-	gettimeofday(&thistime, 0);
+	clock_gettime(CLOCK_MONOTONIC, &thistime);
 	if (lasttime.tv_sec)
 	{
 		timediff = ((thistime.tv_sec - lasttime.tv_sec) +
-					(thistime.tv_usec - lasttime.tv_usec) * 1e-6);
+					(thistime.tv_nsec - lasttime.tv_nsec) * 1e-9);
 	}
 	else
 	{
@@ -891,35 +1125,52 @@ get_process_info_r(struct system_info *si, struct process_select *sel,
 
 	timediff *= HZ;				/* Convert to ticks. */
 
-	connect_to_db(conninfo);
-	if (conninfo->connection != NULL)
+	++generation;
+
+	if (mode != MODE_REPLICATION && snapshot != NULL)
 	{
-		switch (mode)
-		{
-			case MODE_REPLICATION:
-				pgresult = pg_replication(conninfo->connection);
-				break;
-			default:
-				if (sel->fullcmd == 2)
-				{
-					pgresult = PQexec(conninfo->connection, QUERY_PROCTAB_QUERY);
-				}
-				else
-				{
-					pgresult = PQexec(conninfo->connection, QUERY_PROCTAB);
-				}
-		}
-		rows = PQntuples(pgresult);
+		/* already fetched along with the system wide numbers */
+		pgresult = snapshot;
+		snapshot = NULL;
 	}
 	else
 	{
-		rows = 0;
+		connect_to_db(conninfo);
+		if (conninfo->connection != NULL)
+		{
+			switch (mode)
+			{
+				case MODE_REPLICATION:
+					pgresult = pg_replication(conninfo->connection);
+					break;
+				default:
+					if (sel->fullcmd == 2)
+					{
+						pgresult = pg_exec(conninfo->connection,
+										   QUERY_PROCTAB_QUERY);
+					}
+					else
+					{
+						pgresult = pg_exec(conninfo->connection,
+										   QUERY_PROCTAB);
+					}
+			}
+		}
 	}
 
-	if (rows > 0)
+	rows = PQntuples(pgresult);
+
+	/* The system wide numbers come back even if there are no processes. */
+	if (mode != MODE_REPLICATION && rows == 1 &&
+		PQgetisnull(pgresult, 0, c_pid))
+		rows = 0;
+
+	if (rows > pgrtable_size)
 	{
-		p = realloc(pgrtable, rows * sizeof(struct top_proc_r));
-		if (p == NULL)
+		struct top_proc_r **t;
+
+		t = realloc(pgrtable, rows * sizeof(struct top_proc_r *));
+		if (t == NULL)
 		{
 			fprintf(stderr, "realloc error\n");
 			if (pgresult != NULL)
@@ -927,56 +1178,47 @@ get_process_info_r(struct system_info *si, struct process_select *sel,
 			disconnect_from_db(conninfo);
 			exit(1);
 		}
-		pgrtable = p;
+		pgrtable = t;
+		pgrtable_size = rows;
 	}
 
 	for (i = 0; i < rows; i++)
 	{
+		struct top_proc_r key;
 		unsigned long otime;
+		unsigned long start_time;
 		long long	value;
 
-		n = malloc(sizeof(struct top_proc_r));
+		key.pid = pg_getint(pgresult, i, c_pid);
+		n = RB_FIND(pgprocr, &head_proc_r, &key);
 		if (n == NULL)
 		{
-			fprintf(stderr, "malloc error\n");
-			if (pgresult != NULL)
-				PQclear(pgresult);
-			disconnect_from_db(conninfo);
-			exit(1);
-		}
-		memset(n, 0, sizeof(struct top_proc_r));
-		n->pid = atoi(PQgetvalue(pgresult, i, c_pid));
-		p = RB_INSERT(pgprocr, &head_proc_r, n);
-		if (p != NULL)
-		{
-			free(n);
-			n = p;
-		}
-		else
-		{
-			n->time = 0;
+			n = alloc_proc_r();
+			n->pid = key.pid;
+			RB_INSERT(pgprocr, &head_proc_r, n);
 		}
+		n->generation = generation;
 
 		otime = n->time;
 
 		switch (mode)
 		{
 			case MODE_REPLICATION:
-				update_str(&n->usename, PQgetvalue(pgresult, i, 1));
-				update_str(&n->application_name, PQgetvalue(pgresult, i, 2));
-				update_str(&n->client_addr, PQgetvalue(pgresult, i, 3));
-				update_str(&n->repstate, PQgetvalue(pgresult, i, 4));
+				n->usename = intern_str(PQgetvalue(pgresult, i, 1));
+				n->application_name = intern_str(PQgetvalue(pgresult, i, 2));
+				n->client_addr = intern_str(PQgetvalue(pgresult, i, 3));
+				n->repstate = intern_str(PQgetvalue(pgresult, i, 4));
 				update_str(&n->primary, PQgetvalue(pgresult, i, 5));
 				update_str(&n->sent, PQgetvalue(pgresult, i, 6));
 				update_str(&n->write, PQgetvalue(pgresult, i, 7));
 				update_str(&n->flush, PQgetvalue(pgresult, i, 8));
 				update_str(&n->replay, PQgetvalue(pgresult, i, 9));
-				n->sent_lag = atol(PQgetvalue(pgresult, i, 10));
-				n->write_lag = atol(PQgetvalue(pgresult, i, 11));
-				n->flush_lag = atol(PQgetvalue(pgresult, i, 12));
-				n->replay_lag = atol(PQgetvalue(pgresult, i, 13));
+				n->sent_lag = pg_getint(pgresult, i, 10);
+				n->write_lag = pg_getint(pgresult, i, 11);
+				n->flush_lag = pg_getint(pgresult, i, 12);
+				n->replay_lag = pg_getint(pgresult, i, 13);
 
-				memcpy(&pgrtable[active_procs++], n, sizeof(struct top_proc_r));
+				pgrtable[active_procs++] = n;
 				break;
 			default:
 				if (sel->fullcmd && PQgetvalue(pgresult, i, c_fullcomm))
@@ -1009,47 +1251,61 @@ get_process_info_r(struct system_info *si, struct process_select *sel,
 				}
 				update_state(&n->pgstate, PQgetvalue(pgresult, i, c_pgstate));
 
-				n->time = (unsigned long) atol(PQgetvalue(pgresult, i, c_utime));
-				n->time += (unsigned long) atol(PQgetvalue(pgresult, i, c_stime));
-				n->start_time = (unsigned long)
-					atol(PQgetvalue(pgresult, i, c_starttime));
-				n->size = bytetok((unsigned long)
-								  atol(PQgetvalue(pgresult, i, c_vsize)));
-				n->rss = bytetok((unsigned long)
-								 atol(PQgetvalue(pgresult, i, c_rss)));
+				n->time = (unsigned long) pg_getint(pgresult, i, c_utime);
+				n->time += (unsigned long) pg_getint(pgresult, i, c_stime);
+				start_time = (unsigned long) pg_getint(pgresult, i, c_starttime);
+				if (n->start_time != start_time)
+				{
+					/*
+					 * The pid has been reused, so count the new process's cpu
+					 * time and i/o from zero.
+					 */
+					otime = 0;
+					n->rchar = 0;
+					n->wchar = 0;
+					n->syscr = 0;
+					n->syscw = 0;
+					n->read_bytes = 0;
+					n->write_bytes = 0;
+					n->cancelled_write_bytes = 0;
+					n->start_time = start_time;
+				}
+				n->size = bytetok((unsigned long) pg_getint(pgresult, i, c_vsize));
+				n->rss = bytetok((unsigned long) pg_getint(pgresult, i, c_rss));
 
-				update_str(&n->usename, PQgetvalue(pgresult, i, c_username));
+				n->usename = intern_str(PQgetvalue(pgresult, i, c_username));
+				n->datname = intern_str(PQgetvalue(pgresult, i, c_datname));
 
-				n->xtime = atol(PQgetvalue(pgresult, i, c_xtime));
-				n->qtime = atol(PQgetvalue(pgresult, i, c_qtime));
+				n->xtime = pg_getint(pgresult, i, c_xtime);
+				n->qtime = pg_getint(pgresult, i, c_qtime);
 
-				n->locks = atol(PQgetvalue(pgresult, i, c_locks));
+				n->locks = pg_getint(pgresult, i, c_locks);
 
-				value = atoll(PQgetvalue(pgresult, i, c_rchar));
+				value = pg_getint(pgresult, i, c_rchar);
 				n->rchar_diff = value - n->rchar;
 				n->rchar = value;
 
-				value = atoll(PQgetvalue(pgresult, i, c_wchar));
+				value = pg_getint(pgresult, i, c_wchar);
 				n->wchar_diff = value - n->wchar;
 				n->wchar = value;
 
-				value = atoll(PQgetvalue(pgresult, i, c_syscr));
+				value = pg_getint(pgresult, i, c_syscr);
 				n->syscr_diff = value - n->syscr;
 				n->syscr = value;
 
-				value = atoll(PQgetvalue(pgresult, i, c_syscw));
+				value = pg_getint(pgresult, i, c_syscw);
 				n->syscw_diff = value - n->syscw;
 				n->syscw = value;
 
-				value = atoll(PQgetvalue(pgresult, i, c_reads));
+				value = pg_getint(pgresult, i, c_reads);
 				n->read_bytes_diff = value - n->read_bytes;
 				n->read_bytes = value;
 
-				value = atoll(PQgetvalue(pgresult, i, c_writes));
+				value = pg_getint(pgresult, i, c_writes);
 				n->write_bytes_diff = value - n->write_bytes;
 				n->write_bytes = value;
 
-				value = atoll(PQgetvalue(pgresult, i, c_cwrites));
+				value = pg_getint(pgresult, i, c_cwrites);
 				n->cancelled_write_bytes_diff = value - n->cancelled_write_bytes;
 				n->cancelled_write_bytes = value;
 
@@ -1063,12 +1319,18 @@ get_process_info_r(struct system_info *si, struct process_select *sel,
 				}
 
 				if ((show_idle || n->pgstate != STATE_IDLE) &&
-					(sel->usename[0] == '\0' ||
-					 strcmp(n->usename, sel->usename) == 0))
-					memcpy(&pgrtable[active_procs++], n, sizeof(struct top_proc_r));
+					(usename == NULL || n->usename == usename))
+					pgrtable[active_procs++] = n;
 		}
 	}
 
+	/*
+	 * Only forget the pids that are gone if the query actually told us which
+	 * ones are still around.
+	 */
+	if (pgresult != NULL && PQresultStatus(pgresult) == PGRES_TUPLES_OK)
+		evict_stale_procs_r();
+
 	if (pgresult != NULL)
 		PQclear(pgresult);
 	disconnect_from_db(conninfo);
@@ -1077,10 +1339,17 @@ get_process_info_r(struct system_info *si, struct process_select *sel,
 	si->p_total = total_procs;
 	si->procstates = process_states;
 
-	/* Sort the "active" procs if specified. */
+	/* Sort the "active" procs that are going to be shown if specified. */
 	if (compare_index >= 0 && si->p_active)
-		qsort(pgrtable, si->p_active, sizeof(struct top_proc_r),
-			  proc_compares_r[compare_index]);
+	{
+		if (proc_keys_r[compare_index] != NULL)
+			key_sort(pgrtable, si->p_active, sizeof(struct top_proc_r *),
+					 sel->topn, proc_keys_r[compare_index],
+					 proc_compares_r[compare_index]);
+		else
+			partial_sort(pgrtable, si->p_active, sizeof(struct top_proc_r *),
+						 sel->topn, proc_compares_r[compare_index]);
+	}
 
 	/* don't even pretend that the return value thing here isn't bogus */
 	proc_r_index = 0;
@@ -1114,6 +1383,7 @@ machine_init_r(struct statics *statics, struct pg_conninfo_ctx *conninfo)
 	statics->memory_names = memorynames;
 	statics->swap_names = swapnames;
 	statics->order_names = ordernames;
+	statics->process_orders = NPROCORDERS;
 	statics->boottime = boottime;
 	statics->flags.fullcmds = 1;
 	statics->flags.warmup = 1;
@@ -1126,3 +1396,55 @@ topprocrcmp(struct top_proc_r *e1, struct top_proc_r *e2)
 {
 	return (e1->pid < e2->pid ? -1 : e1->pid > e2->pid);
 }
+
+/*
+ * Sort keys for key_sort.  Each packs the first two ORDERKEYs of the
+ * matching comparison function so that the keys sort in the same order.
+ */
+
+#define SORTKEY_CWRITES    sort_key_int(p->cancelled_write_bytes)
+#define SORTKEY_LAG_FLUSH  (~sort_key_int(p->flush_lag))
+#define SORTKEY_LAG_REPLAY (~sort_key_int(p->replay_lag))
+#define SORTKEY_LAG_SENT   (~sort_key_int(p->sent_lag))
+#define SORTKEY_LAG_WRITE  (~sort_key_int(p->write_lag))
+#define SORTKEY_LOCKS      (~sort_key_int(p->locks))
+#define SORTKEY_MEM        (~sort_key_int(p->size))
+#define SORTKEY_PCTCPU     (~sort_key_double(p->pcpu))
+#define SORTKEY_QTIME      (~sort_key_int(p->qtime))
+#define SORTKEY_RCHAR      sort_key_int(p->rchar)
+#define SORTKEY_READS      sort_key_int(p->read_bytes)
+#define SORTKEY_RSSIZE     (~sort_key_int(p->rss))
+#define SORTKEY_STATE      (~sort_key_int(p->pgstate))
+#define SORTKEY_SYSCR      sort_key_int(p->syscr)
+#define SORTKEY_SYSCW      sort_key_int(p->syscw)
+#define SORTKEY_WCHAR      sort_key_int(p->wchar)
+#define SORTKEY_WRITES     sort_key_int(p->write_bytes)
+#define SORTKEY_XTIME      (~sort_key_int(p->xtime))
+
+#define PROC_SORTKEY(name, primary, secondary) \
+static void \
+key_##name(const void *v, uint64_t *hi, uint64_t *lo) \
+{ \
+	const struct top_proc_r *p = *(struct top_proc_r *const *) v; \
+\
+	*hi = primary; \
+	*lo = secondary; \
+}
+
+PROC_SORTKEY(cpu_r, SORTKEY_PCTCPU, SORTKEY_STATE)
+PROC_SORTKEY(size_r, SORTKEY_MEM, SORTKEY_RSSIZE)
+PROC_SORTKEY(res_r, SORTKEY_RSSIZE, SORTKEY_MEM)
+PROC_SORTKEY(xtime_r, SORTKEY_XTIME, SORTKEY_PCTCPU)
+PROC_SORTKEY(qtime_r, SORTKEY_QTIME, SORTKEY_PCTCPU)
+PROC_SORTKEY(rchar_r, SORTKEY_RCHAR, SORTKEY_WCHAR)
+PROC_SORTKEY(wchar_r, SORTKEY_WCHAR, SORTKEY_RCHAR)
+PROC_SORTKEY(syscr_r, SORTKEY_SYSCR, SORTKEY_RCHAR)
+PROC_SORTKEY(syscw_r, SORTKEY_SYSCW, SORTKEY_RCHAR)
+PROC_SORTKEY(reads_r, SORTKEY_READS, SORTKEY_RCHAR)
+PROC_SORTKEY(writes_r, SORTKEY_WRITES, SORTKEY_RCHAR)
+PROC_SORTKEY(cwrites_r, SORTKEY_CWRITES, SORTKEY_RCHAR)
+PROC_SORTKEY(locks_r, SORTKEY_LOCKS, SORTKEY_QTIME)
+PROC_SORTKEY(lag_flush, SORTKEY_LAG_FLUSH, SORTKEY_PCTCPU)
+PROC_SORTKEY(lag_replay, SORTKEY_LAG_REPLAY, SORTKEY_PCTCPU)
+PROC_SORTKEY(lag_sent, SORTKEY_LAG_SENT, SORTKEY_PCTCPU)
+PROC_SORTKEY(lag_write, SORTKEY_LAG_WRITE, SORTKEY_PCTCPU)
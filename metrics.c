@@ -0,0 +1,648 @@
+/*
+ *	Top users/processes display for Unix
+ *
+ *	Copyright (c) 2007-2019, Mark Wong
+ */
+
+/*
+ *	This file contains the Prometheus exporter.  Every sample is turned
+ *	into the text exposition format by the thread that took it, and a
+ *	thread of its own answers the scrapes with the latest one, so a scrape
+ *	never waits on the server and a slow scraper never holds up sampling.
+ *	The backends are summed up by state, user and database, and only the
+ *	busiest few get series of their own, so the number of series stays
+ *	bounded however many backends come and go.
+ */
+
+#include "os.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "metrics.h"
+
+#define REQUEST_SIZE	4096	/* of the request line and headers */
+#define IO_TIMEOUT		5		/* seconds a scraper gets to send or read */
+#define OTHER_LABEL		"__other__"
+
+extern char *myname;
+
+/* Text being put together. */
+struct textbuf
+{
+	char	   *data;
+	size_t		len;
+	size_t		size;
+};
+
+/* What the backends of one user or database add up to. */
+struct label_stats
+{
+	char	   *name;			/* interned */
+	int			backends;
+	double		pcpu;
+	long long	rss;			/* in k */
+	long long	read_bytes;		/* since pg_top started */
+	long long	write_bytes;	/* since pg_top started */
+};
+
+struct label_set
+{
+	int			count;
+	int			other;			/* whether the last entry has been used */
+	struct label_stats stats[METRICS_MAX_LABELS + 1];
+};
+
+static struct
+{
+	int			serving;
+	int			fd;
+	pthread_t	thread;
+	pthread_mutex_t lock;
+	struct textbuf page;		/* the latest sample, under lock */
+	struct textbuf next;		/* the sample being put together */
+	struct statics *statics;
+	struct label_set users;
+	struct label_set databases;
+	struct backend_stats top[METRICS_TOP];
+}			metrics;
+
+static void
+text_grow(struct textbuf *buf, size_t n)
+{
+	char	   *data;
+	size_t		size;
+
+	if (buf->len + n <= buf->size)
+		return;
+
+	size = buf->size > 0 ? buf->size : 4096;
+	while (size < buf->len + n)
+		size *= 2;
+	if ((data = realloc(buf->data, size)) == NULL)
+	{
+		fprintf(stderr, "%s: can't allocate sufficient memory\n", myname);
+		exit(4);
+	}
+	buf->data = data;
+	buf->size = size;
+}
+
+static void
+text_put(struct textbuf *buf, const char *s, size_t n)
+{
+	text_grow(buf, n);
+	memcpy(buf->data + buf->len, s, n);
+	buf->len += n;
+}
+
+static void
+text_printf(struct textbuf *buf, const char *fmt,...)
+{
+	va_list		ap;
+	int			n;
+
+	va_start(ap, fmt);
+	n = vsnprintf(buf->data + buf->len, buf->size - buf->len, fmt, ap);
+	va_end(ap);
+	if (n < 0)
+		return;
+	if (buf->len + n >= buf->size)
+	{
+		text_grow(buf, n + 1);
+		va_start(ap, fmt);
+		vsnprintf(buf->data + buf->len, buf->size - buf->len, fmt, ap);
+		va_end(ap);
+	}
+	buf->len += n;
+}
+
+/* Write "value" as a label value, with the characters that need it escaped. */
+static void
+text_label(struct textbuf *buf, const char *value)
+{
+	const char *s;
+
+	if (value == NULL)
+		return;
+	for (s = value; *s != '\0'; s++)
+	{
+		if (*s == '\\')
+			text_put(buf, "\\\\", 2);
+		else if (*s == '"')
+			text_put(buf, "\\\"", 2);
+		else if (*s == '\n')
+			text_put(buf, "\\n", 2);
+		else
+			text_put(buf, s, 1);
+	}
+}
+
+static void
+text_family(struct textbuf *buf, const char *name, const char *type,
+			const char *help)
+{
+	text_printf(buf, "# HELP pg_top_%s %s\n# TYPE pg_top_%s %s\n",
+				name, help, name, type);
+}
+
+/*
+ * Turn one of the names the machine module gives the states and memory
+ * figures, such as " idle txn, " or "K used, ", into a label value such as
+ * "idle_txn" or "used".  Returns whether the figure is in kilobytes.
+ */
+static int
+name_label(const char *name, char *label, size_t size)
+{
+	size_t		n = 0;
+	int			kilo = 0;
+
+	if (strncmp(name, "K ", 2) == 0)
+	{
+		kilo = 1;
+		name += 2;
+	}
+	while (*name == ' ')
+		name++;
+	for (; *name != '\0' && *name != ',' && n + 1 < size; name++)
+		label[n++] = *name == ' ' ? '_' : *name;
+	while (n > 0 && label[n - 1] == '_')
+		n--;
+	label[n] = '\0';
+	return kilo;
+}
+
+/*
+ * Find the totals for "name", or lump it in with the rest once there are
+ * as many names as get series of their own.
+ */
+static struct label_stats *
+label_find(struct label_set *set, char *name)
+{
+	int			i;
+
+	for (i = 0; i < set->count; i++)
+		if (set->stats[i].name == name)
+			return &set->stats[i];
+
+	if (set->count < METRICS_MAX_LABELS)
+	{
+		set->stats[set->count].name = name;
+		return &set->stats[set->count++];
+	}
+	set->other = 1;
+	return &set->stats[METRICS_MAX_LABELS];
+}
+
+static void
+label_add(struct label_stats *l, struct backend_stats *b)
+{
+	l->backends++;
+	l->pcpu += b->pcpu;
+	l->rss += b->rss;
+	if (b->io_diff.read_bytes > 0)
+		l->read_bytes += b->io_diff.read_bytes;
+	if (b->io_diff.write_bytes > 0)
+		l->write_bytes += b->io_diff.write_bytes;
+}
+
+/* The gauges start over with every sample, the counters keep going. */
+static void
+label_reset(struct label_set *set)
+{
+	int			i;
+
+	for (i = 0; i <= METRICS_MAX_LABELS; i++)
+	{
+		set->stats[i].backends = 0;
+		set->stats[i].pcpu = 0;
+		set->stats[i].rss = 0;
+	}
+}
+
+/*
+ * Write one family with a series for every user or database, "what" being
+ * which and "field" selecting the figure.
+ */
+static void
+render_labels(struct textbuf *buf, struct label_set *set, const char *what,
+			  const char *field, const char *type, const char *help)
+{
+	char		name[64];
+	struct label_stats *l;
+	int			i;
+
+	snprintf(name, sizeof(name), "%s_%s", what, field);
+	text_family(buf, name, type, help);
+	for (i = 0; i <= METRICS_MAX_LABELS; i++)
+	{
+		if (i == set->count)
+		{
+			if (!set->other)
+				break;
+			i = METRICS_MAX_LABELS;
+		}
+		l = &set->stats[i];
+		text_printf(buf, "pg_top_%s{%s=\"", name, what);
+		text_label(buf, i == METRICS_MAX_LABELS ? OTHER_LABEL : l->name);
+		text_put(buf, "\"} ", 3);
+		if (strcmp(field, "backends") == 0)
+			text_printf(buf, "%d\n", l->backends);
+		else if (strcmp(field, "cpu_ratio") == 0)
+			text_printf(buf, "%.15g\n", l->pcpu);
+		else if (strcmp(field, "resident_bytes") == 0)
+			text_printf(buf, "%lld\n", l->rss * 1024);
+		else if (strcmp(field, "read_bytes_total") == 0)
+			text_printf(buf, "%lld\n", l->read_bytes);
+		else
+			text_printf(buf, "%lld\n", l->write_bytes);
+	}
+}
+
+static void
+render_labels_all(struct textbuf *buf, struct label_set *set, const char *what)
+{
+	render_labels(buf, set, what, "backends", "gauge",
+				  "Backends connected.");
+	render_labels(buf, set, what, "cpu_ratio", "gauge",
+				  "CPU used by the backends, 1 being a whole CPU.");
+	render_labels(buf, set, what, "resident_bytes", "gauge",
+				  "Resident memory of the backends.");
+	render_labels(buf, set, what, "read_bytes_total", "counter",
+				  "Bytes the backends have had read from storage.");
+	render_labels(buf, set, what, "write_bytes_total", "counter",
+				  "Bytes the backends have had written to storage.");
+}
+
+/* Write one family with a series for each of the busiest backends. */
+static void
+render_top(struct textbuf *buf, int ntop, const char *field,
+		   const char *help)
+{
+	struct backend_stats *b;
+	char		state[32];
+	int			i;
+
+	text_family(buf, field, "gauge", help);
+	for (i = 0; i < ntop; i++)
+	{
+		b = &metrics.top[i];
+		name_label(metrics.statics->procstate_names[b->pgstate], state,
+				   sizeof(state));
+		text_printf(buf, "pg_top_%s{pid=\"%d\",user=\"", field, (int) b->pid);
+		text_label(buf, b->usename);
+		text_put(buf, "\",database=\"", 12);
+		text_label(buf, b->datname);
+		text_printf(buf, "\",state=\"%s\"} ", state);
+		if (strcmp(field, "backend_cpu_ratio") == 0)
+			text_printf(buf, "%.15g\n", b->pcpu);
+		else if (strcmp(field, "backend_resident_bytes") == 0)
+			text_printf(buf, "%lld\n", b->rss * 1024LL);
+		else if (strcmp(field, "backend_virtual_bytes") == 0)
+			text_printf(buf, "%lld\n", b->size * 1024LL);
+		else if (strcmp(field, "backend_transaction_seconds") == 0)
+			text_printf(buf, "%lu\n", b->xtime);
+		else if (strcmp(field, "backend_query_seconds") == 0)
+			text_printf(buf, "%lu\n", b->qtime);
+		else
+			text_printf(buf, "%u\n", b->locks);
+	}
+}
+
+/* Write the system wide figures the machine module has names for. */
+static void
+render_named(struct textbuf *buf, const char *name, const char *label,
+			 char **names, long *values, const char *help)
+{
+	char		value[32];
+	int			i;
+
+	if (names == NULL || values == NULL)
+		return;
+
+	text_family(buf, name, "gauge", help);
+	for (i = 0; names[i] != NULL; i++)
+	{
+		if (name_label(names[i], value, sizeof(value)))
+			text_printf(buf, "pg_top_%s{%s=\"%s\"} %lld\n", name, label,
+						value, values[i] * 1024LL);
+		else
+			text_printf(buf, "pg_top_%s{%s=\"%s\"} %ld\n", name, label,
+						value, values[i]);
+	}
+}
+
+static void
+render(struct textbuf *buf, struct snapshot *snap, int ntop)
+{
+	static const int minutes[NUM_AVERAGES] = {1, 5, 15};
+	struct system_info *si = &snap->system_info;
+	char		label[32];
+	char	  **names;
+	int			i;
+
+	buf->len = 0;
+
+	text_family(buf, "sample_timestamp_seconds", "gauge",
+				"When the statistics were sampled.");
+	text_printf(buf, "pg_top_sample_timestamp_seconds %lld.%06lld\n",
+				snap->usec / 1000000, snap->usec % 1000000);
+
+	text_family(buf, "load_average", "gauge", "System load average.");
+	for (i = 0; i < NUM_AVERAGES; i++)
+		text_printf(buf, "pg_top_load_average{minutes=\"%d\"} %.15g\n",
+					minutes[i], si->load_avg[i]);
+
+	if ((names = metrics.statics->cpustate_names) != NULL &&
+		si->cpustates != NULL)
+	{
+		text_family(buf, "cpu_ratio", "gauge",
+					"Share of CPU time spent in each mode.");
+		for (i = 0; names[i] != NULL; i++)
+		{
+			name_label(names[i], label, sizeof(label));
+			text_printf(buf, "pg_top_cpu_ratio{mode=\"%s\"} %.15g\n", label,
+						si->cpustates[i] / 1000.0);
+		}
+	}
+
+	render_named(buf, "memory_bytes", "kind", metrics.statics->memory_names,
+				 si->memory, "System memory.");
+	render_named(buf, "swap_bytes", "kind", metrics.statics->swap_names,
+				 si->swap, "System swap space.");
+
+	if ((names = metrics.statics->procstate_names) != NULL &&
+		si->procstates != NULL)
+	{
+		text_family(buf, "backends", "gauge", "Backends in each state.");
+		for (i = 0; names[i] != NULL; i++)
+		{
+			name_label(names[i], label, sizeof(label));
+			if (label[0] != '\0')
+				text_printf(buf, "pg_top_backends{state=\"%s\"} %d\n", label,
+							si->procstates[i]);
+		}
+	}
+
+	render_labels_all(buf, &metrics.users, "user");
+	render_labels_all(buf, &metrics.databases, "database");
+
+	render_top(buf, ntop, "backend_cpu_ratio",
+			   "CPU used by the backend, 1 being a whole CPU.");
+	render_top(buf, ntop, "backend_resident_bytes",
+			   "Resident memory of the backend.");
+	render_top(buf, ntop, "backend_virtual_bytes",
+			   "Virtual memory of the backend.");
+	render_top(buf, ntop, "backend_transaction_seconds",
+			   "Time since the backend's transaction started.");
+	render_top(buf, ntop, "backend_query_seconds",
+			   "Time since the backend's query started.");
+	render_top(buf, ntop, "backend_locks", "Locks held by the backend.");
+}
+
+/*
+ * Sum up the processes of a sample, which are in the order they would be
+ * shown in, and make it the one the scrapes get.
+ */
+void
+metrics_update(struct snapshot *snap, caddr_t processes,
+			   void (*next) (caddr_t, struct backend_stats *))
+{
+	struct backend_stats b;
+	struct textbuf tmp;
+	int			ntop = 0;
+	int			i;
+
+	label_reset(&metrics.users);
+	label_reset(&metrics.databases);
+	for (i = 0; i < snap->system_info.P_ACTIVE; i++)
+	{
+		next(processes, &b);
+		if (ntop < METRICS_TOP)
+			metrics.top[ntop++] = b;
+		label_add(label_find(&metrics.users, b.usename), &b);
+		label_add(label_find(&metrics.databases, b.datname), &b);
+	}
+
+	render(&metrics.next, snap, ntop);
+
+	pthread_mutex_lock(&metrics.lock);
+	tmp = metrics.page;
+	metrics.page = metrics.next;
+	metrics.next = tmp;
+	pthread_mutex_unlock(&metrics.lock);
+}
+
+static void
+send_all(int fd, const char *data, size_t len)
+{
+	ssize_t		n;
+
+	while (len > 0)
+	{
+		if ((n = send(fd, data, len, MSG_NOSIGNAL)) == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			return;
+		}
+		data += n;
+		len -= n;
+	}
+}
+
+/* Answer the request on "fd", using "body" to hold a copy of the page. */
+static void
+answer(int fd, struct textbuf *body)
+{
+	char		request[REQUEST_SIZE];
+	char		header[256];
+	struct timeval tv;
+	const char *status;
+	char	   *path;
+	size_t		len = 0;
+	ssize_t		n;
+	int			head;
+
+	tv.tv_sec = IO_TIMEOUT;
+	tv.tv_usec = 0;
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+	/* only the request line matters, but read up to the end of the headers */
+	request[0] = '\0';
+	while (len < sizeof(request) - 1 && strstr(request, "\r\n\r\n") == NULL &&
+		   strstr(request, "\n\n") == NULL)
+	{
+		if ((n = recv(fd, request + len, sizeof(request) - 1 - len, 0)) <= 0)
+		{
+			if (n == -1 && errno == EINTR)
+				continue;
+			break;
+		}
+		len += n;
+		request[len] = '\0';
+	}
+	if (len == 0)
+		return;
+
+	body->len = 0;
+	head = strncmp(request, "HEAD ", 5) == 0;
+	if (!head && strncmp(request, "GET ", 4) != 0)
+		status = "405 Method Not Allowed";
+	else
+	{
+		path = strchr(request, ' ') + 1;
+		if (strcspn(path, " ?\r\n") != 8 || strncmp(path, "/metrics", 8) != 0)
+			status = "404 Not Found";
+		else
+		{
+			pthread_mutex_lock(&metrics.lock);
+			text_put(body, metrics.page.data, metrics.page.len);
+			pthread_mutex_unlock(&metrics.lock);
+			status = body->len > 0 ? "200 OK" : "503 Service Unavailable";
+		}
+	}
+
+	snprintf(header, sizeof(header),
+			 "HTTP/1.0 %s\r\n"
+			 "Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+			 "Content-Length: %lu\r\n"
+			 "Connection: close\r\n\r\n",
+			 status, (unsigned long) body->len);
+	send_all(fd, header, strlen(header));
+	if (!head)
+		send_all(fd, body->data, body->len);
+}
+
+/* The listener thread, answering one scrape at a time. */
+static void *
+metrics_main(void *arg)
+{
+	struct textbuf body;
+	int			fd;
+
+	memset(&body, 0, sizeof(body));
+	for (;;)
+	{
+		if ((fd = accept(metrics.fd, NULL, NULL)) == -1)
+		{
+			/* out of descriptors, most likely, so give it a moment */
+			if (errno != EINTR && errno != ECONNABORTED)
+				sleep(1);
+			continue;
+		}
+		answer(fd, &body);
+		close(fd);
+	}
+	return NULL;
+}
+
+/*
+ * Start serving the metrics on "addr", which is a port, optionally preceded
+ * by a host name or address and a colon.  IPv6 addresses go in brackets.
+ * Returns -1 after saying why if that could not be done.
+ */
+int
+metrics_listen(const char *addr, struct statics *statics)
+{
+	struct addrinfo hints;
+	struct addrinfo *res;
+	struct addrinfo *ai;
+	char		host[256];
+	const char *port;
+	const char *end;
+	sigset_t	all;
+	sigset_t	old;
+	int			fd = -1;
+	int			err = 0;
+	int			on = 1;
+	int			i;
+
+	host[0] = '\0';
+	if (addr[0] == '[' && (end = strchr(addr, ']')) != NULL && end[1] == ':')
+	{
+		snprintf(host, sizeof(host), "%.*s", (int) (end - addr - 1), addr + 1);
+		port = end + 2;
+	}
+	else if ((end = strrchr(addr, ':')) != NULL)
+	{
+		snprintf(host, sizeof(host), "%.*s", (int) (end - addr), addr);
+		port = end + 1;
+	}
+	else
+		port = addr;
+	if (*port == '\0')
+	{
+		fprintf(stderr, "%s: no port given to serve metrics on: %s\n", myname,
+				addr);
+		return -1;
+	}
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+	if ((i = getaddrinfo(host[0] != '\0' ? host : NULL, port, &hints,
+						 &res)) != 0)
+	{
+		fprintf(stderr, "%s: cannot serve metrics on %s: %s\n", myname, addr,
+				gai_strerror(i));
+		return -1;
+	}
+	for (ai = res; ai != NULL; ai = ai->ai_next)
+	{
+		if ((fd = socket(ai->ai_family, ai->ai_socktype,
+						 ai->ai_protocol)) == -1)
+		{
+			err = errno;
+			continue;
+		}
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+		if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 && listen(fd, 16) == 0)
+			break;
+		err = errno;
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(res);
+	if (fd == -1)
+	{
+		fprintf(stderr, "%s: cannot serve metrics on %s: %s\n", myname, addr,
+				strerror(err));
+		return -1;
+	}
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+	metrics.fd = fd;
+	metrics.statics = statics;
+	pthread_mutex_init(&metrics.lock, NULL);
+
+	/* signals are for the main thread */
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	i = pthread_create(&metrics.thread, NULL, metrics_main, NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (i != 0)
+	{
+		fprintf(stderr, "%s: cannot start the metrics listener: %s\n", myname,
+				strerror(i));
+		close(fd);
+		return -1;
+	}
+
+	metrics.serving = 1;
+	return 0;
+}
+
+int
+metrics_serving(void)
+{
+	return metrics.serving;
+}
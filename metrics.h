@@ -0,0 +1,25 @@
+/*
+ * Interface for serving the statistics to Prometheus instead of drawing
+ * them.
+ *
+ *	Copyright (c) 2007-2019, Mark Wong
+ */
+
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+#include "machine.h"
+#include "sampler.h"
+
+/* Backends that get series of their own, the busiest first. */
+#define METRICS_TOP			10
+
+/* Users or databases that get series of their own, the rest are lumped. */
+#define METRICS_MAX_LABELS	50
+
+int			metrics_listen(const char *, struct statics *);
+int			metrics_serving(void);
+void		metrics_update(struct snapshot *, caddr_t,
+						   void (*) (caddr_t, struct backend_stats *));
+
+#endif							/* _METRICS_H_ */
@@ -6,6 +6,7 @@
 #include <sys/types.h>
 #include <sys/param.h>
 #include <stdio.h>
+#include <stdint.h>
 
 #if TIME_WITH_SYS_TIME
 #include <sys/time.h>
@@ -0,0 +1,227 @@
+/*
+ *	Top users/processes display for Unix
+ *
+ *	Copyright (c) 2007-2019, Mark Wong
+ */
+
+/*
+ *	This file contains the routines that write the processes out as JSON
+ *	Lines or CSV rather than drawing them.  The machine modules hand over
+ *	each field of a row with its name and full value, the row is put
+ *	together here and written to stdout in one piece.  Nothing goes
+ *	through the display, so the columns are never cut to the screen width.
+ */
+
+#include "os.h"
+#include <math.h>
+
+#include "output.h"
+
+extern char *myname;
+
+int			output_format = OUTPUT_TEXT;
+
+/* A row, or the names of its fields, being put together. */
+struct outbuf
+{
+	char	   *data;
+	size_t		len;
+	size_t		size;
+};
+
+static struct outbuf row;
+static struct outbuf names;		/* for the CSV header */
+static struct outbuf header;	/* the CSV header last written */
+
+/* Returns -1 if "format" is not one we know. */
+int
+output_parse(const char *format)
+{
+	if (strcmp(format, "jsonl") == 0)
+		output_format = OUTPUT_JSONL;
+	else if (strcmp(format, "csv") == 0)
+		output_format = OUTPUT_CSV;
+	else if (strcmp(format, "text") == 0)
+		output_format = OUTPUT_TEXT;
+	else
+		return -1;
+	return 0;
+}
+
+static void
+put(struct outbuf *buf, const char *s, size_t n)
+{
+	char	   *data;
+	size_t		size;
+
+	if (buf->len + n > buf->size)
+	{
+		size = buf->size > 0 ? buf->size : 1024;
+		while (size < buf->len + n)
+			size *= 2;
+		if ((data = realloc(buf->data, size)) == NULL)
+		{
+			fprintf(stderr, "%s: can't allocate sufficient memory\n", myname);
+			exit(4);
+		}
+		buf->data = data;
+		buf->size = size;
+	}
+	memcpy(buf->data + buf->len, s, n);
+	buf->len += n;
+}
+
+static void
+puts_buf(struct outbuf *buf, const char *s)
+{
+	put(buf, s, strlen(s));
+}
+
+/* Start the next field called "name", as far as the punctuation goes. */
+static void
+field(const char *name)
+{
+	int			first = row.len == 0;
+
+	if (output_format == OUTPUT_JSONL)
+	{
+		put(&row, first ? "{\"" : ",\"", 2);
+		puts_buf(&row, name);
+		put(&row, "\":", 2);
+	}
+	else
+	{
+		if (!first)
+		{
+			put(&row, ",", 1);
+			put(&names, ",", 1);
+		}
+		puts_buf(&names, name);
+	}
+}
+
+/* Start a row for a sample taken "usec" microseconds after the epoch. */
+void
+output_row_begin(long long usec)
+{
+	char		buf[32];
+
+	row.len = 0;
+	names.len = 0;
+	field("time");
+	snprintf(buf, sizeof(buf), "%lld.%06lld", usec / 1000000, usec % 1000000);
+	puts_buf(&row, buf);
+}
+
+void
+output_int(const char *name, long long value)
+{
+	char		buf[32];
+
+	field(name);
+	snprintf(buf, sizeof(buf), "%lld", value);
+	puts_buf(&row, buf);
+}
+
+void
+output_double(const char *name, double value)
+{
+	char		buf[32];
+
+	field(name);
+	if (isfinite(value))
+	{
+		/* the fewest digits that still give the same double back */
+		snprintf(buf, sizeof(buf), "%.15g", value);
+		if (strtod(buf, NULL) != value)
+			snprintf(buf, sizeof(buf), "%.17g", value);
+		puts_buf(&row, buf);
+	}
+	else if (output_format == OUTPUT_JSONL)
+		puts_buf(&row, "null");
+}
+
+void
+output_str(const char *name, const char *value)
+{
+	const char *s;
+	char		buf[8];
+
+	field(name);
+	if (value == NULL)
+	{
+		if (output_format == OUTPUT_JSONL)
+			puts_buf(&row, "null");
+		return;
+	}
+
+	if (output_format == OUTPUT_JSONL)
+	{
+		put(&row, "\"", 1);
+		for (s = value; *s != '\0'; s++)
+		{
+			switch (*s)
+			{
+				case '"':
+					put(&row, "\\\"", 2);
+					break;
+				case '\\':
+					put(&row, "\\\\", 2);
+					break;
+				case '\n':
+					put(&row, "\\n", 2);
+					break;
+				case '\r':
+					put(&row, "\\r", 2);
+					break;
+				case '\t':
+					put(&row, "\\t", 2);
+					break;
+				default:
+					if ((unsigned char) *s < 0x20)
+					{
+						snprintf(buf, sizeof(buf), "\\u%04x", *s);
+						puts_buf(&row, buf);
+					}
+					else
+						put(&row, s, 1);
+			}
+		}
+		put(&row, "\"", 1);
+	}
+	else if (strpbrk(value, ",\"\r\n") != NULL)
+	{
+		/* quote the field, doubling any quotes in it */
+		put(&row, "\"", 1);
+		for (s = value; *s != '\0'; s++)
+		{
+			if (*s == '"')
+				put(&row, "\"", 1);
+			put(&row, s, 1);
+		}
+		put(&row, "\"", 1);
+	}
+	else
+		puts_buf(&row, value);
+}
+
+void
+output_row_end(void)
+{
+	if (output_format == OUTPUT_JSONL)
+		put(&row, "}", 1);
+	put(&row, "\n", 1);
+
+	/* a CSV header goes in front of the first row and whenever it changes */
+	if (output_format == OUTPUT_CSV &&
+		(names.len != header.len ||
+		 memcmp(names.data, header.data, names.len) != 0))
+	{
+		header.len = 0;
+		put(&header, names.data, names.len);
+		fwrite(header.data, 1, header.len, stdout);
+		putchar('\n');
+	}
+
+	fwrite(row.data, 1, row.len, stdout);
+}
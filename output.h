@@ -0,0 +1,25 @@
+/*
+ * Interface for writing the processes out in a machine readable format
+ * instead of drawing them.
+ *
+ *	Copyright (c) 2007-2019, Mark Wong
+ */
+
+#ifndef _OUTPUT_H_
+#define _OUTPUT_H_
+
+/* Values of output_format */
+#define OUTPUT_TEXT		0		/* the usual display */
+#define OUTPUT_JSONL	1		/* one JSON object per line */
+#define OUTPUT_CSV		2		/* comma separated, with a header line */
+
+extern int	output_format;
+
+int			output_parse(const char *);
+void		output_row_begin(long long);
+void		output_int(const char *, long long);
+void		output_double(const char *, double);
+void		output_str(const char *, const char *);
+void		output_row_end(void);
+
+#endif							/* _OUTPUT_H_ */
@@ -3,6 +3,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
+#include <time.h>
+#include <arpa/inet.h>
 
 #include "display.h"
 #include "pg.h"
@@ -20,7 +22,9 @@
 		"                              xact_start))::BIGINT,\n" \
 		"       extract(EPOCH FROM age(clock_timestamp(),\n" \
 		"                              query_start))::BIGINT,\n" \
-		"       coalesce(lock_count, 0) AS lock_count\n" \
+		"       coalesce(lock_count, 0) AS lock_count,\n" \
+		"       (extract(EPOCH FROM backend_start) * 1000000)::BIGINT,\n" \
+		"       datname\n" \
 		"FROM pg_stat_activity a LEFT OUTER JOIN lock_activity b\n" \
 		"  ON a.pid = b.pid;"
 
@@ -53,6 +57,57 @@
 		"                             replay_location) as replay_lag\n" \
 		"       FROM pg_stat_replication;"
 
+/*
+ * The statistics of every user table or index, keyed by an oid that is
+ * cast so it reads the same in text and binary results.
+ */
+#define QUERY_TABLES \
+		"SELECT s.relid::BIGINT, s.schemaname || '.' || s.relname,\n" \
+		"       seq_scan, coalesce(idx_scan, 0),\n" \
+		"       n_tup_ins, n_tup_upd, n_tup_del,\n" \
+		"       coalesce(heap_blks_hit, 0), coalesce(heap_blks_read, 0),\n" \
+		"       coalesce(idx_blks_hit, 0), coalesce(idx_blks_read, 0)\n" \
+		"FROM pg_stat_user_tables s\n" \
+		"     JOIN pg_statio_user_tables io ON s.relid = io.relid;"
+
+#define QUERY_INDEXES \
+		"SELECT s.indexrelid::BIGINT,\n" \
+		"       s.schemaname || '.' || s.indexrelname ||\n" \
+		"       ' (' || s.relname || ')',\n" \
+		"       idx_scan, idx_tup_read, idx_tup_fetch,\n" \
+		"       coalesce(idx_blks_hit, 0), coalesce(idx_blks_read, 0)\n" \
+		"FROM pg_stat_user_indexes s\n" \
+		"     JOIN pg_statio_user_indexes io ON s.indexrelid = io.indexrelid;"
+
+/*
+ * The counters of every statement, without its text, which is only asked
+ * for with QUERY_STATEMENT_TEXTS for the ones that get shown.  The same
+ * statement run by different users or in different databases is added up.
+ * The time is in microseconds so all of it reads as integers.
+ */
+#define QUERY_STATEMENTS \
+		"SELECT queryid, sum(calls)::BIGINT,\n" \
+		"       (sum(total_exec_time) * 1000)::BIGINT, sum(rows)::BIGINT,\n" \
+		"       sum(shared_blks_hit)::BIGINT, sum(shared_blks_read)::BIGINT,\n" \
+		"       sum(temp_blks_read + temp_blks_written)::BIGINT\n" \
+		"FROM pg_stat_statements(false)\n" \
+		"WHERE queryid IS NOT NULL\n" \
+		"GROUP BY queryid;"
+
+#define QUERY_STATEMENTS_12 \
+		"SELECT queryid, sum(calls)::BIGINT,\n" \
+		"       (sum(total_time) * 1000)::BIGINT, sum(rows)::BIGINT,\n" \
+		"       sum(shared_blks_hit)::BIGINT, sum(shared_blks_read)::BIGINT,\n" \
+		"       sum(temp_blks_read + temp_blks_written)::BIGINT\n" \
+		"FROM pg_stat_statements(false)\n" \
+		"WHERE queryid IS NOT NULL\n" \
+		"GROUP BY queryid;"
+
+#define QUERY_STATEMENT_TEXTS \
+		"SELECT queryid, query\n" \
+		"FROM pg_stat_statements\n" \
+		"WHERE queryid = ANY ($1::BIGINT[]);"
+
 #define GET_LOCKS \
 		"SELECT datname, relname, mode, granted\n" \
 		"FROM pg_stat_activity, pg_locks\n" \
@@ -69,18 +124,166 @@
 		"WHERE procpid = %d\n" \
 		"  AND procpid = pid;"
 
+/* Names of the statements prepared on each connection. */
+#define STMT_PROCESSES "pg_top_processes"
+#define STMT_REPLICATION "pg_top_replication"
+#define STMT_TABLES "pg_top_tables"
+#define STMT_INDEXES "pg_top_indexes"
+#define STMT_STATEMENTS "pg_top_statements"
+#define STMT_STATEMENT_TEXTS "pg_top_statement_texts"
+
+/* Bounds, in seconds, on the wait between attempts to reconnect. */
+#define RECONNECT_MIN 1
+#define RECONNECT_MAX 60
+
+#define PREPARED_PROCESSES	0x01
+#define PREPARED_REPLICATION 0x02
+#define PREPARED_TABLES		0x04
+#define PREPARED_INDEXES	0x08
+#define PREPARED_STATEMENTS 0x10
+#define PREPARED_STATEMENT_TEXTS 0x20
+
 int			pg_version(PGconn *);
 
+/* Statements already prepared on the current connection. */
+static PGconn *prepared_conn = NULL;
+static int	prepared = 0;
+
+/*
+ * Number of round trips to the server since last asked.  Commands count
+ * theirs while the collector thread counts its own.
+ */
+static int	round_trips = 0;
+
+#define COUNT_ROUND_TRIP() ((void) __sync_add_and_fetch(&round_trips, 1))
+
+/* Format to ask for the results of the refresh queries in, 1 is binary. */
+int			pg_result_format = 0;
+
+/*
+ * Prepare "sql" as "name" on the connection unless that has been done
+ * already.  Returns 0 on failure.
+ */
+static int
+pg_prepare(PGconn *pgconn, int flag, const char *name, const char *sql)
+{
+	PGresult   *pgresult;
+	int			ok;
+
+	if (prepared_conn != pgconn)
+	{
+		prepared_conn = pgconn;
+		prepared = 0;
+	}
+	if (prepared & flag)
+		return 1;
+
+	COUNT_ROUND_TRIP();
+	pgresult = PQprepare(pgconn, name, sql, 0, NULL);
+	ok = PQresultStatus(pgresult) == PGRES_COMMAND_OK;
+	PQclear(pgresult);
+	if (ok)
+		prepared |= flag;
+	return ok;
+}
+
+/*
+ * Per-session setup done once after connecting.  The timeout keeps pg_top
+ * from piling up on a server that is already struggling.
+ */
+static void
+pg_session_setup(PGconn *pgconn)
+{
+	COUNT_ROUND_TRIP();
+	PQclear(PQexec(pgconn, "SET statement_timeout = '2s';"));
+}
+
+/*
+ * Returns 1 if it is time to try to reach the server again, otherwise tells
+ * the user how long until the next attempt.
+ */
+static int
+pg_retry_due(struct pg_conninfo_ctx *conninfo)
+{
+	time_t		now = time(NULL);
+
+	if (now >= conninfo->retry_at)
+		return 1;
+
+	new_message(MT_standout | MT_delayed, " Reconnecting in %ld seconds",
+				(long) (conninfo->retry_at - now));
+	return 0;
+}
+
+/* Wait twice as long as last time before the next attempt. */
+static void
+pg_retry_later(struct pg_conninfo_ctx *conninfo)
+{
+	if (conninfo->backoff == 0)
+		conninfo->backoff = RECONNECT_MIN;
+	else if ((conninfo->backoff *= 2) > RECONNECT_MAX)
+		conninfo->backoff = RECONNECT_MAX;
+	conninfo->retry_at = time(NULL) + conninfo->backoff;
+}
+
 void
 connect_to_db(struct pg_conninfo_ctx *conninfo)
 {
-	int			i;
 	const char *keywords[6] = {"host", "port", "user", "password", "dbname",
 	NULL};
 
-	if (conninfo->persistent && PQsocket(conninfo->connection) >= 0)
-		return;
+	if (conninfo->persistent)
+	{
+		if (conninfo->connection != NULL)
+		{
+			/*
+			 * Make sure the server is still there.  PQconsumeInput notices a
+			 * connection that was closed while we were idle.
+			 */
+			if (PQstatus(conninfo->connection) == CONNECTION_OK &&
+				PQconsumeInput(conninfo->connection))
+				return;
+
+			/* Try again straight away, then back off. */
+			conninfo->lost = conninfo->connection;
+			conninfo->connection = NULL;
+			conninfo->backoff = 0;
+			conninfo->retry_at = 0;
+		}
+
+		if (!pg_retry_due(conninfo))
+			return;
+
+		/*
+		 * The password has been freed by now, but PQreset reuses the
+		 * parameters the connection was first opened with.
+		 */
+		if (conninfo->lost != NULL)
+		{
+			COUNT_ROUND_TRIP();
+			PQreset(conninfo->lost);
+			if (PQstatus(conninfo->lost) != CONNECTION_OK)
+			{
+				pg_retry_later(conninfo);
+				new_message(MT_standout | MT_delayed,
+							" Lost connection, reconnecting in %d seconds",
+							conninfo->backoff);
+				return;
+			}
+			conninfo->connection = conninfo->lost;
+			conninfo->lost = NULL;
+			conninfo->backoff = 0;
+			pg_session_setup(conninfo->connection);
+
+			/* the server has forgotten what was prepared */
+			if (conninfo->prepares)
+				prepared_conn = NULL;
+			new_message(MT_standout | MT_delayed, " Reconnected");
+			return;
+		}
+	}
 
+	COUNT_ROUND_TRIP();
 	conninfo->connection = PQconnectdbParams(keywords, conninfo->values, 1);
 	if (PQstatus(conninfo->connection) != CONNECTION_OK)
 	{
@@ -89,13 +292,30 @@ connect_to_db(struct pg_conninfo_ctx *conninfo)
 
 		PQfinish(conninfo->connection);
 		conninfo->connection = NULL;
+		if (conninfo->persistent)
+			pg_retry_later(conninfo);
 		return;
 	}
 
+	pg_session_setup(conninfo->connection);
+
+	/*
+	 * Only the sampling connection has statements prepared on it, which a
+	 * new one does not have yet.
+	 */
+	if (conninfo->prepares)
+		prepared_conn = NULL;
+
+	/*
+	 * Don't keep the password around once it is no longer needed, PQreset
+	 * reuses the one the connection was opened with.
+	 */
 	if (conninfo->persistent)
-		for (i = 0; i < 5; i++)
-			if (conninfo->values[i] != NULL)
-				free((void *) conninfo->values[i]);
+	{
+		conninfo->backoff = 0;
+		free((void *) conninfo->values[PG_PASSWORD]);
+		conninfo->values[PG_PASSWORD] = NULL;
+	}
 }
 
 void
@@ -122,40 +342,191 @@ pg_locks(PGconn *pgconn, int procpid)
 		sql = (char *) malloc(strlen(GET_LOCKS) + 7);
 		sprintf(sql, GET_LOCKS_9_1, procpid);
 	}
+	COUNT_ROUND_TRIP();
 	pgresult = PQexec(pgconn, sql);
 	free(sql);
 	return pgresult;
 }
 
+/*
+ * Send the activity query without waiting for it to finish, so the caller
+ * can do other work in the mean time.  Returns 0 if it could not be sent.
+ * The result has to be picked up with pg_processes_result().
+ */
+int
+pg_processes_send(PGconn *pgconn)
+{
+	if (!pg_prepare(pgconn, PREPARED_PROCESSES, STMT_PROCESSES,
+					pg_version(pgconn) >= 902 ? QUERY_PROCESSES :
+					QUERY_PROCESSES_9_1))
+		return 0;
+
+	COUNT_ROUND_TRIP();
+	return PQsendQueryPrepared(pgconn, STMT_PROCESSES, 0, NULL, NULL, NULL,
+							   pg_result_format);
+}
+
+/*
+ * Wait for the query sent by pg_processes_send() and return its result.
+ */
 PGresult *
-pg_processes(PGconn *pgconn)
+pg_processes_result(PGconn *pgconn)
 {
-	PGresult   *pgresult;
+	PGresult   *pgresult = NULL;
+	PGresult   *tmp;
 
-	PQexec(pgconn, "BEGIN;");
-	PQexec(pgconn, "SET statement_timeout = '2s';");
-	if (pg_version(pgconn) >= 902)
+	while ((tmp = PQgetResult(pgconn)) != NULL)
 	{
-		pgresult = PQexec(pgconn, QUERY_PROCESSES);
+		if (pgresult == NULL)
+			pgresult = tmp;
+		else
+			PQclear(tmp);
 	}
-	else
-	{
-		pgresult = PQexec(pgconn, QUERY_PROCESSES_9_1);
-	}
-	PQexec(pgconn, "ROLLBACK;;");
 	return pgresult;
 }
 
+PGresult *
+pg_processes(PGconn *pgconn)
+{
+	if (!pg_processes_send(pgconn))
+		return NULL;
+	return pg_processes_result(pgconn);
+}
+
 PGresult *
 pg_replication(PGconn *pgconn)
 {
-	PGresult   *pgresult;
+	if (!pg_prepare(pgconn, PREPARED_REPLICATION, STMT_REPLICATION,
+					REPLICATION))
+		return NULL;
 
-	PQexec(pgconn, "BEGIN;");
-	PQexec(pgconn, "SET statement_timeout = '2s';");
-	pgresult = PQexec(pgconn, REPLICATION);
-	PQexec(pgconn, "ROLLBACK;");
-	return pgresult;
+	COUNT_ROUND_TRIP();
+	return PQexecPrepared(pgconn, STMT_REPLICATION, 0, NULL, NULL, NULL, 0);
+}
+
+PGresult *
+pg_tables(PGconn *pgconn)
+{
+	if (!pg_prepare(pgconn, PREPARED_TABLES, STMT_TABLES, QUERY_TABLES))
+		return NULL;
+
+	COUNT_ROUND_TRIP();
+	return PQexecPrepared(pgconn, STMT_TABLES, 0, NULL, NULL, NULL,
+						  pg_result_format);
+}
+
+PGresult *
+pg_indexes(PGconn *pgconn)
+{
+	if (!pg_prepare(pgconn, PREPARED_INDEXES, STMT_INDEXES, QUERY_INDEXES))
+		return NULL;
+
+	COUNT_ROUND_TRIP();
+	return PQexecPrepared(pgconn, STMT_INDEXES, 0, NULL, NULL, NULL,
+						  pg_result_format);
+}
+
+PGresult *
+pg_statements(PGconn *pgconn)
+{
+	if (!pg_prepare(pgconn, PREPARED_STATEMENTS, STMT_STATEMENTS,
+					PQserverVersion(pgconn) >= 130000 ?
+					QUERY_STATEMENTS : QUERY_STATEMENTS_12))
+		return NULL;
+
+	COUNT_ROUND_TRIP();
+	return PQexecPrepared(pgconn, STMT_STATEMENTS, 0, NULL, NULL, NULL,
+						  pg_result_format);
+}
+
+/*
+ * The text of each statement in "queryids", an array literal such as
+ * "{1,2}".  Statements that went away in the meantime are left out.  This
+ * reads the server's whole file of texts, so the caller keeps what it gets.
+ */
+PGresult *
+pg_statement_texts(PGconn *pgconn, const char *queryids)
+{
+	if (!pg_prepare(pgconn, PREPARED_STATEMENT_TEXTS, STMT_STATEMENT_TEXTS,
+					QUERY_STATEMENT_TEXTS))
+		return NULL;
+
+	COUNT_ROUND_TRIP();
+	return PQexecPrepared(pgconn, STMT_STATEMENT_TEXTS, 1, &queryids, NULL,
+						  NULL, pg_result_format);
+}
+
+/*
+ * Run a query that has no prepared statement of its own, counting the round
+ * trip.  The result comes back in pg_result_format, so read the numbers with
+ * pg_getint() and pg_getfloat().
+ */
+PGresult *
+pg_exec(PGconn *pgconn, const char *sql)
+{
+	COUNT_ROUND_TRIP();
+	return PQexecParams(pgconn, sql, 0, NULL, NULL, NULL, NULL,
+						pg_result_format);
+}
+
+/*
+ * Return an integer column whether it came back as text or in the binary
+ * format, where it is a big endian int2, int4 or int8.
+ */
+long long
+pg_getint(const PGresult *pgresult, int row, int column)
+{
+	const char *value = PQgetvalue(pgresult, row, column);
+	uint16_t	u16;
+	uint32_t	u32[2];
+
+	if (PQfformat(pgresult, column) == 0)
+		return atoll(value);
+
+	switch (PQgetlength(pgresult, row, column))
+	{
+		case 2:
+			memcpy(&u16, value, sizeof(u16));
+			return (int16_t) ntohs(u16);
+		case 4:
+			memcpy(u32, value, sizeof(u32[0]));
+			return (int32_t) ntohl(u32[0]);
+		case 8:
+			memcpy(u32, value, sizeof(u32));
+			return (int64_t) (((uint64_t) ntohl(u32[0]) << 32) |
+							  ntohl(u32[1]));
+		default:
+			return 0;
+	}
+}
+
+/* Same as pg_getint() for float4 and float8 columns. */
+double
+pg_getfloat(const PGresult *pgresult, int row, int column)
+{
+	const char *value = PQgetvalue(pgresult, row, column);
+	uint32_t	u32;
+	uint64_t	u64;
+	float		f;
+	double		d;
+
+	if (PQfformat(pgresult, column) == 0)
+		return atof(value);
+
+	switch (PQgetlength(pgresult, row, column))
+	{
+		case 4:
+			memcpy(&u32, value, sizeof(u32));
+			u32 = ntohl(u32);
+			memcpy(&f, &u32, sizeof(f));
+			return f;
+		case 8:
+			u64 = pg_getint(pgresult, row, column);
+			memcpy(&d, &u64, sizeof(d));
+			return d;
+		default:
+			return 0;
+	}
 }
 
 PGresult *
@@ -174,12 +545,23 @@ pg_query(PGconn *pgconn, int procpid)
 		sql = (char *) malloc(strlen(CURRENT_QUERY_9_1) + 7);
 		sprintf(sql, CURRENT_QUERY_9_1, procpid);
 	}
+	COUNT_ROUND_TRIP();
 	pgresult = PQexec(pgconn, sql);
 	free(sql);
 
 	return pgresult;
 }
 
+/*
+ * Return the number of round trips made to the server since the last call,
+ * which is once per refresh.
+ */
+int
+pg_round_trips(void)
+{
+	return __sync_fetch_and_and(&round_trips, 0);
+}
+
 int
 pg_version(PGconn *pgconn)
 {
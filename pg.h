@@ -3,13 +3,21 @@
 #ifndef _PG_H_
 #define _PG_H_
 
+#include <time.h>
+
 #include <libpq-fe.h>
 
 struct pg_conninfo_ctx
 {
 	PGconn	   *connection;
 	int			persistent;
+	int			prepares;		/* statements are prepared on it */
 	const char *values[6];
+
+	/* State for getting a persistent connection back after losing it. */
+	PGconn	   *lost;
+	int			backoff;		/* seconds to wait before the next attempt */
+	time_t		retry_at;
 };
 
 void		connect_to_db(struct pg_conninfo_ctx *);
@@ -17,8 +25,20 @@ void		disconnect_from_db(struct pg_conninfo_ctx *);
 
 PGresult   *pg_locks(PGconn *, int);
 PGresult   *pg_processes(PGconn *);
+int			pg_processes_send(PGconn *);
+PGresult   *pg_processes_result(PGconn *);
 PGresult   *pg_replication(PGconn *);
+PGresult   *pg_tables(PGconn *);
+PGresult   *pg_indexes(PGconn *);
+PGresult   *pg_statements(PGconn *);
+PGresult   *pg_statement_texts(PGconn *, const char *);
 PGresult   *pg_query(PGconn *, int);
+PGresult   *pg_exec(PGconn *, const char *);
+long long	pg_getint(const PGresult *, int, int);
+double		pg_getfloat(const PGresult *, int, int);
+int			pg_round_trips(void);
+
+extern int	pg_result_format;
 
 enum BackendState
 {
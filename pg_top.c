@@ -29,12 +29,23 @@ char	   *copyright =
  *	FD_SET	 - macros FD_SET and FD_ZERO are used when defined
  */
 
+#if defined(DEBUG) && defined(__linux__)
+#define _GNU_SOURCE				/* for fopencookie */
+#endif
+
 #include "os.h"
 #include <signal.h>
 #include <setjmp.h>
 #include <ctype.h>
 #include <unistd.h>
 #include <getopt.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#ifdef __linux__
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#endif							/* __linux__ */
 
 /* determine which type of signal functions to use */
 #ifdef HAVE_SIGACTION
@@ -49,6 +60,11 @@ char	   *copyright =
 
 #include "pg_top.h"
 #include "remote.h"
+#include "sampler.h"
+#include "record.h"
+#include "relstats.h"
+#include "output.h"
+#include "metrics.h"
 #include "commands.h"
 #include "display.h"			/* interface to display package */
 #include "screen.h"				/* interface to screen package */
@@ -60,11 +76,30 @@ char	   *copyright =
 #endif
 #include "port.h"
 
-/* Size of the stdio buffer given to stdout */
-#define Buffersize	2048
+/*
+ * The stdio buffer given to stdout is sized from the screen at start up,
+ * every line at its widest with room for the cursor motion and colors on
+ * it, so that each refresh goes out to the terminal in a single write when
+ * stdout is flushed.  A window made taller later on may take more than one.
+ * Buffersize is the least it gets, for output that is not drawn.
+ */
+#define Buffersize	65536
+#define Lineescapes 64
 
 /* The buffer that stdio will use */
-char		stdoutbuf[Buffersize];
+char	   *stdoutbuf;
+
+#if defined(DEBUG) && defined(__linux__)
+/* Number of writes to the terminal since the last refresh. */
+static unsigned long stdout_writes = 0;
+
+static ssize_t
+count_write(void *cookie, const char *buf, size_t size)
+{
+	stdout_writes++;
+	return write(STDOUT_FILENO, buf, size);
+}
+#endif							/* DEBUG && __linux__ */
 
 /* build signal masks */
 #ifndef sigmask
@@ -91,6 +126,19 @@ static const char *progname = "pg_top";
 void		process_commands(struct pg_top_context *);
 static void usage(const char *progname);
 
+/* Options that only have a long form */
+enum
+{
+	OPT_COLLECTOR_THREADS = 256,
+	OPT_BINARY_RESULTS,
+	OPT_PROC_ROOT,
+	OPT_RECORD,
+	OPT_RECORD_SIZE,
+	OPT_REPLAY,
+	OPT_OUTPUT,
+	OPT_SERVE_METRICS
+};
+
 /* List of all the options available */
 static struct option long_options[] = {
 	{"batch", no_argument, NULL, 'b'},
@@ -112,6 +160,14 @@ static struct option long_options[] = {
 	{"port", required_argument, NULL, 'p'},
 	{"username", required_argument, NULL, 'U'},
 	{"password", no_argument, NULL, 'W'},
+	{"collector-threads", required_argument, NULL, OPT_COLLECTOR_THREADS},
+	{"binary-results", no_argument, NULL, OPT_BINARY_RESULTS},
+	{"proc-root", required_argument, NULL, OPT_PROC_ROOT},
+	{"record", required_argument, NULL, OPT_RECORD},
+	{"record-size", required_argument, NULL, OPT_RECORD_SIZE},
+	{"replay", required_argument, NULL, OPT_REPLAY},
+	{"output", required_argument, NULL, OPT_OUTPUT},
+	{"serve-metrics", required_argument, NULL, OPT_SERVE_METRICS},
 	{NULL, 0, NULL, 0}
 };
 
@@ -133,6 +189,22 @@ void		(*d_process) (int, char *) = i_process;
  */
 int			mode_stats = STATS_DIFF;
 
+/* Number of threads used to read /proc for the backends. */
+int			collector_threads = 1;
+
+/* Where to find the proc filesystem, NULL for the usual place. */
+char	   *proc_root = NULL;
+
+/* File to record each refresh to, and the size to rotate it at in MB. */
+static char *record_file = NULL;
+static int	record_size = 0;
+
+/* Recording to show instead of sampling. */
+static char *replay_file = NULL;
+
+/* Where to serve the metrics, if anywhere. */
+static char *metrics_addr = NULL;
+
 /*
  *	usage - print help message with details about commands
  */
@@ -144,14 +216,26 @@ usage(const char *progname)
 	printf("  %s [OPTION]... [NUMBER]\n", progname);
 	printf("\nOptions:\n");
 	printf("  -b, --batch               use batch mode\n");
+	printf("      --binary-results      fetch statistics in binary format\n");
 	printf("  -c, --show-command        display command name of each process\n");
 	printf("  -C, --color-mode          turn off color mode\n");
+	printf("      --collector-threads=N read process statistics with N threads\n");
 	printf("  -i, --interactive         use interactive mode\n");
 	printf("  -I, --hide-idle           hide idle processes\n");
 	printf("  -n, --non-interactive     use non-interactive mode\n");
 	printf("  -o, --order-field=FIELD   select sort order\n");
+	printf("      --output=FORMAT       write every process of each refresh\n");
+	printf("                            as jsonl or csv instead of a screen\n");
+	printf("      --proc-root=DIR       read process statistics from DIR\n");
+	printf("                            instead of /proc\n");
+	printf("      --record=FILE         record each refresh to FILE\n");
+	printf("      --record-size=MB      move FILE aside to FILE.1 once it\n");
+	printf("                            reaches MB megabytes\n");
 	printf("  -r, --remote-mode         activate remote mode\n");
-	printf("  -s, --set-delay=SECOND    set delay between screen updates\n");
+	printf("      --replay=FILE         show the refreshes recorded in FILE\n");
+	printf("  -s, --set-delay=SECONDS   set delay between screen updates\n");
+	printf("      --serve-metrics=ADDR  serve Prometheus metrics on [HOST:]PORT\n");
+	printf("                            instead of showing a screen\n");
 	printf("  -T, --show-tags           show color tags\n");
 	printf("  -V, --version             output version information, then exit\n");
 	printf("  -x, --set-display=COUNT   set maximum number of displays\n");
@@ -164,15 +248,7 @@ usage(const char *progname)
 	printf("  -h, --host=HOSTNAME       database server host or socket directory\n");
 	printf("  -p, --port=PORT           database server port\n");
 	printf("  -U, --username=USERNAME   user name to connect as\n");
-	printf("  -W, --password            force password prompt, and persistent connection\n");
-}
-
-RETSIGTYPE
-onalrm(int i)					/* SIGALRM handler */
-
-{
-	/* this is only used in batch mode to break out of the pause() */
-	/* return; */
+	printf("  -W, --password            force password prompt\n");
 }
 
 void
@@ -181,34 +257,49 @@ do_display(struct pg_top_context *pgtctx)
 	register int i = 0;
 	register int active_procs;
 
-	caddr_t		processes;
+	struct snapshot *snap;
+	char		line[MAX_COLS + 1];
 	time_t		curr_time;
 	static struct ext_decl exts = {NULL, NULL};
 
-	/* get the current stats and processes */
-	if (pgtctx->mode_remote == 0)
+	/*
+	 * Writing the processes out or serving metrics needs no screen: either
+	 * is done as they are sampled, and stdout is flushed once per refresh.
+	 */
+	if (output_format != OUTPUT_TEXT || metrics_serving())
 	{
-		get_system_info(&pgtctx->system_info);
-#ifdef __linux__
-		processes = get_process_info(&pgtctx->system_info, &pgtctx->ps,
-									 pgtctx->order_index, &pgtctx->conninfo, pgtctx->mode);
-#else
-		processes = get_process_info(&pgtctx->system_info, &pgtctx->ps,
-									 pgtctx->order_index, &pgtctx->conninfo);
-#endif							/* __linux__ */
+		sampler_sample(pgtctx);
+		e_message();
+		if (fflush(stdout) != 0)
+		{
+			fprintf(stderr, "%s: write error on stdout\n", myname);
+			quit(1);
+			/* NOTREACHED */
+		}
+		if (pgtctx->displays)
+			process_commands(pgtctx);
+		return;
 	}
+
+	/* get the current stats and processes */
+	if (replaying())
+		snap = replay_snapshot(pgtctx);
+	else if (sampler_running())
+		snap = sampler_latest();
 	else
-	{
-		get_system_info_r(&pgtctx->system_info, &pgtctx->conninfo);
-		processes = get_process_info_r(&pgtctx->system_info, &pgtctx->ps,
-									   pgtctx->order_index, &pgtctx->conninfo, pgtctx->mode);
-	}
+		snap = sampler_sample(pgtctx);
+#ifdef DEBUG
+	dprintf("do_display: %d round trips to the server\n", snap->round_trips);
+#endif							/* DEBUG */
+
+	if (recording())
+		record_snapshot(snap, pgtctx->header_text);
 
 	/* display the load averages */
-	(*d_loadave) (pgtctx->system_info.last_pid, pgtctx->system_info.load_avg);
+	(*d_loadave) (snap->system_info.last_pid, snap->system_info.load_avg);
 
-	/* this method of getting the time SHOULD be fairly portable */
-	time(&curr_time);
+	/* show when the statistics were taken, which is long ago on replay */
+	curr_time = snap->usec / 1000000;
 
 	/* if we have a minibar extension, use it, otherwise show uptime */
 	if (exts.f_minibar != NULL)
@@ -224,12 +315,12 @@ do_display(struct pg_top_context *pgtctx)
 	i_timeofday(&curr_time);
 
 	/* display process state breakdown */
-	(*d_procstates) (pgtctx->system_info.p_total, pgtctx->system_info.procstates);
+	(*d_procstates) (snap->system_info.p_total, snap->system_info.procstates);
 
 	/* display the cpu state percentage breakdown */
 	if (pgtctx->dostates)		/* but not the first time */
 	{
-		(*d_cpustates) (pgtctx->system_info.cpustates);
+		(*d_cpustates) (snap->system_info.cpustates);
 	}
 	else
 	{
@@ -242,10 +333,10 @@ do_display(struct pg_top_context *pgtctx)
 	}
 
 	/* display memory stats */
-	(*d_memory) (pgtctx->system_info.memory);
+	(*d_memory) (snap->system_info.memory);
 
 	/* display swap stats */
-	(*d_swap) (pgtctx->system_info.swap);
+	(*d_swap) (snap->system_info.swap);
 
 	/* handle message area */
 	(*d_message) ();
@@ -261,7 +352,7 @@ do_display(struct pg_top_context *pgtctx)
 		 * this number will be the smallest of:  active processes, number user
 		 * requested, number current screen accomodates
 		 */
-		active_procs = pgtctx->system_info.P_ACTIVE;
+		active_procs = snap->system_info.P_ACTIVE;
 		if (active_procs > pgtctx->topn)
 		{
 			active_procs = pgtctx->topn;
@@ -270,39 +361,19 @@ do_display(struct pg_top_context *pgtctx)
 		{
 			active_procs = max_topn;
 		}
+		if (active_procs > snap->nlines)
+		{
+			active_procs = snap->nlines;
+		}
 
-		/* Now show the top "n" processes or other statistics. */
-		switch (pgtctx->mode)
+		/*
+		 * Now show the top "n" processes or other statistics.  The lines are
+		 * copied since displaying them cuts them to the screen width.
+		 */
+		for (i = 0; i < active_procs; i++)
 		{
-#ifdef __linux__
-			case MODE_IO_STATS:
-				for (i = 0; i < active_procs; i++)
-				{
-					if (pgtctx->mode_remote == 0)
-						(*d_process) (i, format_next_io(processes));
-					else
-						(*d_process) (i, format_next_io_r(processes));
-				}
-				break;
-#endif							/* __linux__ */
-			case MODE_REPLICATION:
-				for (i = 0; i < active_procs; i++)
-				{
-					if (pgtctx->mode_remote == 0)
-						(*d_process) (i, format_next_replication(processes));
-					else
-						(*d_process) (i, format_next_replication_r(processes));
-				}
-				break;
-			case MODE_PROCESSES:
-			default:
-				for (i = 0; i < active_procs; i++)
-				{
-					if (pgtctx->mode_remote == 0)
-						(*d_process) (i, format_next_process(processes));
-					else
-						(*d_process) (i, format_next_process_r(processes));
-				}
+			strcpy(line, snap->lines + (size_t) i * MAX_COLS);
+			(*d_process) (i, line);
 		}
 	}
 	else
@@ -321,6 +392,10 @@ do_display(struct pg_top_context *pgtctx)
 		quit(1);
 		/* NOTREACHED */
 	}
+#if defined(DEBUG) && defined(__linux__)
+	dprintf("do_display: %lu writes to the terminal\n", stdout_writes);
+	stdout_writes = 0;
+#endif							/* DEBUG && __linux__ */
 
 	/* only do the rest if we have more displays to show */
 	if (pgtctx->displays)
@@ -347,17 +422,7 @@ do_display(struct pg_top_context *pgtctx)
 			}
 		}
 
-		if (!pgtctx->interactive)
-		{
-			/* set up alarm */
-			(void) signal(SIGALRM, onalrm);
-			(void) alarm((unsigned) pgtctx->delay);
-
-			/* wait for the rest of it .... */
-			pause();
-		}
-		else
-			process_commands(pgtctx);
+		process_commands(pgtctx);
 	}
 }
 
@@ -425,8 +490,7 @@ process_arguments(struct pg_top_context *pgtctx, int ac, char **av)
 				break;
 
 			case 's':
-				if ((pgtctx->delay = atoi(optarg)) < 0 ||
-					(pgtctx->delay == 0 && getuid() != 0))
+				if ((pgtctx->delay = atodelay(optarg)) == Invalid)
 				{
 					new_message(MT_standout | MT_delayed,
 								" Bad seconds delay (ignored)");
@@ -451,7 +515,6 @@ process_arguments(struct pg_top_context *pgtctx, int ac, char **av)
 				break;
 
 			case 'W':			/* prompt for database password */
-				pgtctx->conninfo.persistent = 1;
 				pgtctx->conninfo.values[PG_PASSWORD] =
 					simple_prompt("Password: ", 1000, 0);
 				break;
@@ -480,6 +543,67 @@ process_arguments(struct pg_top_context *pgtctx, int ac, char **av)
 				pgtctx->mode = MODE_IO_STATS;
 				break;
 
+			case OPT_BINARY_RESULTS:
+				pg_result_format = 1;
+				break;
+
+			case OPT_PROC_ROOT:
+				proc_root = optarg;
+				break;
+
+			case OPT_RECORD:
+				record_file = optarg;
+				break;
+
+			case OPT_RECORD_SIZE:
+				if ((i = atoiwi(optarg)) == Invalid || i <= 0)
+				{
+					new_message(MT_standout | MT_delayed,
+								" Bad recording size (ignored)");
+				}
+				else
+				{
+					record_size = i;
+				}
+				break;
+
+			case OPT_REPLAY:
+				replay_file = optarg;
+				break;
+
+			case OPT_SERVE_METRICS:
+				metrics_addr = optarg;
+				break;
+
+			case OPT_OUTPUT:
+				if (output_parse(optarg) == -1)
+				{
+					new_message(MT_standout | MT_delayed,
+								" Bad output format (ignored)");
+				}
+				break;
+
+			case OPT_COLLECTOR_THREADS:
+				if ((i = atoiwi(optarg)) == Invalid || i < 1)
+				{
+					new_message(MT_standout | MT_delayed,
+								" Bad number of collector threads (ignored)");
+				}
+				else
+				{
+					/* more threads than processors only get in the way */
+					long		ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+					if (ncpus > 0 && i > ncpus)
+					{
+						new_message(MT_standout | MT_delayed,
+									" Collector threads capped at %ld", ncpus);
+						i = (int) ncpus;
+					}
+					collector_threads = i;
+				}
+				break;
+
 			default:
 				fprintf(stderr, "Try \"%s --help\" for more information.\n",
 						progname);
@@ -488,26 +612,220 @@ process_arguments(struct pg_top_context *pgtctx, int ac, char **av)
 	}
 }
 
+/*
+ * The refresh timer.  Refreshes are due every delay seconds counted from
+ * when the timer was armed rather than from when the last one finished, so
+ * the time spent collecting does not push them back.  On Linux the ticks
+ * come from a timerfd and SIGWINCH from a signalfd, so that both can be
+ * waited for with poll() next to the terminal.
+ */
+#ifdef __linux__
+static int	tick_fd = -1;
+static int	winch_fd = -1;
+#endif							/* __linux__ */
+static double tick_delay = -1;	/* delay the timer is armed with */
+static struct timespec next_tick;
+
+/* Readable when the collector thread has a new snapshot, if it is running. */
+static int	sample_fd = -1;
+
+static void
+tick_advance(const struct timespec *interval)
+{
+	next_tick.tv_sec += interval->tv_sec;
+	next_tick.tv_nsec += interval->tv_nsec;
+	if (next_tick.tv_nsec >= 1000000000L)
+	{
+		next_tick.tv_sec++;
+		next_tick.tv_nsec -= 1000000000L;
+	}
+}
+
+static void
+tick_arm(double delay)
+{
+	struct timespec interval;
+
+	tick_delay = delay;
+	interval.tv_sec = (time_t) delay;
+	interval.tv_nsec = (long) ((delay - interval.tv_sec) * 1e9);
+
+#ifdef __linux__
+	if (tick_fd == -1)
+		tick_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (tick_fd != -1)
+	{
+		struct itimerspec its;
+
+		/* a delay of 0 disarms the timer, refreshes then never wait */
+		memset(&its, 0, sizeof(its));
+		its.it_value = interval;
+		its.it_interval = interval;
+		timerfd_settime(tick_fd, 0, &its, NULL);
+		return;
+	}
+#endif							/* __linux__ */
+
+	clock_gettime(CLOCK_MONOTONIC, &next_tick);
+	tick_advance(&interval);
+}
+
+/* How long poll() may wait for the next tick, in milliseconds. */
+static int
+tick_timeout(void)
+{
+	struct timespec now;
+	long long	ms;
+
+	if (tick_delay == 0)
+		return 0;
+#ifdef __linux__
+	if (tick_fd != -1)
+		return -1;
+#endif							/* __linux__ */
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	ms = (next_tick.tv_sec - now.tv_sec) * 1000LL +
+		(next_tick.tv_nsec - now.tv_nsec) / 1000000;
+	return ms > 0 ? (int) ms : 0;
+}
+
+/* Move on to the next tick, dropping any that were missed. */
+static void
+tick_consume(void)
+{
+	struct timespec now;
+	struct timespec interval;
+
+#ifdef __linux__
+	if (tick_fd != -1)
+	{
+		uint64_t	expirations;
+
+		(void) read(tick_fd, &expirations, sizeof(expirations));
+		return;
+	}
+#endif							/* __linux__ */
+
+	interval.tv_sec = (time_t) tick_delay;
+	interval.tv_nsec = (long) ((tick_delay - interval.tv_sec) * 1e9);
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	while (next_tick.tv_sec < now.tv_sec ||
+		   (next_tick.tv_sec == now.tv_sec && next_tick.tv_nsec <= now.tv_nsec))
+		tick_advance(&interval);
+}
+
+/*
+ * Wait for the next refresh to be due, executing whatever commands are
+ * typed in the mean time.  Returns early when a command or a change in the
+ * window size needs the screen redrawn.  When the collector thread is
+ * running, refreshes are due whenever it publishes a snapshot, and a redraw
+ * waits for one taken after the command that asked for it.
+ */
 void
 process_commands(struct pg_top_context *pgtctx)
 {
-	int			no_command;
-	fd_set		readfds;
+	struct pollfd fds[3];
+	int			nfds;
+	int			stdin_idx = -1;
+	int			tick_idx = -1;
+	int			winch_idx = -1;
+	int			timeout;
+	int			n;
 	char		ch;
+	char		buf[64];
 
-	do
+	if (sample_fd == -1 && !replaying() && pgtctx->delay != tick_delay)
+		tick_arm(pgtctx->delay);
+
+	for (;;)
 	{
-		no_command = No;
+		nfds = 0;
+		if (pgtctx->interactive)
+		{
+			stdin_idx = nfds;
+			fds[nfds].fd = 0;
+			fds[nfds++].events = POLLIN;
+		}
+		if (sample_fd != -1)
+		{
+			tick_idx = nfds;
+			fds[nfds].fd = sample_fd;
+			fds[nfds++].events = POLLIN;
+		}
+#ifdef __linux__
+		else if (tick_fd != -1 && tick_delay > 0)
+		{
+			tick_idx = nfds;
+			fds[nfds].fd = tick_fd;
+			fds[nfds++].events = POLLIN;
+		}
+		if (winch_fd != -1)
+		{
+			winch_idx = nfds;
+			fds[nfds].fd = winch_fd;
+			fds[nfds++].events = POLLIN;
+		}
+#endif							/* __linux__ */
+
+		/* wait for input, a change in size or the end of the delay period */
+		if (replaying())
+			timeout = replay_timeout(pgtctx->interactive);
+		else
+			timeout = sample_fd != -1 ? -1 : tick_timeout();
+		if ((n = poll(fds, nfds, timeout)) == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			new_message(MT_standout, " Poll error: %s", strerror(errno));
+			putchar('\r');
+			quit(1);
+			/* NOTREACHED */
+		}
+
+		if (n == 0)
+		{
+			if (!replaying())
+				tick_consume();
+			else if (!replay_advance() && !pgtctx->interactive)
+				quit(0);
+			return;
+		}
+
+		if (tick_idx != -1 && (fds[tick_idx].revents & POLLIN))
+		{
+			if (sample_fd == -1)
+			{
+				tick_consume();
+				return;
+			}
+
+			while (read(sample_fd, buf, sizeof(buf)) > 0)
+				;
+			if (sampler_ready())
+				return;
+		}
 
-		/* set up arguments for select with timeout */
-		FD_ZERO(&readfds);
-		FD_SET(0, &readfds);	/* for standard input */
-		pgtctx->timeout.tv_sec = pgtctx->delay;
-		pgtctx->timeout.tv_usec = 0;
+#ifdef __linux__
+		if (winch_idx != -1 && (fds[winch_idx].revents & POLLIN))
+		{
+			struct signalfd_siginfo si;
+
+			(void) read(winch_fd, &si, sizeof(si));
+
+			/* reascertain the screen dimensions and redraw everything */
+			get_screensize();
+			max_topn = display_resize();
+			reset_display(pgtctx);
+			if (sample_fd == -1)
+				return;
+			sampler_request(pgtctx);
+			continue;
+		}
+#endif							/* __linux__ */
 
-		/* wait for either input or the end of the delay period */
-		if (select(32, &readfds, (fd_set *) NULL, (fd_set *) NULL,
-				   &pgtctx->timeout) > 0)
+		if (stdin_idx != -1 && (fds[stdin_idx].revents & (POLLIN | POLLHUP)))
 		{
 			/* something to read -- clear the message area first */
 			clear_message();
@@ -523,12 +841,19 @@ process_commands(struct pg_top_context *pgtctx)
 				/* NOTREACHED */
 			}
 
-			no_command = execute_command(pgtctx, ch);
+			n = execute_command(pgtctx, ch);
 
 			/* flush out stuff that may have been written */
 			fflush(stdout);
+
+			if (!n)
+			{
+				if (sample_fd == -1)
+					return;
+				sampler_request(pgtctx);
+			}
 		}
-	} while (no_command);
+	}
 }
 
 /*
@@ -663,7 +988,9 @@ main(int argc, char *argv[])
 	char	  **preset_argv;
 	int			preset_argc = 0;
 	char	  **av;
+	const char *opt;
 	int			ac;
+	size_t		bufsize;
 
 #ifndef FD_SET
 	/* FD_SET and friends are not present:	fake it */
@@ -695,10 +1022,12 @@ main(int argc, char *argv[])
 	pgtctx.ps.fullcmd = Yes;
 	pgtctx.ps.command = NULL;
 	pgtctx.ps.usename[0] = '\0';
+	pgtctx.ps.topn = Largest;
 	pgtctx.show_tags = No;
 	pgtctx.topn = 0;
 	pgtctx.conninfo.connection = NULL;
-	pgtctx.conninfo.persistent = 0;
+	pgtctx.conninfo.persistent = 1;
+	pgtctx.conninfo.prepares = 1;
 
 	/* Show help or version number if necessary */
 	if (argc > 1)
@@ -715,14 +1044,16 @@ main(int argc, char *argv[])
 		}
 	}
 
-	/* set the buffer for stdout */
-#ifdef HAVE_SETVBUF
-	setvbuf(stdout, stdoutbuf, _IOFBF, BUFFERSIZE);
-#else
-#ifdef HAVE_SETBUFFER
-	setbuffer(stdout, stdoutbuf, Buffersize);
-#endif							/* HAVE_SETBUFFER */
-#endif							/* HAVE_SETVBUF */
+#if defined(DEBUG) && defined(__linux__)
+	/* count the writes to the terminal */
+	{
+		cookie_io_functions_t io = {NULL, count_write, NULL, NULL};
+		FILE	   *fp;
+
+		if ((fp = fopencookie(NULL, "w", io)) != NULL)
+			stdout = fp;
+	}
+#endif							/* DEBUG && __linux__ */
 
 	/* get our name */
 	if (argc > 0)
@@ -785,6 +1116,55 @@ main(int argc, char *argv[])
 		/* repeat only if we really did the preset arguments */
 	} while (i != 0);
 
+	/*
+	 * stdout is for the statistics alone when writing them out, and nothing
+	 * at all when serving them.
+	 */
+	if (output_format != OUTPUT_TEXT || metrics_addr != NULL)
+	{
+		opt = output_format != OUTPUT_TEXT ? "--output" : "--serve-metrics";
+		if (output_format != OUTPUT_TEXT && metrics_addr != NULL)
+		{
+			fprintf(stderr, "%s: --output cannot be used with --serve-metrics\n",
+					myname);
+			exit(1);
+		}
+		if (replay_file != NULL || record_file != NULL)
+		{
+			fprintf(stderr, "%s: %s cannot be used with --%s\n", myname, opt,
+					replay_file != NULL ? "replay" : "record");
+			exit(1);
+		}
+#ifndef __linux__
+		if (pgtctx.mode_remote == 0)
+		{
+			fprintf(stderr, "%s: %s needs remote mode on this platform\n",
+					myname, opt);
+			exit(1);
+		}
+#endif							/* __linux__ */
+		pgtctx.interactive = No;
+		if (pgtctx.displays == 0)
+			pgtctx.displays = Infinity;
+	}
+
+	/* the metrics are about every backend there is */
+	if (metrics_addr != NULL)
+	{
+		pgtctx.mode = MODE_PROCESSES;
+		pgtctx.ps.idle = Yes;
+	}
+
+	/*
+	 * Commands that query the server get a connection of their own, so they
+	 * never wait on or interfere with the one used for sampling.  It is
+	 * only opened when one of them is used.
+	 */
+	pgtctx.cmd_conninfo.persistent = 1;
+	for (i = 0; i < 5; i++)
+		if (pgtctx.conninfo.values[i] != NULL)
+			pgtctx.cmd_conninfo.values[i] = strdup(pgtctx.conninfo.values[i]);
+
 	/* set constants for username/uid display correctly */
 	if (!pgtctx.do_unames)
 	{
@@ -811,8 +1191,10 @@ main(int argc, char *argv[])
 	color_env_parse(env_top);
 #endif
 
-	/* call the platform-specific init */
-	if (pgtctx.mode_remote == 0)
+	/* call the platform-specific init, or read what it was from a recording */
+	if (replay_file != NULL)
+		i = replay_open(replay_file, &pgtctx.statics);
+	else if (pgtctx.mode_remote == 0)
 		i = machine_init(&pgtctx.statics);
 	else
 		i = machine_init_r(&pgtctx.statics, &pgtctx.conninfo);
@@ -829,17 +1211,19 @@ main(int argc, char *argv[])
 						" This platform does not support arbitrary ordering");
 		}
 		else if ((pgtctx.order_index = string_index(pgtctx.order_name,
-													pgtctx.statics.order_names)) == -1)
+													pgtctx.statics.order_names)) == -1 ||
+				 !order_applies(&pgtctx.statics, pgtctx.mode,
+								pgtctx.order_index))
 		{
-			char	  **pp;
-
-			fprintf(stderr, "%s: '%s' is not a recognized sorting order.\n",
-					myname, pgtctx.order_name);
+			fprintf(stderr, "%s: '%s' is not a %s.\n", myname,
+					pgtctx.order_name, pgtctx.order_index == -1 ?
+					"recognized sorting order" :
+					"sorting order for this display");
 			fprintf(stderr, "\tTry one of these:");
-			pp = pgtctx.statics.order_names;
-			while (*pp != NULL)
+			for (i = 0; pgtctx.statics.order_names[i] != NULL; i++)
 			{
-				fprintf(stderr, " %s", *pp++);
+				if (order_applies(&pgtctx.statics, pgtctx.mode, i))
+					fprintf(stderr, " %s", pgtctx.statics.order_names[i]);
 			}
 			fputc('\n', stderr);
 			exit(1);
@@ -854,15 +1238,36 @@ main(int argc, char *argv[])
 	/* initialize termcap */
 	init_termcap(pgtctx.interactive);
 
+	/*
+	 * Set the buffer for stdout, now that the screen size is known.  It is
+	 * fully buffered even on a terminal, everything that needs to be seen
+	 * before waiting is flushed explicitly.
+	 */
+	bufsize = (size_t) (screen_length + 1) * (MAX_COLS + Lineescapes);
+	if (bufsize < Buffersize)
+		bufsize = Buffersize;
+	if ((stdoutbuf = malloc(bufsize)) == NULL)
+	{
+		fprintf(stderr, "%s: can't allocate sufficient memory\n", myname);
+		exit(4);
+	}
+	setvbuf(stdout, stdoutbuf, _IOFBF, bufsize);
+
 	/* 0 corresponds to machine headers definitions */
 	pgtctx.header_options[0][MODE_PROCESSES] = format_header(uname_field);
 	pgtctx.header_options[0][MODE_IO_STATS] = fmt_header_io;
 	pgtctx.header_options[0][MODE_REPLICATION] = fmt_header_replication;
+	pgtctx.header_options[0][MODE_TABLE_STATS] = fmt_header_tables;
+	pgtctx.header_options[0][MODE_INDEX_STATS] = fmt_header_indexes;
+	pgtctx.header_options[0][MODE_STATEMENTS] = fmt_header_statements;
 
 	/* 1 corresponds to headers definitions when remotely connecting to pg */
 	pgtctx.header_options[1][MODE_PROCESSES] = format_header_r(uname_field);
 	pgtctx.header_options[1][MODE_IO_STATS] = fmt_header_io_r;
 	pgtctx.header_options[1][MODE_REPLICATION] = fmt_header_replication_r;
+	pgtctx.header_options[1][MODE_TABLE_STATS] = fmt_header_tables;
+	pgtctx.header_options[1][MODE_INDEX_STATS] = fmt_header_indexes;
+	pgtctx.header_options[1][MODE_STATEMENTS] = fmt_header_statements;
 
 	/* get the string to use for the process area header */
 
@@ -921,9 +1326,20 @@ main(int argc, char *argv[])
 	/* if # of displays not specified, fill it in */
 	if (pgtctx.displays == 0)
 	{
-		pgtctx.displays = smart_terminal ? Infinity : 1;
+		pgtctx.displays = smart_terminal || replaying() ? Infinity : 1;
 	}
 
+	/* start serving metrics */
+	if (metrics_addr != NULL &&
+		metrics_listen(metrics_addr, &pgtctx.statics) == -1)
+		exit(1);
+
+	/* start recording */
+	if (record_file != NULL &&
+		record_open(record_file, record_size * 1024LL * 1024,
+					&pgtctx.statics) == -1)
+		exit(1);
+
 	/* hold interrupt signals while setting up the screen and the handlers */
 #ifdef HAVE_SIGPROCMASK
 	sigemptyset(&signalset);
@@ -960,14 +1376,35 @@ main(int argc, char *argv[])
 	(void) set_signal(SIGQUIT, leave);
 	(void) set_signal(SIGTSTP, tstop);
 #ifdef SIGWINCH
+#if defined(__linux__) && defined(HAVE_SIGPROCMASK)
+	{
+		sigset_t	winchset;
+
+		/*
+		 * Leave SIGWINCH blocked and let process_commands pick it up from a
+		 * signalfd, instead of jumping out of whatever is going on when the
+		 * window changes size.
+		 */
+		sigemptyset(&winchset);
+		sigaddset(&winchset, SIGWINCH);
+		winch_fd = signalfd(-1, &winchset, SFD_NONBLOCK | SFD_CLOEXEC);
+		if (winch_fd != -1)
+			sigdelset(&signalset, SIGWINCH);
+		else
+			(void) set_signal(SIGWINCH, winch);
+	}
+#else
 	(void) set_signal(SIGWINCH, winch);
-#endif
+#endif							/* __linux__ && HAVE_SIGPROCMASK */
+#endif							/* SIGWINCH */
 
 	/* setup the jump buffer for stops */
 	if (setjmp(jmp_int) != 0)
 	{
 		/* control ends up here after an interrupt */
 		reset_display(&pgtctx);
+		if (sampler_running())
+			sampler_request(&pgtctx);
 	}
 
 	/*
@@ -992,7 +1429,7 @@ main(int argc, char *argv[])
 #endif
 
 	/* some systems require a warmup */
-	if (pgtctx.statics.flags.warmup)
+	if (pgtctx.statics.flags.warmup && !sampler_running())
 	{
 		if (pgtctx.mode_remote == 0)
 		{
@@ -1007,7 +1444,8 @@ main(int argc, char *argv[])
 		}
 		else
 		{
-			get_system_info_r(&pgtctx.system_info, &pgtctx.conninfo);
+			get_system_info_r(&pgtctx.system_info, &pgtctx.ps, pgtctx.mode,
+							  &pgtctx.conninfo);
 			(void) get_process_info_r(&pgtctx.system_info, &pgtctx.ps, -1,
 									  &pgtctx.conninfo, -1);
 		}
@@ -1020,6 +1458,31 @@ main(int argc, char *argv[])
 		pgtctx.dostates = Yes;
 	}
 
+	/* every recorded refresh has good states */
+	if (replaying())
+		pgtctx.dostates = Yes;
+
+	/*
+	 * Sample in the background when there is a screen to keep responsive,
+	 * otherwise each display samples for itself.
+	 */
+	if (pgtctx.interactive && smart_terminal && !replaying() &&
+		!sampler_running())
+		sample_fd = sampler_start(&pgtctx);
+
+	/*
+	 * The connection for the commands is opened the first time one of them
+	 * runs, which forgets the password.  Nothing runs commands otherwise.
+	 */
+	if (!pgtctx.interactive)
+	{
+		for (i = 0; i < 5; i++)
+		{
+			free((void *) pgtctx.cmd_conninfo.values[i]);
+			pgtctx.cmd_conninfo.values[i] = NULL;
+		}
+	}
+
 	/*
 	 * main loop -- repeat while display count is positive or while it
 	 * indicates infinity (by being -1)
@@ -56,6 +56,11 @@ struct ext_decl
 #define Default_DELAY	5
 #endif
 
+/* Shortest delay, in seconds, that anyone but root may ask for */
+#ifndef Min_DELAY
+#define Min_DELAY		0.1
+#endif
+
 /*
  *	If the local system's getpwnam interface uses random access to retrieve
  *	a record (i.e.: 4.3 systems, Sun "yellow pages"), then defining
@@ -87,7 +92,7 @@ struct pg_top_context
 #ifdef ENABLE_COLOR
 	int			color_on;
 #endif
-	int			delay;
+	double		delay;			/* seconds between updates */
 	int			displays;
 	void		(*d_header) (char *);
 	char		do_unames;
@@ -107,6 +112,7 @@ struct pg_top_context
 	struct timeval timeout;
 	int			topn;
 	struct pg_conninfo_ctx conninfo;
+	struct pg_conninfo_ctx cmd_conninfo;	/* kept open for commands */
 };
 
 void		quit(int);
@@ -0,0 +1,1332 @@
+/*
+ *	Top users/processes display for Unix
+ *
+ *	Copyright (c) 2007-2019, Mark Wong
+ */
+
+/*
+ *	This file contains the routines that record each refresh to a file and
+ *	play such a file back through the display.
+ *
+ *	A recording starts with a file header naming the process, cpu, memory
+ *	and swap states, followed by one record per refresh.  Every record is
+ *	prefixed with its length and holds the system information and then
+ *	either every process or the formatted lines of the other displays.
+ *
+ *	The processes are kept the way they were sampled, in order of pid, so
+ *	that replay can sort, filter and format them as it is asked to and show
+ *	the ones that did not fit on the screen.  Each number is stored as how
+ *	much it changed since the record before for the same pid, and each name
+ *	only when it changed, all in a variable length encoding.  The lines of
+ *	the other displays, every one of them, are stored as the number of
+ *	leading characters each shares with the same line of the record before
+ *	plus the characters that differ.  Key frames refer to no earlier record
+ *	and are what replay seeks to.  Numbers are stored in the byte order of
+ *	the machine that made the recording.
+ *
+ *	Replay maps the file and decodes records straight out of the mapping,
+ *	the names of the processes are used where they are in it.
+ */
+
+#include "os.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "pg_top.h"
+#include "display.h"
+#include "pg.h"
+#include "record.h"
+#include "utils.h"
+
+#define LOG_MAGIC	"PGTOPLOG"
+#define LOG_VERSION 2
+
+/* Record flags */
+#define REC_KEYFRAME	0x01	/* does not refer to the previous record */
+#define REC_HEADER		0x02	/* the process header text follows */
+#define REC_BACKENDS	0x04	/* every process follows, not lines */
+
+/* Records between key frames */
+#define KEYFRAME_INTERVAL 60
+
+/* Size of the fixed part of a record, after its length */
+#define REC_FIXED	(4 + 8 + 8 + 3 * 4 + NUM_AVERAGES * 8)
+
+/*
+ * Longest pause replay makes between two refreshes, in seconds, so that a
+ * recording that was stopped and picked up again later plays on.
+ */
+#define MAX_GAP		10.0
+
+/* The numbers kept for each process, in the order they are stored. */
+#define BV_PGSTATE	0
+#define BV_PCPU		1			/* in millionths */
+#define BV_SIZE		2
+#define BV_RSS		3
+#define BV_XTIME	4
+#define BV_QTIME	5
+#define BV_LOCKS	6
+#define BV_IO		7			/* struct backend_io, then io_diff */
+#define BV_NIO		7
+#define BV_COUNT	(BV_IO + 2 * BV_NIO)
+
+extern char *myname;
+extern int	max_topn;
+
+/* Buffer a record or a file header is put together in. */
+struct logbuf
+{
+	char	   *data;
+	size_t		len;
+	size_t		size;
+};
+
+static struct
+{
+	FILE	   *fp;
+	char	   *path;
+	long long	max_size;		/* rotate when this big, 0 never */
+	long long	size;
+	long		records;		/* records in the current file */
+	struct statics *statics;
+	int			nprocstates;
+	int			ncpustates;
+	int			nmemory;
+	int			nswap;
+	struct logbuf buf;
+	char		header[MAX_COLS];
+	char	   *lines;			/* lines of the previous record */
+	int			nlines;
+	int			lines_size;
+
+	/* the processes of the previous record, in order of pid */
+	struct backend_stats *prev;
+	int			nprev;
+	int			prev_size;
+	char	   *prev_strings;
+	size_t		prev_strings_size;
+	struct backend_stats **order;	/* this record's, in order of pid */
+	int			order_size;
+}			rec;
+
+static struct
+{
+	int			active;
+	char	   *map;
+	size_t		map_size;
+	size_t	   *offsets;		/* of each record */
+	int64_t    *usecs;			/* when each record was taken */
+	int			count;
+	int			current;		/* record decoded into snap */
+	struct snapshot snap;
+	time_t		boottime;
+	char		header[MAX_COLS];
+	int			header_changed;
+	int			nprocstates;
+	int			ncpustates;
+	int			nmemory;
+	int			nswap;
+	double		speed;
+	int			paused;
+	struct timespec due;		/* when the next record should be shown */
+
+	int			mode;			/* what the current record was taken in */
+	int			mode_remote;
+	int			shown_mode;		/* the recorded mode last shown, or -1 */
+	char	   *lines;			/* the current record's lines */
+	int			nlines;
+	int			lines_size;
+
+	/* the current record's processes, in order of pid, or nrows -1 */
+	struct backend_stats *rows;
+	struct backend_stats *next_rows;	/* the next record's go here */
+	int			nrows;
+	int			rows_size;
+	struct backend_stats **shown;	/* those that pass, in display order */
+	char	   *formatted;		/* their lines */
+	int			formatted_size;
+}			replay;
+
+/* What replay sorts the processes by: a BV_ number, or -1 for the name. */
+static char *replay_order_names[] =
+{
+	"cpu", "size", "res", "xtime", "qtime", "rchar", "wchar", "syscr",
+	"syscw", "reads", "writes", "cwrites", "locks", "command", NULL
+};
+
+static int	replay_order_values[] =
+{
+	BV_PCPU, BV_SIZE, BV_RSS, BV_XTIME, BV_QTIME, BV_IO, BV_IO + 1,
+	BV_IO + 2, BV_IO + 3, BV_IO + 4, BV_IO + 5, BV_IO + 6, BV_LOCKS, -1
+};
+
+static int
+name_count(char **pp)
+{
+	int			cnt = 0;
+
+	if (pp != NULL)
+		while (*pp++ != NULL)
+			cnt++;
+	return cnt;
+}
+
+static int
+buf_put(struct logbuf *buf, const void *p, size_t n)
+{
+	char	   *data;
+	size_t		size;
+
+	if (buf->len + n > buf->size)
+	{
+		size = buf->size > 0 ? buf->size : 4096;
+		while (size < buf->len + n)
+			size *= 2;
+		if ((data = realloc(buf->data, size)) == NULL)
+			return -1;
+		buf->data = data;
+		buf->size = size;
+	}
+	memcpy(buf->data + buf->len, p, n);
+	buf->len += n;
+	return 0;
+}
+
+static int
+buf_put_int32(struct logbuf *buf, int32_t v)
+{
+	return buf_put(buf, &v, sizeof(v));
+}
+
+static int
+buf_put_int64(struct logbuf *buf, int64_t v)
+{
+	return buf_put(buf, &v, sizeof(v));
+}
+
+/* Seven bits at a time, with the sign folded into the lowest bit. */
+static int
+buf_put_varint(struct logbuf *buf, int64_t v)
+{
+	uint64_t	u = ((uint64_t) v << 1) ^ (uint64_t) (v >> 63);
+	unsigned char bytes[10];
+	int			n = 0;
+
+	do
+	{
+		bytes[n] = u & 0x7f;
+		u >>= 7;
+		if (u != 0)
+			bytes[n] |= 0x80;
+		n++;
+	} while (u != 0);
+	return buf_put(buf, bytes, n);
+}
+
+static int
+buf_put_names(struct logbuf *buf, char **names)
+{
+	int			n = name_count(names);
+	int			i;
+
+	if (buf_put_int32(buf, n) == -1)
+		return -1;
+	for (i = 0; i < n; i++)
+		if (buf_put(buf, names[i], strlen(names[i]) + 1) == -1)
+			return -1;
+	return 0;
+}
+
+static int
+buf_put_file_header(struct logbuf *buf, struct statics *statics)
+{
+	buf->len = 0;
+	if (buf_put(buf, LOG_MAGIC, 8) == -1 ||
+		buf_put_int32(buf, LOG_VERSION) == -1 ||
+		buf_put_names(buf, statics->procstate_names) == -1 ||
+		buf_put_names(buf, statics->cpustate_names) == -1 ||
+		buf_put_names(buf, statics->memory_names) == -1 ||
+		buf_put_names(buf, statics->swap_names) == -1)
+		return -1;
+	return 0;
+}
+
+static void
+io_values(const struct backend_io *io, int64_t *v)
+{
+	v[0] = io->rchar;
+	v[1] = io->wchar;
+	v[2] = io->syscr;
+	v[3] = io->syscw;
+	v[4] = io->read_bytes;
+	v[5] = io->write_bytes;
+	v[6] = io->cancelled_write_bytes;
+}
+
+static void
+io_set_values(struct backend_io *io, const int64_t *v)
+{
+	io->rchar = v[0];
+	io->wchar = v[1];
+	io->syscr = v[2];
+	io->syscw = v[3];
+	io->read_bytes = v[4];
+	io->write_bytes = v[5];
+	io->cancelled_write_bytes = v[6];
+}
+
+/* The numbers kept of process "b", as BV_COUNT values. */
+static void
+backend_values(const struct backend_stats *b, int64_t *v)
+{
+	v[BV_PGSTATE] = b->pgstate;
+	v[BV_PCPU] = (int64_t) (b->pcpu * 1000000.0 + 0.5);
+	v[BV_SIZE] = b->size;
+	v[BV_RSS] = b->rss;
+	v[BV_XTIME] = b->xtime;
+	v[BV_QTIME] = b->qtime;
+	v[BV_LOCKS] = b->locks;
+	io_values(&b->io, v + BV_IO);
+	io_values(&b->io_diff, v + BV_IO + BV_NIO);
+}
+
+static void
+backend_set_values(struct backend_stats *b, const int64_t *v)
+{
+	b->pgstate = v[BV_PGSTATE];
+	b->pcpu = v[BV_PCPU] / 1000000.0;
+	b->size = v[BV_SIZE];
+	b->rss = v[BV_RSS];
+	b->xtime = v[BV_XTIME];
+	b->qtime = v[BV_QTIME];
+	b->locks = v[BV_LOCKS];
+	io_set_values(&b->io, v + BV_IO);
+	io_set_values(&b->io_diff, v + BV_IO + BV_NIO);
+}
+
+static int
+backend_pid_cmp(const void *v1, const void *v2)
+{
+	pid_t		p1 = (*(struct backend_stats *const *) v1)->pid;
+	pid_t		p2 = (*(struct backend_stats *const *) v2)->pid;
+
+	return p1 < p2 ? -1 : p1 > p2;
+}
+
+static void
+record_stop(const char *why)
+{
+	new_message(MT_standout | MT_delayed, " Recording stopped: %s", why);
+	if (rec.fp != NULL)
+		fclose(rec.fp);
+	rec.fp = NULL;
+}
+
+/*
+ * Start recording to "path", or carry on with a recording already there.
+ * Returns -1 if that cannot be done.
+ */
+int
+record_open(const char *path, long long max_size, struct statics *statics)
+{
+	char	   *head;
+	long		size;
+
+	if (buf_put_file_header(&rec.buf, statics) == -1)
+	{
+		fprintf(stderr, "%s: can't allocate sufficient memory\n", myname);
+		return -1;
+	}
+
+	if ((rec.fp = fopen(path, "a+")) == NULL)
+	{
+		fprintf(stderr, "%s: %s: %s\n", myname, path, strerror(errno));
+		return -1;
+	}
+
+	fseek(rec.fp, 0, SEEK_END);
+	if ((size = ftell(rec.fp)) == 0)
+	{
+		if (fwrite(rec.buf.data, 1, rec.buf.len, rec.fp) != rec.buf.len ||
+			fflush(rec.fp) != 0)
+		{
+			fprintf(stderr, "%s: %s: %s\n", myname, path, strerror(errno));
+			fclose(rec.fp);
+			rec.fp = NULL;
+			return -1;
+		}
+		size = rec.buf.len;
+	}
+	else
+	{
+		/* only append to a recording of the same kind of display */
+		head = malloc(rec.buf.len);
+		fseek(rec.fp, 0, SEEK_SET);
+		if (head == NULL ||
+			fread(head, 1, rec.buf.len, rec.fp) != rec.buf.len ||
+			memcmp(head, rec.buf.data, rec.buf.len) != 0)
+		{
+			fprintf(stderr, "%s: %s is not a recording pg_top can add to\n",
+					myname, path);
+			free(head);
+			fclose(rec.fp);
+			rec.fp = NULL;
+			return -1;
+		}
+		free(head);
+	}
+
+	rec.path = strdup(path);
+	rec.max_size = max_size;
+	rec.size = size;
+	rec.records = 0;
+	rec.statics = statics;
+	rec.nprocstates = name_count(statics->procstate_names);
+	rec.ncpustates = name_count(statics->cpustate_names);
+	rec.nmemory = name_count(statics->memory_names);
+	rec.nswap = name_count(statics->swap_names);
+	return 0;
+}
+
+int
+recording(void)
+{
+	return rec.fp != NULL;
+}
+
+/* Move the recording aside to "path".1 and start a new one. */
+static void
+record_rotate(void)
+{
+	char	   *old;
+
+	old = malloc(strlen(rec.path) + 3);
+	if (old == NULL || buf_put_file_header(&rec.buf, rec.statics) == -1)
+	{
+		free(old);
+		record_stop("out of memory");
+		return;
+	}
+	sprintf(old, "%s.1", rec.path);
+
+	fclose(rec.fp);
+	rec.fp = NULL;
+	if (rename(rec.path, old) == -1 ||
+		(rec.fp = fopen(rec.path, "w")) == NULL ||
+		fwrite(rec.buf.data, 1, rec.buf.len, rec.fp) != rec.buf.len ||
+		fflush(rec.fp) != 0)
+		record_stop(strerror(errno));
+	free(old);
+
+	rec.size = rec.buf.len;
+	rec.records = 0;
+}
+
+/*
+ * A name of a process, or nothing but a zero if it is the same as "prev".
+ * It is stored with its terminating nul so that replay can use it in place.
+ */
+static int
+buf_put_name(struct logbuf *buf, const char *name, const char *prev)
+{
+	size_t		len = strlen(name);
+
+	if (prev != NULL && strcmp(name, prev) == 0)
+		return buf_put_varint(buf, 0);
+	if (buf_put_varint(buf, (int64_t) len + 1) == -1)
+		return -1;
+	return buf_put(buf, name, len + 1);
+}
+
+/* Every line of "snap", each against the same one of the record before. */
+static int
+record_lines(struct logbuf *buf, struct snapshot *snap, int keyframe)
+{
+	unsigned char span[2];
+	char	   *line;
+	char	   *prev;
+	int			len;
+	int			prefix;
+	int			err = 0;
+	int			i;
+
+	err |= buf_put_int32(buf, snap->nlines);
+	for (i = 0; i < snap->nlines; i++)
+	{
+		line = snap->lines + (size_t) i * MAX_COLS;
+		len = strlen(line);
+		prefix = 0;
+		if (!keyframe && i < rec.nlines)
+		{
+			prev = rec.lines + (size_t) i * MAX_COLS;
+			while (prefix < len && prev[prefix] == line[prefix])
+				prefix++;
+		}
+		span[0] = prefix;
+		span[1] = len - prefix;
+		err |= buf_put(buf, span, sizeof(span));
+		err |= buf_put(buf, line + prefix, len - prefix);
+	}
+
+	/* keep the lines to compare the next record's with */
+	if (snap->nlines > rec.lines_size)
+	{
+		if ((line = realloc(rec.lines, (size_t) snap->nlines * MAX_COLS)) == NULL)
+			return -1;
+		rec.lines = line;
+		rec.lines_size = snap->nlines;
+	}
+	if (snap->nlines > 0)
+		memcpy(rec.lines, snap->lines, (size_t) snap->nlines * MAX_COLS);
+	rec.nlines = snap->nlines;
+	rec.nprev = 0;
+	return err;
+}
+
+/*
+ * Every process of "snap" in order of pid, each against the one with the
+ * same pid in the record before, if there is one.
+ */
+static int
+record_backends(struct logbuf *buf, struct snapshot *snap, int keyframe)
+{
+	struct backend_stats **order;
+	struct backend_stats *b;
+	struct backend_stats *prev;
+	int64_t		v[BV_COUNT];
+	int64_t		pv[BV_COUNT];
+	pid_t		last = 0;
+	char	   *strings;
+	int			n = snap->nbackends;
+	int			err = 0;
+	int			i;
+	int			j = 0;
+	int			k;
+
+	if (n > rec.order_size)
+	{
+		if ((order = realloc(rec.order, n * sizeof(*order))) == NULL)
+			return -1;
+		rec.order = order;
+		rec.order_size = n;
+	}
+	for (i = 0; i < n; i++)
+		rec.order[i] = &snap->backends[i];
+	qsort(rec.order, n, sizeof(*rec.order), backend_pid_cmp);
+
+	err |= buf_put_varint(buf, n);
+	for (i = 0; i < n; i++)
+	{
+		b = rec.order[i];
+		prev = NULL;
+		if (!keyframe)
+		{
+			while (j < rec.nprev && rec.prev[j].pid < b->pid)
+				j++;
+			if (j < rec.nprev && rec.prev[j].pid == b->pid)
+				prev = &rec.prev[j];
+		}
+
+		err |= buf_put_varint(buf, b->pid - last);
+		last = b->pid;
+		backend_values(b, v);
+		if (prev != NULL)
+			backend_values(prev, pv);
+		else
+			memset(pv, 0, sizeof(pv));
+		for (k = 0; k < BV_COUNT; k++)
+			err |= buf_put_varint(buf, v[k] - pv[k]);
+		err |= buf_put_name(buf, b->usename,
+							prev != NULL ? prev->usename : NULL);
+		err |= buf_put_name(buf, b->datname,
+							prev != NULL ? prev->datname : NULL);
+		err |= buf_put_name(buf, b->command,
+							prev != NULL ? prev->command : NULL);
+	}
+
+	/*
+	 * Keep them to compare the next record's with.  Their names are all in
+	 * the snapshot's strings, which the collector is going to reuse.
+	 */
+	if (n > rec.prev_size)
+	{
+		if ((b = realloc(rec.prev, n * sizeof(*b))) == NULL)
+			return -1;
+		rec.prev = b;
+		rec.prev_size = n;
+	}
+	if (snap->strings_size > rec.prev_strings_size)
+	{
+		if ((strings = realloc(rec.prev_strings, snap->strings_size)) == NULL)
+			return -1;
+		rec.prev_strings = strings;
+		rec.prev_strings_size = snap->strings_size;
+	}
+	if (n > 0)
+		memcpy(rec.prev_strings, snap->strings, snap->strings_size);
+	for (i = 0; i < n; i++)
+	{
+		rec.prev[i] = *rec.order[i];
+		rec.prev[i].usename = rec.prev_strings +
+			(rec.order[i]->usename - snap->strings);
+		rec.prev[i].datname = rec.prev_strings +
+			(rec.order[i]->datname - snap->strings);
+		rec.prev[i].command = rec.prev_strings +
+			(rec.order[i]->command - snap->strings);
+	}
+	rec.nprev = n;
+	rec.nlines = 0;
+	return err;
+}
+
+/* Append the refresh in "snap", shown under "header", to the recording. */
+void
+record_snapshot(struct snapshot *snap, char *header)
+{
+	struct logbuf *buf = &rec.buf;
+	struct system_info *si = &snap->system_info;
+	unsigned char fixed[4];
+	int			keyframe;
+	int			err = 0;
+	int			i;
+	uint16_t	hlen;
+	uint32_t	reclen;
+
+	if (rec.fp == NULL)
+		return;
+
+	keyframe = rec.records % KEYFRAME_INTERVAL == 0;
+	fixed[0] = keyframe ? REC_KEYFRAME : 0;
+	if (keyframe || strcmp(header, rec.header) != 0)
+		fixed[0] |= REC_HEADER;
+	if (snap->nbackends >= 0)
+		fixed[0] |= REC_BACKENDS;
+	fixed[1] = snap->mode;
+	fixed[2] = snap->mode_remote;
+	fixed[3] = 0;
+
+	/* the length goes in front once it is known */
+	buf->len = 0;
+	err |= buf_put(buf, "\0\0\0\0", 4);
+	err |= buf_put(buf, fixed, sizeof(fixed));
+	err |= buf_put_int64(buf, snap->usec);
+	err |= buf_put_int64(buf, rec.statics->boottime);
+	err |= buf_put_int32(buf, si->last_pid);
+	err |= buf_put_int32(buf, si->p_total);
+	err |= buf_put_int32(buf, si->P_ACTIVE);
+	err |= buf_put(buf, si->load_avg, sizeof(si->load_avg));
+	for (i = 0; i < rec.nprocstates; i++)
+		err |= buf_put_int32(buf, si->procstates[i]);
+	for (i = 0; i < rec.ncpustates; i++)
+		err |= buf_put_int64(buf, si->cpustates[i]);
+	for (i = 0; i < rec.nmemory; i++)
+		err |= buf_put_int64(buf, si->memory[i]);
+	for (i = 0; i < rec.nswap; i++)
+		err |= buf_put_int64(buf, si->swap[i]);
+
+	if (fixed[0] & REC_HEADER)
+	{
+		strncpy(rec.header, header, sizeof(rec.header) - 1);
+		hlen = strlen(rec.header);
+		err |= buf_put(buf, &hlen, sizeof(hlen));
+		err |= buf_put(buf, rec.header, hlen);
+	}
+
+	if (fixed[0] & REC_BACKENDS)
+		err |= record_backends(buf, snap, keyframe);
+	else
+		err |= record_lines(buf, snap, keyframe);
+	if (err)
+	{
+		record_stop("out of memory");
+		return;
+	}
+
+	reclen = buf->len - 4;
+	memcpy(buf->data, &reclen, 4);
+	if (fwrite(buf->data, 1, buf->len, rec.fp) != buf->len ||
+		fflush(rec.fp) != 0)
+	{
+		record_stop(strerror(errno));
+		return;
+	}
+	rec.size += buf->len;
+	rec.records++;
+
+	if (rec.max_size > 0 && rec.size >= rec.max_size)
+		record_rotate();
+}
+
+/*
+ * Reading a record: "pos" is moved past whatever is taken, and -1 is
+ * returned if the record is not long enough for it.
+ */
+static int
+get(const char *end, const char **pos, void *dst, size_t n)
+{
+	if ((size_t) (end - *pos) < n)
+		return -1;
+	memcpy(dst, *pos, n);
+	*pos += n;
+	return 0;
+}
+
+/* Point "names" at the list of state names in the file header. */
+static int
+get_names(const char *end, const char **pos, char ***names, int *count)
+{
+	const char *nul;
+	int32_t		n;
+	int			i;
+
+	if (get(end, pos, &n, sizeof(n)) == -1 || n < 0 || n > 1024)
+		return -1;
+	if ((*names = calloc(n + 1, sizeof(char *))) == NULL)
+		return -1;
+	for (i = 0; i < n; i++)
+	{
+		if ((nul = memchr(*pos, '\0', end - *pos)) == NULL)
+			return -1;
+		(*names)[i] = (char *) *pos;
+		*pos = nul + 1;
+	}
+	*count = n;
+	return 0;
+}
+
+static int
+get_varint(const char *end, const char **pos, int64_t *v)
+{
+	uint64_t	u = 0;
+	unsigned char c;
+	int			shift = 0;
+
+	do
+	{
+		if (*pos >= end || shift > 63)
+			return -1;
+		c = *(*pos)++;
+		u |= (uint64_t) (c & 0x7f) << shift;
+		shift += 7;
+	} while (c & 0x80);
+	*v = (int64_t) (u >> 1) ^ -(int64_t) (u & 1);
+	return 0;
+}
+
+/* Point "name" at a name of a process in the mapping, or at "prev". */
+static int
+get_name(const char *end, const char **pos, char *prev, char **name)
+{
+	int64_t		len;
+
+	if (get_varint(end, pos, &len) == -1)
+		return -1;
+	if (len == 0)
+	{
+		if (prev == NULL)
+			return -1;
+		*name = prev;
+		return 0;
+	}
+	if (len > end - *pos || (*pos)[len - 1] != '\0')
+		return -1;
+	*name = (char *) *pos;
+	*pos += len;
+	return 0;
+}
+
+/* Make room for "n" processes in each of the arrays replay keeps them in. */
+static int
+replay_reserve_rows(int n)
+{
+	struct backend_stats *rows;
+	struct backend_stats **shown;
+
+	if (n <= replay.rows_size)
+		return 0;
+	if ((rows = realloc(replay.rows, n * sizeof(*rows))) == NULL)
+		return -1;
+	replay.rows = rows;
+	if ((rows = realloc(replay.next_rows, n * sizeof(*rows))) == NULL)
+		return -1;
+	replay.next_rows = rows;
+	if ((shown = realloc(replay.shown, n * sizeof(*shown))) == NULL)
+		return -1;
+	replay.shown = shown;
+	replay.rows_size = n;
+	return 0;
+}
+
+/* Decode the processes of a record, which follows the current one. */
+static void
+replay_decode_backends(const char *end, const char *pos, int keyframe)
+{
+	struct backend_stats *prev_rows = replay.nrows > 0 ? replay.rows : NULL;
+	struct backend_stats *prev;
+	struct backend_stats *r;
+	int64_t		v[BV_COUNT];
+	int64_t		pv[BV_COUNT];
+	int64_t		n;
+	int64_t		d;
+	pid_t		last = 0;
+	int			nprev = replay.nrows > 0 ? replay.nrows : 0;
+	int			i;
+	int			j = 0;
+	int			k;
+
+	if (get_varint(end, &pos, &n) == -1 || n < 0 || n > end - pos ||
+		replay_reserve_rows(n) == -1)
+		n = 0;
+	if (keyframe)
+		nprev = 0;
+
+	for (i = 0; i < n; i++)
+	{
+		r = &replay.next_rows[i];
+		if (get_varint(end, &pos, &d) == -1)
+			break;
+		r->pid = last + d;
+		last = r->pid;
+
+		prev = NULL;
+		while (j < nprev && prev_rows[j].pid < r->pid)
+			j++;
+		if (j < nprev && prev_rows[j].pid == r->pid)
+			prev = &prev_rows[j];
+		if (prev != NULL)
+			backend_values(prev, pv);
+		else
+			memset(pv, 0, sizeof(pv));
+
+		for (k = 0; k < BV_COUNT; k++)
+		{
+			if (get_varint(end, &pos, &d) == -1)
+				break;
+			v[k] = pv[k] + d;
+		}
+		if (k < BV_COUNT ||
+			get_name(end, &pos, prev != NULL ? prev->usename : NULL,
+					 &r->usename) == -1 ||
+			get_name(end, &pos, prev != NULL ? prev->datname : NULL,
+					 &r->datname) == -1 ||
+			get_name(end, &pos, prev != NULL ? prev->command : NULL,
+					 &r->command) == -1)
+			break;
+		backend_set_values(r, v);
+		if (r->pgstate < STATE_UNDEFINED || r->pgstate > STATE_DISABLED)
+			r->pgstate = STATE_UNDEFINED;
+	}
+
+	r = replay.rows;
+	replay.rows = replay.next_rows;
+	replay.next_rows = r;
+	replay.nrows = i;
+	replay.nlines = 0;
+}
+
+/* Decode the lines of a record, which follows the current one. */
+static void
+replay_decode_lines(const char *end, const char *pos)
+{
+	unsigned char span[2];
+	char	   *line;
+	int32_t		n;
+	int			prev_nlines = replay.nlines;
+	int			i;
+
+	replay.nrows = -1;
+	replay.nlines = 0;
+	if (get(end, &pos, &n, 4) == -1 || n < 0)
+		return;
+	if (n > replay.lines_size)
+	{
+		if ((line = realloc(replay.lines, (size_t) n * MAX_COLS)) == NULL)
+			return;
+		replay.lines = line;
+		replay.lines_size = n;
+	}
+
+	/* each line starts with what it shares with the same one before */
+	for (i = 0; i < n; i++)
+	{
+		line = replay.lines + (size_t) i * MAX_COLS;
+		if (get(end, &pos, span, sizeof(span)) == -1 ||
+			span[0] + span[1] >= MAX_COLS ||
+			(i >= prev_nlines && span[0] > 0) ||
+			get(end, &pos, line + span[0], span[1]) == -1)
+			break;
+		line[span[0] + span[1]] = '\0';
+	}
+	replay.nlines = i;
+}
+
+/* Decode record "idx", which follows the current one, into replay.snap. */
+static void
+replay_decode(int idx)
+{
+	struct snapshot *snap = &replay.snap;
+	struct system_info *si = &snap->system_info;
+	const char *pos = replay.map + replay.offsets[idx] + 4;
+	const char *end;
+	unsigned char fixed[4];
+	char		header[MAX_COLS];
+	int64_t		v64;
+	int32_t		v32;
+	uint16_t	hlen;
+	int			i;
+
+	memcpy(&v32, replay.map + replay.offsets[idx], 4);
+	end = pos + v32;
+
+	/* the index was only built from records this long */
+	(void) get(end, &pos, fixed, sizeof(fixed));
+	(void) get(end, &pos, &snap->usec, 8);
+	(void) get(end, &pos, &v64, 8);
+	replay.boottime = v64;
+	(void) get(end, &pos, &si->last_pid, 4);
+	(void) get(end, &pos, &si->p_total, 4);
+	(void) get(end, &pos, &si->P_ACTIVE, 4);
+	(void) get(end, &pos, si->load_avg, sizeof(si->load_avg));
+	replay.mode = fixed[1];
+	replay.mode_remote = fixed[2];
+
+	for (i = 0; i < replay.nprocstates; i++)
+		if (get(end, &pos, &v32, 4) == 0)
+			snap->procstates[i] = v32;
+	for (i = 0; i < replay.ncpustates; i++)
+		(void) get(end, &pos, &snap->cpustates[i], 8);
+	for (i = 0; i < replay.nmemory; i++)
+		if (get(end, &pos, &v64, 8) == 0)
+			snap->memory[i] = v64;
+	for (i = 0; i < replay.nswap; i++)
+		if (get(end, &pos, &v64, 8) == 0)
+			snap->swap[i] = v64;
+
+	if (fixed[0] & REC_HEADER)
+	{
+		if (get(end, &pos, &hlen, sizeof(hlen)) == -1 ||
+			hlen >= sizeof(header) ||
+			get(end, &pos, header, hlen) == -1)
+			end = pos;
+		else
+		{
+			header[hlen] = '\0';
+			if (strcmp(header, replay.header) != 0)
+			{
+				strcpy(replay.header, header);
+				replay.header_changed = 1;
+			}
+		}
+	}
+
+	if (fixed[0] & REC_BACKENDS)
+		replay_decode_backends(end, pos, fixed[0] & REC_KEYFRAME);
+	else
+		replay_decode_lines(end, pos);
+}
+
+/* Make record "idx" the current one. */
+static void
+replay_goto(int idx)
+{
+	int			i;
+
+	if (idx < 0)
+		idx = 0;
+	if (idx >= replay.count)
+		idx = replay.count - 1;
+	if (idx == replay.current)
+		return;
+
+	/* start from the key frame before it unless it comes right after */
+	i = idx;
+	if (idx != replay.current + 1)
+		while (i > 0 && !(replay.map[replay.offsets[i] + 4] & REC_KEYFRAME))
+			i--;
+	for (; i <= idx; i++)
+		replay_decode(i);
+	replay.current = idx;
+}
+
+/*
+ * Map the recording in "path" and fill in "statics" from it, ready to show
+ * its first refresh.  Returns -1 if it cannot be replayed.
+ */
+int
+replay_open(const char *path, struct statics *statics)
+{
+	struct stat st;
+	const char *pos;
+	const char *end;
+	char		magic[8];
+	int32_t		version;
+	uint32_t	len;
+	size_t		off;
+	int			size = 0;
+	int			fd;
+
+	if ((fd = open(path, O_RDONLY)) == -1 || fstat(fd, &st) == -1)
+	{
+		fprintf(stderr, "%s: %s: %s\n", myname, path, strerror(errno));
+		return -1;
+	}
+	replay.map_size = st.st_size;
+	replay.map = replay.map_size > 0 ?
+		mmap(NULL, replay.map_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+	close(fd);
+	if (replay.map == MAP_FAILED)
+	{
+		fprintf(stderr, "%s: %s: %s\n", myname, path,
+				replay.map_size > 0 ? strerror(errno) : "empty file");
+		return -1;
+	}
+
+	pos = replay.map;
+	end = replay.map + replay.map_size;
+	if (get(end, &pos, magic, 8) == -1 || memcmp(magic, LOG_MAGIC, 8) != 0 ||
+		get(end, &pos, &version, 4) == -1 || version != LOG_VERSION ||
+		get_names(end, &pos, &statics->procstate_names,
+				  &replay.nprocstates) == -1 ||
+		get_names(end, &pos, &statics->cpustate_names,
+				  &replay.ncpustates) == -1 ||
+		get_names(end, &pos, &statics->memory_names, &replay.nmemory) == -1 ||
+		get_names(end, &pos, &statics->swap_names, &replay.nswap) == -1)
+	{
+		fprintf(stderr, "%s: %s is not a pg_top recording\n", myname, path);
+		return -1;
+	}
+
+	/* find where each record starts, up to the first incomplete one */
+	for (off = pos - replay.map; off + 4 <= replay.map_size; off += 4 + len)
+	{
+		memcpy(&len, replay.map + off, 4);
+		if (len < REC_FIXED || len > replay.map_size - off - 4)
+			break;
+		if (replay.count == size)
+		{
+			size = size > 0 ? size * 2 : 1024;
+			replay.offsets = realloc(replay.offsets, size * sizeof(size_t));
+			replay.usecs = realloc(replay.usecs, size * sizeof(int64_t));
+			if (replay.offsets == NULL || replay.usecs == NULL)
+			{
+				fprintf(stderr, "%s: can't allocate sufficient memory\n",
+						myname);
+				return -1;
+			}
+		}
+		replay.offsets[replay.count] = off;
+		memcpy(&replay.usecs[replay.count], replay.map + off + 8, 8);
+		replay.count++;
+	}
+	if (replay.count == 0)
+	{
+		fprintf(stderr, "%s: %s has no refreshes recorded\n", myname, path);
+		return -1;
+	}
+
+	replay.snap.procstates = calloc(replay.nprocstates + 1, sizeof(int));
+	replay.snap.cpustates = calloc(replay.ncpustates + 1, sizeof(int64_t));
+	replay.snap.memory = calloc(replay.nmemory + 1, sizeof(long));
+	replay.snap.swap = calloc(replay.nswap + 1, sizeof(long));
+	if (replay.snap.procstates == NULL || replay.snap.cpustates == NULL ||
+		replay.snap.memory == NULL || replay.snap.swap == NULL)
+	{
+		fprintf(stderr, "%s: can't allocate sufficient memory\n", myname);
+		return -1;
+	}
+	replay.snap.system_info.procstates = replay.snap.procstates;
+	replay.snap.system_info.cpustates = replay.snap.cpustates;
+	replay.snap.system_info.memory = replay.snap.memory;
+	replay.snap.system_info.swap = replay.snap.swap;
+
+	/* the state names point into the mapping, which stays until exit */
+	statics->order_names = replay_order_names;
+	statics->process_orders = 0;
+	statics->flags.fullcmds = 0;
+	statics->flags.warmup = 0;
+
+	replay.speed = 1.0;
+	replay.current = -1;
+	replay.shown_mode = -1;
+	replay.nrows = -1;
+	replay.snap.nbackends = -1;
+	replay.active = 1;
+	replay_goto(0);
+	statics->boottime = replay.boottime;
+	return 0;
+}
+
+int
+replaying(void)
+{
+	return replay.active;
+}
+
+/* Which of the numbers the processes are being sorted on, see below. */
+static int	sort_value;
+
+/* The most first, ties by cpu and then pid, or by command name. */
+static int
+replay_compare(const void *v1, const void *v2)
+{
+	const struct backend_stats *b1 = *(struct backend_stats *const *) v1;
+	const struct backend_stats *b2 = *(struct backend_stats *const *) v2;
+	int64_t		x1[BV_COUNT];
+	int64_t		x2[BV_COUNT];
+	int			result;
+
+	if (sort_value < 0 && (result = strcmp(b1->command, b2->command)) != 0)
+		return result;
+	backend_values(b1, x1);
+	backend_values(b2, x2);
+	if (sort_value >= 0 && x1[sort_value] != x2[sort_value])
+		return x1[sort_value] < x2[sort_value] ? 1 : -1;
+	if (x1[BV_PCPU] != x2[BV_PCPU])
+		return x1[BV_PCPU] < x2[BV_PCPU] ? 1 : -1;
+	return b1->pid < b2->pid ? -1 : b1->pid > b2->pid;
+}
+
+/* Format "b" the way the machine modules do for "mode". */
+static void
+replay_format(char *line, struct backend_stats *b, int mode)
+{
+	struct backend_io *io;
+
+	if (mode == MODE_IO_STATS)
+	{
+		io = mode_stats == STATS_DIFF ? &b->io_diff : &b->io;
+		snprintf(line, MAX_COLS,
+				 "%5d %5s %5s %7lld %7lld %5s %6s %7s %s",
+				 (int) b->pid,
+				 format_b(io->rchar),
+				 format_b(io->wchar),
+				 io->syscr,
+				 io->syscw,
+				 format_b(io->read_bytes),
+				 format_b(io->write_bytes),
+				 format_b(io->cancelled_write_bytes),
+				 b->command);
+	}
+	else
+		snprintf(line, MAX_COLS,
+				 "%5d %-8.8s %5s %5s %-6s %5s %5s %5.1f %5d %s",
+				 (int) b->pid,
+				 b->usename,
+				 format_k(b->size),
+				 format_k(b->rss),
+				 backendstatenames[b->pgstate],
+				 format_time(b->xtime),
+				 format_time(b->qtime),
+				 b->pcpu * 100.0,
+				 b->locks,
+				 b->command);
+}
+
+/*
+ * Pick out the recorded processes that are to be shown, put them in the
+ * order asked for and format the ones that fit on the screen.
+ */
+static void
+replay_render(struct pg_top_context *pgtctx)
+{
+	struct snapshot *snap = &replay.snap;
+	struct backend_stats *r;
+	char	   *lines;
+	int			n = 0;
+	int			k;
+	int			i;
+
+	for (i = 0; i < replay.nrows; i++)
+	{
+		r = &replay.rows[i];
+		if (!pgtctx->ps.idle && r->pgstate == STATE_IDLE)
+			continue;
+		if (pgtctx->ps.usename[0] != '\0' &&
+			strcmp(r->usename, pgtctx->ps.usename) != 0)
+			continue;
+		replay.shown[n++] = r;
+	}
+
+	k = n < max_topn ? n : max_topn;
+	if (k < 0)
+		k = 0;
+	if (k > replay.formatted_size)
+	{
+		if ((lines = realloc(replay.formatted, (size_t) k * MAX_COLS)) == NULL)
+			k = replay.formatted_size;
+		else
+		{
+			replay.formatted = lines;
+			replay.formatted_size = k;
+		}
+	}
+
+	if (pgtctx->order_index >= 0)
+	{
+		sort_value = replay_order_values[pgtctx->order_index];
+		if (sort_value >= BV_IO && mode_stats == STATS_DIFF)
+			sort_value += BV_NIO;
+		partial_sort(replay.shown, n, sizeof(*replay.shown), k,
+					 replay_compare);
+	}
+	for (i = 0; i < k; i++)
+		replay_format(replay.formatted + (size_t) i * MAX_COLS,
+					  replay.shown[i], pgtctx->mode);
+
+	snap->system_info.P_ACTIVE = n;
+	snap->lines = replay.formatted;
+	snap->nlines = k;
+}
+
+/* The refresh to show now. */
+struct snapshot *
+replay_snapshot(struct pg_top_context *pgtctx)
+{
+	struct timespec now;
+	double		gap = 0;
+	char	   *header;
+
+	/*
+	 * The processes can be shown in either of their displays, until the
+	 * recording moves on to another one.
+	 */
+	if (replay.nrows < 0 || replay.mode != replay.shown_mode ||
+		(pgtctx->mode != MODE_PROCESSES && pgtctx->mode != MODE_IO_STATS))
+		pgtctx->mode = replay.mode;
+	replay.shown_mode = replay.mode;
+	pgtctx->mode_remote = replay.mode_remote;
+	replay.snap.mode = pgtctx->mode;
+	replay.snap.mode_remote = pgtctx->mode_remote;
+
+	if (replay.nrows >= 0)
+	{
+		header = pgtctx->header_options[pgtctx->mode_remote][pgtctx->mode];
+		replay_render(pgtctx);
+	}
+	else
+	{
+		header = replay.header;
+		replay.snap.lines = replay.lines;
+		replay.snap.nlines = replay.nlines;
+	}
+	if (header != pgtctx->header_text || replay.header_changed)
+	{
+		pgtctx->header_text = header;
+		pgtctx->d_header = i_header;
+		replay.header_changed = 0;
+	}
+	pgtctx->statics.boottime = replay.boottime;
+
+	/* work out when the next one is due */
+	if (replay.current + 1 < replay.count)
+	{
+		gap = (replay.usecs[replay.current + 1] -
+			   replay.usecs[replay.current]) / 1e6;
+		if (gap > MAX_GAP)
+			gap = MAX_GAP;
+		if (gap < 0)
+			gap = 0;
+		gap /= replay.speed;
+	}
+	else
+		new_message(MT_standout | MT_delayed, " End of recording");
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	replay.due.tv_sec = now.tv_sec + (time_t) gap;
+	replay.due.tv_nsec = now.tv_nsec + (long) ((gap - (time_t) gap) * 1e9);
+	if (replay.due.tv_nsec >= 1000000000L)
+	{
+		replay.due.tv_sec++;
+		replay.due.tv_nsec -= 1000000000L;
+	}
+
+	return &replay.snap;
+}
+
+/*
+ * How long to wait for the next refresh, in milliseconds, or -1 to wait
+ * for a command.  Without a terminal to control it, replay runs through
+ * the recording as fast as it can be shown.
+ */
+int
+replay_timeout(int interactive)
+{
+	struct timespec now;
+	long long	ms;
+
+	if (!interactive)
+		return 0;
+	if (replay.paused || replay.current + 1 >= replay.count)
+		return -1;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	ms = (replay.due.tv_sec - now.tv_sec) * 1000LL +
+		(replay.due.tv_nsec - now.tv_nsec) / 1000000;
+	return ms > 0 ? (int) ms : 0;
+}
+
+/* Move on to the next refresh.  Returns 0 at the end of the recording. */
+int
+replay_advance(void)
+{
+	if (replay.current + 1 >= replay.count)
+		return 0;
+	replay_goto(replay.current + 1);
+	return 1;
+}
+
+/* Returns Yes if replay is now paused. */
+int
+replay_pause(void)
+{
+	replay.paused = !replay.paused;
+	return replay.paused;
+}
+
+/* Change the speed by "factor", returning the new speed. */
+double
+replay_speed(double factor)
+{
+	replay.speed *= factor;
+	if (replay.speed < 1.0 / 64)
+		replay.speed = 1.0 / 64;
+	if (replay.speed > 64)
+		replay.speed = 64;
+	return replay.speed;
+}
+
+/* Jump "seconds" forwards, or backwards when negative. */
+void
+replay_seek(double seconds)
+{
+	int64_t		target;
+	int			lo = 0;
+	int			hi = replay.count - 1;
+	int			mid;
+
+	target = replay.usecs[replay.current] + (int64_t) (seconds * 1e6);
+
+	/* the first refresh taken at or after the target */
+	while (lo < hi)
+	{
+		mid = (lo + hi) / 2;
+		if (replay.usecs[mid] < target)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	replay_goto(lo);
+}
+
+/* Move "n" refreshes forwards, or backwards when negative. */
+void
+replay_step(int n)
+{
+	replay_goto(replay.current + n);
+}
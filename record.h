@@ -0,0 +1,27 @@
+/*
+ * Interface for recording refreshes to a file and replaying them.
+ *
+ *	Copyright (c) 2007-2019, Mark Wong
+ */
+
+#ifndef _RECORD_H_
+#define _RECORD_H_
+
+#include "pg_top.h"
+#include "sampler.h"
+
+int			record_open(const char *, long long, struct statics *);
+int			recording(void);
+void		record_snapshot(struct snapshot *, char *);
+
+int			replay_open(const char *, struct statics *);
+int			replaying(void);
+struct snapshot *replay_snapshot(struct pg_top_context *);
+int			replay_timeout(int);
+int			replay_advance(void);
+int			replay_pause(void);
+double		replay_speed(double);
+void		replay_seek(double);
+void		replay_step(int);
+
+#endif							/* _RECORD_H_ */
@@ -0,0 +1,637 @@
+/*
+ *	Top users/processes display for Unix
+ *
+ *	Copyright (c) 2007-2019, Mark Wong
+ */
+
+/*
+ *	This file contains the table, index and statement statistics displays.
+ *	The server only keeps running totals, so how much they went up by over
+ *	a refresh is worked out here: the totals read the time before are kept
+ *	in a hash table keyed by the oid of the relation or the queryid of the
+ *	statement, so a refresh takes time linear in the number of them even
+ *	when there are a hundred thousand.  Only the ones that fit on the
+ *	screen are put in order, and the text of a statement is only asked for
+ *	once it is among those.
+ */
+
+#include "os.h"
+#include <ctype.h>
+#include <time.h>
+
+#include "display.h"
+#include "output.h"
+#include "relstats.h"
+#include "utils.h"
+
+#define REL_FIELDS	9			/* most counters a display has */
+
+/* Where each counter of a statement is kept. */
+#define STATEMENT_CALLS	0
+#define STATEMENT_TIME	1		/* microseconds */
+#define STATEMENT_ROWS	2
+#define STATEMENT_HITS	3
+#define STATEMENT_READS	4
+#define STATEMENT_TEMP	5
+#define STATEMENT_MEAN	6		/* worked out from the time and calls */
+
+/* A counter and the sort order that goes with it. */
+struct relfield
+{
+	char	   *order;			/* as in the machine module's order_names */
+	char	   *name;			/* as the server calls it */
+};
+
+static struct relfield table_fields[] =
+{
+	{"seqscan", "seq_scan"},
+	{"idxscan", "idx_scan"},
+	{"ins", "n_tup_ins"},
+	{"upd", "n_tup_upd"},
+	{"del", "n_tup_del"},
+	{"hits", "heap_blks_hit"},
+	{"reads", "heap_blks_read"},
+	{"idxhits", "idx_blks_hit"},
+	{"idxread", "idx_blks_read"},
+	{NULL, NULL}
+};
+
+static struct relfield index_fields[] =
+{
+	{"idxscan", "idx_scan"},
+	{"idxtup", "idx_tup_read"},
+	{"fetch", "idx_tup_fetch"},
+	{"hits", "idx_blks_hit"},
+	{"reads", "idx_blks_read"},
+	{NULL, NULL}
+};
+
+static struct relfield statement_fields[] =
+{
+	{"calls", "calls"},
+	{"time", "total_exec_time_us"},
+	{"rows", "rows"},
+	{"hits", "shared_blks_hit"},
+	{"reads", "shared_blks_read"},
+	{"temp", "temp_blks"},
+	{"mean", "mean_exec_time_us"},
+	{NULL, NULL}
+};
+
+char		fmt_header_tables[] =
+"SEQSCAN IDXSCAN     INS     UPD     DEL    HITS   READS IDXHITS IDXREAD RELATION";
+
+char		fmt_header_indexes[] =
+"IDXSCAN  IDXTUP   FETCH    HITS   READS INDEX";
+
+char		fmt_header_statements[] =
+"CALLS/S    TIME    MEAN  ROWS/S    HITS   READS    TEMP QUERY";
+
+struct relstat
+{
+	long long	id;				/* the oid or the queryid */
+	unsigned int generation;	/* refresh in which it was last seen */
+	char	   *name;
+	int			asked;			/* whether the server was asked for the name */
+	long long	value[REL_FIELDS];	/* the totals as last read */
+	long long	diff[REL_FIELDS];	/* how much they went up by */
+};
+
+/* The relations or statements of one of the displays. */
+struct relset
+{
+	struct relfield *fields;
+	char	   *id_name;		/* what the id and name are written out as */
+	char	   *name_name;
+	int			lazy;			/* names are only read for those shown */
+	char	   *order;			/* what to sort on when the order is not ours */
+
+	int			nfields;
+	int			primed;			/* whether they were read the refresh before */
+	unsigned int generation;
+	long long	usec;			/* when they were read */
+	double		interval;		/* seconds since the time before */
+
+	struct relstat *rels;
+	int			nrels;
+	int			size;
+
+	int		   *hash;			/* 1 + index into rels, 0 if free */
+	unsigned int hash_size;		/* always a power of two */
+
+	int		   *table;			/* the ones seen last refresh, in order */
+	int			table_size;
+	int			index;			/* the next one to format */
+};
+
+static struct relset tables = {table_fields, "relid", "name", 0, "reads"};
+static struct relset indexes = {index_fields, "relid", "name", 0, "reads"};
+static struct relset statements =
+{statement_fields, "queryid", "query", 1, "time"};
+
+/* The ones last read, and which counter they are sorted on. */
+static struct relset *current = &tables;
+static int	sort_field;			/* -1 to sort by name */
+
+/* The ones read the refresh before, NULL if that refresh read none. */
+static struct relset *last_read = NULL;
+
+/* These have no states, but the display wants a count of each. */
+static int	relstates[NPROCSTATES];
+
+static unsigned int
+rel_hash(long long id)
+{
+	return (unsigned int) id * 2654435761u;
+}
+
+static void
+rel_rehash(struct relset *set, unsigned int size)
+{
+	unsigned int mask = size - 1;
+	unsigned int h;
+	int			i;
+
+	free(set->hash);
+	set->hash = calloc(size, sizeof(int));
+	if (set->hash == NULL)
+	{
+		fprintf(stderr, "calloc error\n");
+		exit(1);
+	}
+	set->hash_size = size;
+
+	for (i = 0; i < set->nrels; i++)
+	{
+		h = rel_hash(set->rels[i].id) & mask;
+		while (set->hash[h] != 0)
+			h = (h + 1) & mask;
+		set->hash[h] = i + 1;
+	}
+}
+
+/*
+ * Return the index of the entry for "id", or -1 if there is none, in which
+ * case "slot" is where in the hash table it would go.
+ */
+static int
+rel_lookup(struct relset *set, long long id, unsigned int *slot)
+{
+	unsigned int mask = set->hash_size - 1;
+	unsigned int h;
+	int			i;
+
+	if (set->hash_size == 0)
+		return -1;
+
+	h = rel_hash(id) & mask;
+	while ((i = set->hash[h]) != 0)
+	{
+		if (set->rels[i - 1].id == id)
+			return i - 1;
+		h = (h + 1) & mask;
+	}
+	*slot = h;
+	return -1;
+}
+
+/*
+ * Return the index of the entry for "id", making one if there is none, in
+ * which case "added" is set.
+ */
+static int
+rel_find(struct relset *set, long long id, int *added)
+{
+	struct relstat *rels;
+	unsigned int slot;
+	int			i;
+
+	if ((unsigned int) (set->nrels + 1) * 2 > set->hash_size)
+		rel_rehash(set, set->hash_size > 0 ? set->hash_size * 2 : 1024);
+
+	if ((i = rel_lookup(set, id, &slot)) >= 0)
+	{
+		*added = 0;
+		return i;
+	}
+
+	if (set->nrels == set->size)
+	{
+		rels = realloc(set->rels, (set->size > 0 ? set->size * 2 : 256) *
+					   sizeof(struct relstat));
+		if (rels == NULL)
+		{
+			fprintf(stderr, "realloc error\n");
+			exit(1);
+		}
+		set->rels = rels;
+		set->size = set->size > 0 ? set->size * 2 : 256;
+	}
+	i = set->nrels++;
+	memset(&set->rels[i], 0, sizeof(struct relstat));
+	set->rels[i].id = id;
+	set->hash[slot] = i + 1;
+	*added = 1;
+	return i;
+}
+
+/*
+ * Forget the ones that were not seen this refresh, once there are
+ * enough of them to be worth it.  All the rest are in the table afterwards.
+ */
+static void
+rel_evict(struct relset *set, int seen)
+{
+	int			i;
+	int			j = 0;
+
+	if (set->nrels - seen <= 64 + seen / 4)
+		return;
+
+	for (i = 0; i < set->nrels; i++)
+	{
+		if (set->rels[i].generation == set->generation)
+			set->rels[j++] = set->rels[i];
+		else
+			free(set->rels[i].name);
+	}
+	set->nrels = j;
+	rel_rehash(set, set->hash_size);
+
+	/* the order they were read in does not matter, they get sorted */
+	for (i = 0; i < j; i++)
+		set->table[i] = i;
+}
+
+/*
+ * Which counter "order" sorts on, or -1 for the name.  Names that are not
+ * all there cannot be sorted on.
+ */
+static int
+rel_field(struct relset *set, char *order)
+{
+	int			fallback = 0;
+	int			i;
+
+	if (order != NULL && strcmp(order, "command") == 0 && !set->lazy)
+		return -1;
+	for (i = 0; i < set->nfields; i++)
+	{
+		if (order != NULL && strcmp(set->fields[i].order, order) == 0)
+			return i;
+		if (strcmp(set->fields[i].order, set->order) == 0)
+			fallback = i;
+	}
+	return fallback;
+}
+
+/*
+ * Whether the order at "index" in the machine module's order names sorts
+ * the display for "mode".  The processes go by the first of them, the
+ * others by the counters here and by name where there is a whole one.
+ */
+int
+order_applies(struct statics *statics, int mode, int index)
+{
+	struct relset *set;
+	int			i;
+
+	if (index < 0 || statics->order_names == NULL)
+		return 1;
+	if (mode == MODE_TABLE_STATS)
+		set = &tables;
+	else if (mode == MODE_INDEX_STATS)
+		set = &indexes;
+	else if (mode == MODE_STATEMENTS)
+		set = &statements;
+	else
+		return statics->process_orders == 0 ||
+			index < statics->process_orders;
+
+	if (strcmp(statics->order_names[index], "command") == 0)
+		return !set->lazy;
+	for (i = 0; set->fields[i].order != NULL; i++)
+		if (strcmp(set->fields[i].order, statics->order_names[index]) == 0)
+			return 1;
+	return 0;
+}
+
+/* The counters as they are shown. */
+#define REL_VALUES(r) (mode_stats == STATS_DIFF ? (r)->diff : (r)->value)
+
+/*
+ * By the counter being sorted on, then its total, then by name, or by id
+ * when there may not be one.
+ */
+static int
+rel_compare(const void *v1, const void *v2)
+{
+	struct relstat *r1 = &current->rels[*(const int *) v1];
+	struct relstat *r2 = &current->rels[*(const int *) v2];
+
+	if (sort_field >= 0)
+	{
+		if (REL_VALUES(r1)[sort_field] != REL_VALUES(r2)[sort_field])
+			return REL_VALUES(r1)[sort_field] < REL_VALUES(r2)[sort_field] ?
+				1 : -1;
+		if (r1->value[sort_field] != r2->value[sort_field])
+			return r1->value[sort_field] < r2->value[sort_field] ? 1 : -1;
+	}
+	if (current->lazy)
+		return r1->id < r2->id ? -1 : r1->id > r2->id;
+	return strcmp(r1->name, r2->name);
+}
+
+/* Keep a statement on one line by making each run of white space a space. */
+static void
+rel_set_text(struct relstat *r, const char *text)
+{
+	char	   *s;
+	char	   *t;
+
+	if ((s = malloc(strlen(text) + 1)) == NULL)
+	{
+		fprintf(stderr, "malloc error\n");
+		exit(1);
+	}
+	for (t = s; *text != '\0'; text++)
+	{
+		if (!isspace((unsigned char) *text))
+			*t++ = *text;
+		else if (t > s && t[-1] != ' ')
+			*t++ = ' ';
+	}
+	*t = '\0';
+	free(r->name);
+	r->name = s;
+}
+
+/*
+ * Read the text of the statements about to be shown, at most "n" of them,
+ * that have not been asked for before.  Once known it stays the same.  The
+ * server reads the whole file of texts to answer, however few are asked
+ * for, so one that it did not send back is not asked for again but shown
+ * without a text.
+ */
+static void
+rel_get_texts(struct relset *set, PGconn *pgconn, int n)
+{
+	PGresult   *pgresult;
+	unsigned int slot;
+	char	   *queryids;
+	size_t		len = 0;
+	int			i;
+	int			j;
+
+	if ((queryids = malloc((size_t) n * 22 + 3)) == NULL)
+	{
+		fprintf(stderr, "malloc error\n");
+		exit(1);
+	}
+	queryids[len++] = '{';
+	for (i = 0; i < n; i++)
+	{
+		if (set->rels[set->table[i]].asked)
+			continue;
+		if (len > 1)
+			queryids[len++] = ',';
+		len += sprintf(queryids + len, "%lld", set->rels[set->table[i]].id);
+	}
+	queryids[len++] = '}';
+	queryids[len] = '\0';
+
+	if (len > 2)
+	{
+		pgresult = pg_statement_texts(pgconn, queryids);
+		if (pgresult != NULL && PQresultStatus(pgresult) == PGRES_TUPLES_OK)
+		{
+			for (i = 0; i < PQntuples(pgresult); i++)
+			{
+				j = rel_lookup(set, pg_getint(pgresult, i, 0), &slot);
+				if (j >= 0 && set->rels[j].name == NULL)
+					rel_set_text(&set->rels[j], PQgetvalue(pgresult, i, 1));
+			}
+			for (i = 0; i < n; i++)
+				set->rels[set->table[i]].asked = 1;
+		}
+		if (pgresult != NULL)
+			PQclear(pgresult);
+	}
+	free(queryids);
+}
+
+static void
+rel_key(const void *v, uint64_t *hi, uint64_t *lo)
+{
+	struct relstat *r = &current->rels[*(const int *) v];
+
+	*hi = ~sort_key_int(REL_VALUES(r)[sort_field]);
+	*lo = ~sort_key_int(r->value[sort_field]);
+}
+
+caddr_t
+get_relation_info(struct system_info *si, struct process_select *sel,
+				  int compare_index, char **order_names,
+				  struct pg_conninfo_ctx *conninfo, int mode)
+{
+	struct relset *set;
+	PGresult   *pgresult = NULL;
+	struct relstat *r;
+	struct timespec now;
+	long long	value;
+	int		   *table;
+	int			first;
+	int			ok;
+	int			rows = 0;
+	int			added;
+	int			i;
+	int			j;
+
+	if (mode == MODE_TABLE_STATS)
+		set = &tables;
+	else if (mode == MODE_INDEX_STATS)
+		set = &indexes;
+	else
+		set = &statements;
+
+	while (set->fields[set->nfields].order != NULL)
+		set->nfields++;
+
+	/*
+	 * The totals kept from before another display was shown cover all the
+	 * time it was up, so coming back is like the first time.
+	 */
+	if (last_read != set)
+		set->primed = 0;
+	last_read = set;
+
+	connect_to_db(conninfo);
+	if (conninfo->connection != NULL)
+	{
+		if (mode == MODE_TABLE_STATS)
+			pgresult = pg_tables(conninfo->connection);
+		else if (mode == MODE_INDEX_STATS)
+			pgresult = pg_indexes(conninfo->connection);
+		else
+			pgresult = pg_statements(conninfo->connection);
+	}
+	ok = pgresult != NULL && PQresultStatus(pgresult) == PGRES_TUPLES_OK;
+	if (ok)
+		rows = PQntuples(pgresult);
+	else if (conninfo->connection != NULL && mode == MODE_STATEMENTS)
+		new_message(MT_standout | MT_delayed,
+					" pg_stat_statements is not available");
+
+	if (rows > set->table_size)
+	{
+		table = realloc(set->table, rows * sizeof(int));
+		if (table == NULL)
+		{
+			fprintf(stderr, "realloc error\n");
+			exit(1);
+		}
+		set->table = table;
+		set->table_size = rows;
+	}
+
+	/* the name, if it is read every time, comes right before the counters */
+	first = set->lazy ? 1 : 2;
+	++set->generation;
+	for (i = 0; i < rows; i++)
+	{
+		set->table[i] = rel_find(set, pg_getint(pgresult, i, 0), &added);
+		r = &set->rels[set->table[i]];
+		for (j = 0; j < set->nfields; j++)
+		{
+			if (set == &statements && j == STATEMENT_MEAN)
+				continue;
+			value = pg_getint(pgresult, i, first + j);
+
+			/*
+			 * One that is new since the last refresh did everything it did
+			 * in between, but the first time round there is nothing to go
+			 * by.  A total going down means the statistics were reset.
+			 */
+			if (!set->primed)
+				r->diff[j] = 0;
+			else if (added)
+				r->diff[j] = value;
+			else if (value >= r->value[j])
+				r->diff[j] = value - r->value[j];
+			else
+				r->diff[j] = value;
+			r->value[j] = value;
+		}
+		if (set == &statements)
+		{
+			r->value[STATEMENT_MEAN] = r->value[STATEMENT_CALLS] > 0 ?
+				r->value[STATEMENT_TIME] / r->value[STATEMENT_CALLS] : 0;
+			r->diff[STATEMENT_MEAN] = r->diff[STATEMENT_CALLS] > 0 ?
+				r->diff[STATEMENT_TIME] / r->diff[STATEMENT_CALLS] : 0;
+		}
+		if (!set->lazy)
+			update_str(&r->name, PQgetvalue(pgresult, i, 1));
+		r->generation = set->generation;
+	}
+
+	/* only go by what was not seen if the query worked */
+	if (ok)
+	{
+		rel_evict(set, rows);
+
+		/* the monotonic clock so that setting the time fakes no rates */
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		value = now.tv_sec * 1000000LL + now.tv_nsec / 1000;
+		set->interval = set->primed ? (value - set->usec) / 1000000.0 : 0;
+		set->usec = value;
+		set->primed = 1;
+	}
+	if (pgresult != NULL)
+		PQclear(pgresult);
+
+	si->p_active = rows;
+	si->p_total = rows;
+	si->procstates = relstates;
+
+	/* put the ones that are going to be shown in order */
+	current = set;
+	current->index = 0;
+	sort_field = rel_field(set, compare_index >= 0 && order_names != NULL ?
+						   order_names[compare_index] : NULL);
+	if (sort_field >= 0)
+		key_sort(set->table, rows, sizeof(int), sel->topn, rel_key,
+				 rel_compare);
+	else
+		partial_sort(set->table, rows, sizeof(int), sel->topn, rel_compare);
+
+	if (set->lazy && rows > 0 && conninfo->connection != NULL)
+		rel_get_texts(set, conninfo->connection,
+					  sel->topn < rows ? sel->topn : rows);
+	disconnect_from_db(conninfo);
+
+	return (caddr_t) 0;
+}
+
+/*
+ * Note that a refresh read none of the relations or statements, so the
+ * next one of them to be read starts over.
+ */
+void
+forget_relation_info(void)
+{
+	last_read = NULL;
+}
+
+/* How much "r" went up by each second, or its total. */
+static double
+rel_rate(struct relstat *r, int field)
+{
+	if (mode_stats != STATS_DIFF)
+		return r->value[field];
+	return current->interval > 0 ? r->diff[field] / current->interval : 0;
+}
+
+char *
+format_next_relation(caddr_t handle)
+{
+	static char fmt[MAX_COLS];	/* static area where result is built */
+	struct relstat *r = &current->rels[current->table[current->index++]];
+	long long  *v = REL_VALUES(r);
+
+	if (current == &statements)
+		snprintf(fmt, sizeof(fmt),
+				 "%7.1f %7.0f %7.2f %7.1f %7lld %7lld %7lld %s",
+				 rel_rate(r, STATEMENT_CALLS),
+				 v[STATEMENT_TIME] / 1000.0, v[STATEMENT_MEAN] / 1000.0,
+				 rel_rate(r, STATEMENT_ROWS), v[STATEMENT_HITS],
+				 v[STATEMENT_READS], v[STATEMENT_TEMP],
+				 r->name != NULL ? r->name : "");
+	else if (current == &tables)
+		snprintf(fmt, sizeof(fmt),
+				 "%7lld %7lld %7lld %7lld %7lld %7lld %7lld %7lld %7lld %s",
+				 v[0], v[1], v[2], v[3], v[4], v[5], v[6], v[7], v[8],
+				 r->name);
+	else
+		snprintf(fmt, sizeof(fmt), "%7lld %7lld %7lld %7lld %7lld %s",
+				 v[0], v[1], v[2], v[3], v[4], r->name);
+
+	return (fmt);
+}
+
+void
+output_next_relation(caddr_t handle)
+{
+	struct relstat *r = &current->rels[current->table[current->index++]];
+	char		name[64];
+	int			j;
+
+	output_int(current->id_name, r->id);
+	output_str(current->name_name, r->name);
+	for (j = 0; j < current->nfields; j++)
+		output_int(current->fields[j].name, r->value[j]);
+	for (j = 0; j < current->nfields; j++)
+	{
+		snprintf(name, sizeof(name), "%s_diff", current->fields[j].name);
+		output_int(name, r->diff[j]);
+	}
+}
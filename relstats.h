@@ -0,0 +1,23 @@
+/*
+ * Interface to the table, index and statement statistics displays.
+ *
+ *	Copyright (c) 2007-2019, Mark Wong
+ */
+
+#ifndef _RELSTATS_H_
+#define _RELSTATS_H_
+
+#include "machine.h"
+
+caddr_t		get_relation_info(struct system_info *, struct process_select *,
+							  int, char **, struct pg_conninfo_ctx *, int);
+void		forget_relation_info(void);
+char	   *format_next_relation(caddr_t);
+void		output_next_relation(caddr_t);
+int			order_applies(struct statics *, int, int);
+
+extern char fmt_header_tables[];
+extern char fmt_header_indexes[];
+extern char fmt_header_statements[];
+
+#endif							/* _RELSTATS_H_ */
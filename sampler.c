@@ -0,0 +1,607 @@
+/*
+ *	Top users/processes display for Unix
+ *
+ *	Copyright (c) 2007-2019, Mark Wong
+ */
+
+/*
+ *	This file contains the collector that samples the server for each
+ *	refresh.  In interactive mode it runs in a thread of its own, so that a
+ *	slow server or a long sort never holds up the keyboard or a redraw.
+ *	Each sample goes into a snapshot that is published once it is
+ *	complete: there are three of them, so the collector always has one to
+ *	fill that is neither the latest one nor the one on the screen.
+ */
+
+#include "os.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "metrics.h"
+#include "output.h"
+#include "pg_top.h"
+#include "record.h"
+#include "relstats.h"
+#include "remote.h"
+#include "sampler.h"
+#include "utils.h"
+
+#define NSNAPSHOTS	3
+
+extern char *myname;
+extern int	max_topn;
+
+/* What the screen currently wants sampled. */
+struct sampler_settings
+{
+	unsigned long serial;		/* bumped on every change */
+	double		delay;
+	int			mode;
+	int			mode_remote;
+	int			order_index;
+	int			lines;			/* process lines to format */
+	int			backends;		/* keep every process for the recorder */
+	struct process_select ps;
+};
+
+static struct
+{
+	int			running;
+	pthread_t	thread;
+	pthread_mutex_t lock;
+	pthread_cond_t wakeup;		/* settings changed */
+	pthread_cond_t published;	/* a new snapshot is out */
+	int			kick;			/* sample now rather than when due */
+	int			notify[2];		/* pipe the UI polls for new snapshots */
+	struct sampler_settings settings;
+	struct pg_conninfo_ctx *conninfo;
+	char	  **order_names;	/* the sort orders order_index counts in */
+	struct snapshot slots[NSNAPSHOTS];
+	int			latest;			/* most recently published, or -1 */
+	int			reading;		/* the one on the screen, or -1 */
+
+	/* sizes of the arrays in system_info */
+	int			nprocstates;
+	int			ncpustates;
+	int			nmemory;
+	int			nswap;
+}			sampler;
+
+/*
+ * Whether there is a machine module routine to go through the processes of
+ * "mode" and pick out what the recorder keeps of them.
+ */
+static int
+has_backends(int mode, int mode_remote)
+{
+	if (mode != MODE_PROCESSES && mode != MODE_IO_STATS)
+		return 0;
+#ifdef __linux__
+	return 1;
+#else
+	return mode_remote;
+#endif							/* __linux__ */
+}
+
+static int
+name_count(char **pp)
+{
+	int			cnt = 0;
+
+	if (pp != NULL)
+		while (*pp++ != NULL)
+			cnt++;
+	return cnt;
+}
+
+/* Size the snapshots for what the machine module reports. */
+static void
+sampler_init(struct pg_top_context *pgtctx)
+{
+	static int	initialized = 0;
+	struct snapshot *snap;
+	int			i;
+
+	if (initialized)
+		return;
+	initialized = 1;
+
+	sampler.nprocstates = name_count(pgtctx->statics.procstate_names);
+	sampler.ncpustates = name_count(pgtctx->statics.cpustate_names);
+	sampler.nmemory = name_count(pgtctx->statics.memory_names);
+	sampler.nswap = name_count(pgtctx->statics.swap_names);
+
+	for (i = 0; i < NSNAPSHOTS; i++)
+	{
+		snap = &sampler.slots[i];
+		snap->procstates = calloc(sampler.nprocstates + 1, sizeof(int));
+		snap->cpustates = calloc(sampler.ncpustates + 1, sizeof(int64_t));
+		snap->memory = calloc(sampler.nmemory + 1, sizeof(long));
+		snap->swap = calloc(sampler.nswap + 1, sizeof(long));
+		if (snap->procstates == NULL || snap->cpustates == NULL ||
+			snap->memory == NULL || snap->swap == NULL)
+		{
+			fprintf(stderr, "%s: can't allocate sufficient memory\n", myname);
+			exit(4);
+		}
+	}
+
+	sampler.conninfo = &pgtctx->conninfo;
+	sampler.order_names = pgtctx->statics.order_names;
+	sampler.latest = -1;
+	sampler.reading = -1;
+}
+
+static void
+settings_copy(struct sampler_settings *settings,
+			  struct pg_top_context *pgtctx)
+{
+	settings->delay = pgtctx->delay;
+	settings->mode = pgtctx->mode;
+	settings->mode_remote = pgtctx->mode_remote;
+	/* an order kept from another display leaves this one in its own */
+	settings->order_index = order_applies(&pgtctx->statics, pgtctx->mode,
+										  pgtctx->order_index) ?
+		pgtctx->order_index : -1;
+	settings->ps = pgtctx->ps;
+	settings->backends = 0;
+
+	/*
+	 * Only the processes that fit on the screen need to be put in order,
+	 * unless every one of them is going to be printed.  Nothing is drawn
+	 * when they are being written out, so every one of them is.
+	 */
+	if (output_format != OUTPUT_TEXT)
+	{
+		settings->ps.topn = Largest;
+		settings->lines = 0;
+	}
+	else if (metrics_serving())
+	{
+		settings->ps.topn = METRICS_TOP;
+		settings->lines = 0;
+	}
+	else if (recording() &&
+			 !has_backends(pgtctx->mode, pgtctx->mode_remote))
+	{
+		/* every line goes into the recording, not just those shown */
+		settings->ps.topn = Largest;
+		settings->lines = Largest;
+	}
+	else if (pgtctx->topn == Infinity)
+	{
+		settings->ps.topn = Largest;
+		settings->lines = max_topn;
+	}
+	else
+	{
+		settings->ps.topn = pgtctx->topn < max_topn ? pgtctx->topn : max_topn;
+		settings->lines = settings->ps.topn;
+	}
+
+	/* the recorder sorts and formats the processes again on replay */
+	if (recording() && has_backends(pgtctx->mode, pgtctx->mode_remote))
+		settings->backends = 1;
+}
+
+/* Copy "src" to "*dst" and move past it, returning where it went. */
+static char *
+copy_name(char **dst, const char *src)
+{
+	char	   *start = *dst;
+
+	if (src == NULL)
+		src = "";
+	strcpy(start, src);
+	*dst += strlen(src) + 1;
+	return start;
+}
+
+/*
+ * Keep what the recorder needs of every process in "snap".  The names are
+ * copied, the collector may change or free them before it gets to them.
+ */
+static void
+snapshot_backends(struct snapshot *snap, caddr_t processes,
+				  void (*next) (caddr_t, struct backend_stats *))
+{
+	struct backend_stats *b;
+	size_t		len = 0;
+	char	   *s;
+	int			n = snap->system_info.P_ACTIVE;
+	int			i;
+
+	if (n > snap->backends_size)
+	{
+		if ((b = realloc(snap->backends, n * sizeof(*b))) == NULL)
+			return;
+		snap->backends = b;
+		snap->backends_size = n;
+	}
+	for (i = 0; i < n; i++)
+	{
+		b = &snap->backends[i];
+		next(processes, b);
+		len += (b->usename != NULL ? strlen(b->usename) : 0) +
+			(b->datname != NULL ? strlen(b->datname) : 0) +
+			(b->command != NULL ? strlen(b->command) : 0) + 3;
+	}
+
+	if (len > snap->strings_size)
+	{
+		if ((s = realloc(snap->strings, len)) == NULL)
+			return;
+		snap->strings = s;
+		snap->strings_size = len;
+	}
+	s = snap->strings;
+	for (i = 0; i < n; i++)
+	{
+		b = &snap->backends[i];
+		b->usename = copy_name(&s, b->usename);
+		b->datname = copy_name(&s, b->datname);
+		b->command = copy_name(&s, b->command);
+	}
+	snap->nbackends = n;
+}
+
+/* Collect the statistics for one refresh into "snap". */
+static void
+sample(struct snapshot *snap, struct sampler_settings *settings)
+{
+	caddr_t		processes;
+	char	   *(*format_next) (caddr_t);
+	void		(*output_next) (caddr_t);
+	char	   *line;
+	struct timeval now;
+	int			n;
+	int			i;
+
+	if (settings->mode_remote == 0)
+		get_system_info(&snap->system_info);
+	else
+		get_system_info_r(&snap->system_info, &settings->ps, settings->mode,
+						  sampler.conninfo);
+
+	if (settings->mode == MODE_TABLE_STATS ||
+		settings->mode == MODE_INDEX_STATS ||
+		settings->mode == MODE_STATEMENTS)
+		processes = get_relation_info(&snap->system_info, &settings->ps,
+									  settings->order_index,
+									  sampler.order_names, sampler.conninfo,
+									  settings->mode);
+	else
+	{
+		/* the relation displays start over when they are gone back to */
+		forget_relation_info();
+
+		if (settings->mode_remote == 0)
+		{
+#ifdef __linux__
+			processes = get_process_info(&snap->system_info, &settings->ps,
+										 settings->order_index,
+										 sampler.conninfo, settings->mode);
+#else
+			processes = get_process_info(&snap->system_info, &settings->ps,
+										 settings->order_index,
+										 sampler.conninfo);
+#endif							/* __linux__ */
+		}
+		else
+			processes = get_process_info_r(&snap->system_info,
+										   &settings->ps,
+										   settings->order_index,
+										   sampler.conninfo, settings->mode);
+	}
+	snap->round_trips = pg_round_trips();
+
+	/* the machine module reuses its arrays, keep copies of them */
+	if (snap->system_info.procstates != NULL)
+		memcpy(snap->procstates, snap->system_info.procstates,
+			   sampler.nprocstates * sizeof(int));
+	if (snap->system_info.cpustates != NULL)
+		memcpy(snap->cpustates, snap->system_info.cpustates,
+			   sampler.ncpustates * sizeof(int64_t));
+	if (snap->system_info.memory != NULL)
+		memcpy(snap->memory, snap->system_info.memory,
+			   sampler.nmemory * sizeof(long));
+	if (snap->system_info.swap != NULL)
+		memcpy(snap->swap, snap->system_info.swap,
+			   sampler.nswap * sizeof(long));
+	snap->system_info.procstates = snap->procstates;
+	snap->system_info.cpustates = snap->cpustates;
+	snap->system_info.memory = snap->memory;
+	snap->system_info.swap = snap->swap;
+
+	gettimeofday(&now, NULL);
+	snap->usec = now.tv_sec * 1000000LL + now.tv_usec;
+
+	switch (settings->mode)
+	{
+#ifdef __linux__
+		case MODE_IO_STATS:
+			format_next = settings->mode_remote == 0 ?
+				format_next_io : format_next_io_r;
+			output_next = settings->mode_remote == 0 ?
+				output_next_io : output_next_io_r;
+			break;
+#endif							/* __linux__ */
+		case MODE_TABLE_STATS:
+		case MODE_INDEX_STATS:
+		case MODE_STATEMENTS:
+			format_next = format_next_relation;
+			output_next = output_next_relation;
+			break;
+		case MODE_REPLICATION:
+			format_next = settings->mode_remote == 0 ?
+				format_next_replication : format_next_replication_r;
+#ifdef __linux__
+			output_next = settings->mode_remote == 0 ?
+				output_next_replication : output_next_replication_r;
+#else
+			output_next = output_next_replication_r;
+#endif							/* __linux__ */
+			break;
+		case MODE_PROCESSES:
+		default:
+			format_next = settings->mode_remote == 0 ?
+				format_next_process : format_next_process_r;
+#ifdef __linux__
+			output_next = settings->mode_remote == 0 ?
+				output_next_process : output_next_process_r;
+#else
+			output_next = output_next_process_r;
+#endif							/* __linux__ */
+	}
+
+	/* sum up every process for the metrics */
+	if (metrics_serving())
+	{
+#ifdef __linux__
+		metrics_update(snap, processes, settings->mode_remote == 0 ?
+					   metrics_next_process : metrics_next_process_r);
+#else
+		metrics_update(snap, processes, metrics_next_process_r);
+#endif							/* __linux__ */
+	}
+
+	/* write out every process rather than formatting any */
+	if (output_format != OUTPUT_TEXT)
+	{
+		for (i = 0; i < snap->system_info.P_ACTIVE; i++)
+		{
+			output_row_begin(snap->usec);
+			output_next(processes);
+			output_row_end();
+		}
+	}
+
+	/* format the lines that can be shown */
+	n = snap->system_info.P_ACTIVE;
+	if (n > settings->lines)
+		n = settings->lines;
+	if (n < 0)
+		n = 0;
+	if (n > snap->lines_size)
+	{
+		line = realloc(snap->lines, (size_t) n * MAX_COLS);
+		if (line == NULL)
+			n = snap->lines_size;
+		else
+		{
+			snap->lines = line;
+			snap->lines_size = n;
+		}
+	}
+	for (i = 0; i < n; i++)
+	{
+		line = snap->lines + (size_t) i * MAX_COLS;
+		strncpy(line, format_next(processes), MAX_COLS - 1);
+		line[MAX_COLS - 1] = '\0';
+	}
+	snap->nlines = n;
+
+	snap->nbackends = -1;
+	if (settings->backends && settings->mode_remote)
+	{
+		rewind_process_info_r(processes);
+		snapshot_backends(snap, processes, metrics_next_process_r);
+	}
+#ifdef __linux__
+	else if (settings->backends)
+	{
+		rewind_process_info(processes);
+		snapshot_backends(snap, processes, metrics_next_process);
+	}
+#endif							/* __linux__ */
+
+	snap->serial = settings->serial;
+	snap->mode = settings->mode;
+	snap->mode_remote = settings->mode_remote;
+}
+
+static void
+timespec_add(struct timespec *ts, double delay)
+{
+	ts->tv_sec += (time_t) delay;
+	ts->tv_nsec += (long) ((delay - (time_t) delay) * 1e9);
+	if (ts->tv_nsec >= 1000000000L)
+	{
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000L;
+	}
+}
+
+/*
+ * The collector thread.  Samples are taken on a fixed cadence, so the time
+ * spent collecting does not push the next one back, and straight away when
+ * the screen asks for something different.
+ */
+static void *
+sampler_main(void *arg)
+{
+	struct sampler_settings settings;
+	struct timespec next;
+	struct timespec now;
+	int			slot;
+
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	for (;;)
+	{
+		pthread_mutex_lock(&sampler.lock);
+		settings = sampler.settings;
+		sampler.kick = 0;
+		for (slot = 0; slot == sampler.latest || slot == sampler.reading;
+			 slot++)
+			;
+		pthread_mutex_unlock(&sampler.lock);
+
+		sample(&sampler.slots[slot], &settings);
+
+		pthread_mutex_lock(&sampler.lock);
+		sampler.latest = slot;
+		pthread_cond_broadcast(&sampler.published);
+		pthread_mutex_unlock(&sampler.lock);
+		(void) write(sampler.notify[1], "", 1);
+
+		/* wait for the next sample to be due, dropping any that were missed */
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (settings.delay > 0)
+		{
+			do
+				timespec_add(&next, settings.delay);
+			while (next.tv_sec < now.tv_sec ||
+				   (next.tv_sec == now.tv_sec && next.tv_nsec <= now.tv_nsec));
+		}
+
+		pthread_mutex_lock(&sampler.lock);
+		if (settings.delay > 0)
+			while (!sampler.kick &&
+				   pthread_cond_timedwait(&sampler.wakeup, &sampler.lock,
+										  &next) != ETIMEDOUT)
+				;
+		if (sampler.kick || settings.delay == 0)
+			clock_gettime(CLOCK_MONOTONIC, &next);
+		pthread_mutex_unlock(&sampler.lock);
+	}
+
+	/* NOTREACHED */
+	return NULL;
+}
+
+/*
+ * Start sampling in the background.  Returns a descriptor that becomes
+ * readable whenever a new snapshot is published, or -1 if the collector
+ * could not be started and the caller has to sample for itself.
+ */
+int
+sampler_start(struct pg_top_context *pgtctx)
+{
+	pthread_condattr_t attr;
+	sigset_t	all;
+	sigset_t	old;
+	int			i;
+
+	sampler_init(pgtctx);
+	settings_copy(&sampler.settings, pgtctx);
+
+	if (pipe(sampler.notify) == -1)
+		return -1;
+	for (i = 0; i < 2; i++)
+	{
+		fcntl(sampler.notify[i], F_SETFL,
+			  fcntl(sampler.notify[i], F_GETFL) | O_NONBLOCK);
+		fcntl(sampler.notify[i], F_SETFD, FD_CLOEXEC);
+	}
+
+	pthread_mutex_init(&sampler.lock, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&sampler.wakeup, &attr);
+	pthread_condattr_destroy(&attr);
+	pthread_cond_init(&sampler.published, NULL);
+
+	/* signals are for the thread looking after the terminal */
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	i = pthread_create(&sampler.thread, NULL, sampler_main, NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (i != 0)
+	{
+		close(sampler.notify[0]);
+		close(sampler.notify[1]);
+		return -1;
+	}
+
+	sampler.running = 1;
+	return sampler.notify[0];
+}
+
+int
+sampler_running(void)
+{
+	return sampler.running;
+}
+
+/*
+ * Tell the collector what the screen wants now and have it take a sample
+ * straight away.
+ */
+void
+sampler_request(struct pg_top_context *pgtctx)
+{
+	pthread_mutex_lock(&sampler.lock);
+	settings_copy(&sampler.settings, pgtctx);
+	sampler.settings.serial++;
+	sampler.kick = 1;
+	pthread_cond_signal(&sampler.wakeup);
+	pthread_mutex_unlock(&sampler.lock);
+}
+
+/* Returns Yes if there is a snapshot taken with the current settings. */
+int
+sampler_ready(void)
+{
+	int			ready;
+
+	pthread_mutex_lock(&sampler.lock);
+	ready = sampler.latest != -1 &&
+		sampler.slots[sampler.latest].serial == sampler.settings.serial;
+	pthread_mutex_unlock(&sampler.lock);
+	return ready;
+}
+
+/*
+ * Return the latest snapshot, waiting for one taken with the current
+ * settings if need be.  It stays untouched until the next call.
+ */
+struct snapshot *
+sampler_latest(void)
+{
+	pthread_mutex_lock(&sampler.lock);
+	while (sampler.latest == -1 ||
+		   sampler.slots[sampler.latest].serial != sampler.settings.serial)
+		pthread_cond_wait(&sampler.published, &sampler.lock);
+	sampler.reading = sampler.latest;
+	pthread_mutex_unlock(&sampler.lock);
+
+	return &sampler.slots[sampler.reading];
+}
+
+/* Take a sample in the calling thread, for when there is no collector. */
+struct snapshot *
+sampler_sample(struct pg_top_context *pgtctx)
+{
+	struct sampler_settings settings;
+
+	sampler_init(pgtctx);
+	memset(&settings, 0, sizeof(settings));
+	settings_copy(&settings, pgtctx);
+	sample(&sampler.slots[0], &settings);
+	return &sampler.slots[0];
+}
@@ -0,0 +1,50 @@
+/*
+ * Interface to the collector thread that samples the server in the
+ * background while the screen is drawn from its latest snapshot.
+ *
+ *	Copyright (c) 2007-2019, Mark Wong
+ */
+
+#ifndef _SAMPLER_H_
+#define _SAMPLER_H_
+
+#include "pg_top.h"
+
+/*
+ * Everything needed to draw one refresh.  Once published a snapshot is not
+ * changed until the screen has moved on to a newer one.
+ */
+struct snapshot
+{
+	unsigned long serial;		/* settings it was taken with */
+	long long	usec;			/* when it was taken */
+	int			mode;
+	int			mode_remote;
+	struct system_info system_info;
+	int			round_trips;
+	int			nlines;			/* formatted process lines */
+	char	   *lines;			/* nlines of MAX_COLS each */
+	int			lines_size;		/* lines there is room for */
+
+	/* every process, when they are being recorded, -1 if not */
+	int			nbackends;
+	struct backend_stats *backends;
+	int			backends_size;
+	char	   *strings;		/* what their names point to */
+	size_t		strings_size;
+
+	/* copies of the arrays system_info points to */
+	int		   *procstates;
+	int64_t    *cpustates;
+	long	   *memory;
+	long	   *swap;
+};
+
+int			sampler_start(struct pg_top_context *);
+int			sampler_running(void);
+void		sampler_request(struct pg_top_context *);
+int			sampler_ready(void);
+struct snapshot *sampler_latest(void);
+struct snapshot *sampler_sample(struct pg_top_context *);
+
+#endif							/* _SAMPLER_H_ */
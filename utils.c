@@ -15,6 +15,8 @@
 
 #include "os.h"
 #include <ctype.h>
+#include <limits.h>
+#include <unistd.h>
 #ifdef HAVE_STDARG_H
 #include <stdarg.h>
 #else
@@ -23,6 +25,17 @@
 #include "pg_top.h"
 #include "utils.h"
 
+/*
+ * The formatting routines below build their results in static areas.  The
+ * collector thread formats the process lines while the display formats the
+ * summary, so each thread gets areas of its own.
+ */
+#if defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L
+#define THREAD_LOCAL _Thread_local
+#else
+#define THREAD_LOCAL __thread
+#endif
+
 static int
 alldigits(char *s)
 {
@@ -64,6 +77,27 @@ atoiwi(char *str)
 	return (0);
 }
 
+/*
+ *	atodelay - convert a delay in seconds, which may have a fractional part,
+ *		   to a double.  Returns Invalid if the string is not a
+ *		   non-negative number or is too small for the current user.
+ */
+
+double
+atodelay(char *str)
+{
+	char	   *end;
+	double		delay;
+
+	delay = strtod(str, &end);
+	if (end == str || *end != '\0' || !(delay >= 0) || delay > INT_MAX ||
+		(delay < Min_DELAY && (delay != 0 || getuid() != 0)))
+	{
+		return (Invalid);
+	}
+	return (delay);
+}
+
 /*
  *	itoa - convert integer (decimal) to ascii string for positive numbers
  *		   only (we don't bother with negative numbers since we know we
@@ -79,7 +113,7 @@ char *
 itoa(int val)
 {
 	register char *ptr;
-	static char buffer[16];		/* result is built here */
+	static THREAD_LOCAL char buffer[16];	/* result is built here */
 
 	/*
 	 * 16 is sufficient since the largest number we will ever convert will be
@@ -111,7 +145,7 @@ char *
 itoa7(uid_t val)
 {
 	register char *ptr;
-	static char buffer[16];		/* result is built here */
+	static THREAD_LOCAL char buffer[16];	/* result is built here */
 
 	/*
 	 * 16 is sufficient since the largest number we will ever convert will be
@@ -473,7 +507,7 @@ errmsg(int errnum)
 char *
 format_percent(double v)
 {
-	static char result[10];
+	static THREAD_LOCAL char result[10];
 
 	/* enumerate the possibilities */
 	if (v < 0 || v >= 100000.)
@@ -512,7 +546,7 @@ format_percent(double v)
 char *
 format_time(long seconds)
 {
-	static char result[10];
+	static THREAD_LOCAL char result[10];
 
 	/* sanity protection */
 	if (seconds < 0 || seconds > (99999l * 360l))
@@ -554,8 +588,8 @@ format_time(long seconds)
 char *
 format_b(long long amt)
 {
-	static char retarray[NUM_STRINGS][16];
-	static int	index = 0;
+	static THREAD_LOCAL char retarray[NUM_STRINGS][16];
+	static THREAD_LOCAL int index = 0;
 	register char *ret;
 	register char tag = 'B';
 
@@ -609,8 +643,8 @@ format_b(long long amt)
 char *
 format_k(long amt)
 {
-	static char retarray[NUM_STRINGS][16];
-	static int	index = 0;
+	static THREAD_LOCAL char retarray[NUM_STRINGS][16];
+	static THREAD_LOCAL int index = 0;
 	register char *ret;
 	register char tag = 'K';
 
@@ -633,6 +667,271 @@ format_k(long amt)
 	return (ret);
 }
 
+static void
+swap_elements(char *a, char *b, size_t size)
+{
+	char		tmp;
+
+	while (size-- > 0)
+	{
+		tmp = *a;
+		*a++ = *b;
+		*b++ = tmp;
+	}
+}
+
+/*
+ *	partial_sort(base, nmemb, size, k, compar) - like qsort, but only
+ *	guarantees that the first "k" elements are the smallest ones and in
+ *	order.  The rest are left in no particular order.
+ *
+ *	The first "k" are picked out with a quickselect that partitions three
+ *	ways, so runs of equal keys (lots of idle processes at 0% cpu) don't
+ *	slow it down, and falls back to sorting everything if the pivots keep
+ *	turning out badly.
+ */
+
+void
+partial_sort(void *base, size_t nmemb, size_t size, size_t k,
+			 int (*compar) (const void *, const void *))
+{
+	char	   *a = (char *) base;
+	size_t		left = 0;
+	size_t		right = nmemb - 1;
+	size_t		target = k - 1;
+	size_t		mid,
+				lt,
+				gt,
+				i;
+	int			depth;
+	int			c;
+
+#define ELEMENT(n) (a + (n) * size)
+
+	if (k == 0 || nmemb == 0)
+		return;
+	if (k >= nmemb)
+	{
+		qsort(base, nmemb, size, compar);
+		return;
+	}
+
+	for (depth = 0, i = nmemb; i > 0; i >>= 1)
+		depth += 2;
+
+	while (left < right)
+	{
+		if (depth-- == 0)
+		{
+			qsort(ELEMENT(left), right - left + 1, size, compar);
+			break;
+		}
+
+		/* use the median of three as the pivot, and move it to the left */
+		mid = left + (right - left) / 2;
+		if (compar(ELEMENT(mid), ELEMENT(left)) < 0)
+			swap_elements(ELEMENT(mid), ELEMENT(left), size);
+		if (compar(ELEMENT(right), ELEMENT(left)) < 0)
+			swap_elements(ELEMENT(right), ELEMENT(left), size);
+		if (compar(ELEMENT(right), ELEMENT(mid)) < 0)
+			swap_elements(ELEMENT(right), ELEMENT(mid), size);
+		swap_elements(ELEMENT(mid), ELEMENT(left), size);
+
+		/*
+		 * Partition into less than, equal to and greater than the pivot.
+		 * Everything from lt up to i - 1 is equal to the pivot, so a[lt]
+		 * stands in for it and no copy is needed.
+		 */
+		lt = left;
+		i = left + 1;
+		gt = right;
+		while (i <= gt)
+		{
+			c = compar(ELEMENT(i), ELEMENT(lt));
+			if (c < 0)
+				swap_elements(ELEMENT(lt++), ELEMENT(i++), size);
+			else if (c > 0)
+				swap_elements(ELEMENT(i), ELEMENT(gt--), size);
+			else
+				i++;
+		}
+
+		if (target < lt)
+			right = lt - 1;
+		else if (target > gt)
+			left = gt + 1;
+		else
+			break;
+	}
+
+#undef ELEMENT
+
+	qsort(base, k, size, compar);
+}
+
+/*
+ *	sort_key_int(v), sort_key_double(v) - map a value to an unsigned key that
+ *	orders the same way, so rows can be sorted with key_sort.  Take the
+ *	complement of the key to sort in descending order.
+ */
+
+uint64_t
+sort_key_int(long long v)
+{
+	return (uint64_t) v ^ ((uint64_t) 1 << 63);
+}
+
+uint64_t
+sort_key_double(double v)
+{
+	uint64_t	bits;
+
+	memcpy(&bits, &v, sizeof(bits));
+	if (bits & ((uint64_t) 1 << 63))
+		return ~bits;
+	return bits | ((uint64_t) 1 << 63);
+}
+
+struct sort_key
+{
+	uint64_t	hi;				/* primary key */
+	uint64_t	lo;				/* secondary key */
+	size_t		index;
+};
+
+/* what key_sort is sorting, for compare_sort_keys */
+static char *key_sort_base;
+static size_t key_sort_size;
+static int	(*key_sort_compar) (const void *, const void *);
+
+static int
+compare_sort_keys(const void *v1, const void *v2)
+{
+	const struct sort_key *k1 = (const struct sort_key *) v1;
+	const struct sort_key *k2 = (const struct sort_key *) v2;
+
+	return key_sort_compar(key_sort_base + k1->index * key_sort_size,
+						   key_sort_base + k2->index * key_sort_size);
+}
+
+/*
+ *	key_sort(base, nmemb, size, k, getkey, compar) - does the same as
+ *	partial_sort, but much faster on large arrays.  "getkey" packs the first
+ *	two sort keys of an element into a pair of integers, as produced by
+ *	sort_key_int or sort_key_double.  The pairs are radix sorted, and
+ *	"compar" is only used to break ties between elements whose pairs are
+ *	equal.
+ */
+
+void
+key_sort(void *base, size_t nmemb, size_t size, size_t k,
+		 void (*getkey) (const void *, uint64_t *, uint64_t *),
+		 int (*compar) (const void *, const void *))
+{
+	static struct sort_key *keys = NULL;
+	static struct sort_key *tmp = NULL;
+	static char *scratch = NULL;
+	static size_t nkeys = 0;
+	static size_t nscratch = 0;
+
+	struct sort_key *swap;
+	size_t		count[256];
+	size_t		offset;
+	size_t		i,
+				j;
+	uint64_t	word;
+	int			pass;
+	int			shift;
+
+	if (k == 0 || nmemb == 0)
+		return;
+
+	if (nmemb > nkeys)
+	{
+		if ((swap = realloc(keys, nmemb * sizeof(struct sort_key))) == NULL)
+			goto fallback;
+		keys = swap;
+		if ((swap = realloc(tmp, nmemb * sizeof(struct sort_key))) == NULL)
+			goto fallback;
+		tmp = swap;
+		nkeys = nmemb;
+	}
+	if (nmemb * size > nscratch)
+	{
+		char	   *p;
+
+		if ((p = realloc(scratch, nmemb * size)) == NULL)
+			goto fallback;
+		scratch = p;
+		nscratch = nmemb * size;
+	}
+
+	for (i = 0; i < nmemb; i++)
+	{
+		getkey((char *) base + i * size, &keys[i].hi, &keys[i].lo);
+		keys[i].index = i;
+	}
+
+	/*
+	 * Least significant byte first: eight passes over the secondary key,
+	 * then eight over the primary.  Passes where every key has the same
+	 * byte, such as the top bytes of small counters, are skipped.
+	 */
+	for (pass = 0; pass < 16; pass++)
+	{
+		shift = (pass % 8) * 8;
+
+		memzero(count, sizeof(count));
+		for (i = 0; i < nmemb; i++)
+		{
+			word = pass < 8 ? keys[i].lo : keys[i].hi;
+			count[(word >> shift) & 0xff]++;
+		}
+		word = pass < 8 ? keys[0].lo : keys[0].hi;
+		if (count[(word >> shift) & 0xff] == nmemb)
+			continue;
+
+		for (offset = 0, j = 0; j < 256; j++)
+		{
+			size_t		c = count[j];
+
+			count[j] = offset;
+			offset += c;
+		}
+		for (i = 0; i < nmemb; i++)
+		{
+			word = pass < 8 ? keys[i].lo : keys[i].hi;
+			tmp[count[(word >> shift) & 0xff]++] = keys[i];
+		}
+		swap = keys;
+		keys = tmp;
+		tmp = swap;
+	}
+
+	/* break ties, but only where it can change the first k */
+	key_sort_base = (char *) base;
+	key_sort_size = size;
+	key_sort_compar = compar;
+	for (i = 0; i < nmemb && i < k; i = j)
+	{
+		for (j = i + 1; j < nmemb && keys[j].hi == keys[i].hi &&
+			 keys[j].lo == keys[i].lo; j++)
+			;
+		if (j - i > 1)
+			partial_sort(&keys[i], j - i, sizeof(struct sort_key), k - i,
+						 compare_sort_keys);
+	}
+
+	/* put the elements in their new order */
+	for (i = 0; i < nmemb; i++)
+		memcpy(scratch + i * size, (char *) base + keys[i].index * size, size);
+	memcpy(base, scratch, nmemb * size);
+	return;
+
+fallback:
+	partial_sort(base, nmemb, size, k, compar);
+}
+
 static int	debug_on = 0;
 
 #ifdef DEBUG
@@ -659,7 +958,7 @@ xdprintf(char *fmt,...)
 	if (debug_on)
 	{
 		vfprintf(debugfile, fmt, argp);
-		fflush(stdout);
+		fflush(debugfile);
 	}
 
 	va_end(argp);
@@ -15,6 +15,7 @@
 /* prototypes for functions found in utils.c */
 
 int			atoiwi(char *);
+double		atodelay(char *);
 char	   *itoa(int);
 char	   *itoa7(uid_t);
 int			digits(int);
@@ -30,6 +31,13 @@ char	   *format_time(long);
 char	   *format_b(long long);
 char	   *format_k(long);
 char	   *string_list(char **);
+void		partial_sort(void *, size_t, size_t, size_t,
+						 int (*) (const void *, const void *));
+uint64_t	sort_key_int(long long);
+uint64_t	sort_key_double(double);
+void		key_sort(void *, size_t, size_t, size_t,
+					 void (*) (const void *, uint64_t *, uint64_t *),
+					 int (*) (const void *, const void *));
 void		debug_set(int);
 
 #ifdef DEBUG